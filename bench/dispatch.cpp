@@ -0,0 +1,109 @@
+#include <benchmark/benchmark.h>
+
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "vm.h"
+
+/**
+ * @brief Counts the branch mispredictions of this thread in user space. Stays disabled if the
+ *        kernel or the machine does not expose the hardware counter (e.g. inside some VMs).
+ */
+class BranchMisses {
+public:
+    BranchMisses() {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        m_fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+    ~BranchMisses() {
+        if (available()) {
+            close(m_fd);
+        }
+    }
+    BranchMisses(const BranchMisses&) = delete;
+    BranchMisses& operator=(const BranchMisses&) = delete;
+
+    [[nodiscard]] bool available() const { return m_fd != -1; }
+
+    void start() {
+        if (available()) {
+            ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    void stop() {
+        if (available()) {
+            ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+            std::uint64_t count = 0;
+            if (read(m_fd, &count, sizeof(count)) == sizeof(count)) {
+                m_total += count;
+            }
+        }
+    }
+
+    [[nodiscard]] double total() const { return static_cast<double>(m_total); }
+
+private:
+    int m_fd { -1 };
+    std::uint64_t m_total { 0 };
+};
+
+// the benchmark argument selects the backend, 0 is the stack and 1 the register backend
+static void runScript(benchmark::State& state, const char *source) {
+    const auto backend = static_cast<Backend>(state.range(0));
+    BranchMisses misses;
+    for (auto _ : state) {
+        VM vm;
+        misses.start();
+        auto result = vm.interpret(source, backend);
+        misses.stop();
+        benchmark::DoNotOptimize(result);
+    }
+    if (misses.available()) {
+        state.counters["branch-misses"] = benchmark::Counter(misses.total(), benchmark::Counter::kAvgIterations);
+    }
+}
+
+// The loop from test.lox scaled up: globals, string concatenation and arithmetic.
+static void BM_GlobalLoop(benchmark::State& state) {
+    runScript(state, R"(
+        var i = 0;
+        var sum = 0;
+        while (i < 100000) {
+            sum = sum + i * 2 - 1;
+            i = i + 1;
+        }
+    )");
+}
+BENCHMARK(BM_GlobalLoop)->ArgName("backend")->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+static void BM_LocalLoop(benchmark::State& state) {
+    runScript(state, R"(
+        {
+            var i = 0;
+            var sum = 0;
+            while (i < 100000) {
+                if (i == 3 or i > 10) {
+                    sum = sum + i;
+                } else {
+                    sum = sum - 1;
+                }
+                i = i + 1;
+            }
+        }
+    )");
+}
+BENCHMARK(BM_LocalLoop)->ArgName("backend")->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+BENCHMARK_MAIN();
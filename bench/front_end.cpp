@@ -0,0 +1,205 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <fmt/format.h>
+#include <optional>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include "chunk.h"
+#include "compiler.h"
+#include "globals.h"
+#include "heap.h"
+#include "scanner.h"
+#include "token_buffer.h"
+
+namespace {
+
+enum class Shape {
+    ExpressionChains,
+    Globals,
+    NestedBlocks,
+    StringLiterals,
+    Mixed,
+};
+
+constexpr std::string_view shapeName(Shape shape) {
+    switch (shape) {
+        case Shape::ExpressionChains: return "expression_chains";
+        case Shape::Globals: return "globals";
+        case Shape::NestedBlocks: return "nested_blocks";
+        case Shape::StringLiterals: return "string_literals";
+        case Shape::Mixed: return "mixed";
+    }
+    return "unknown";
+}
+
+/**
+ * @brief Writes a valid Lox program of at least `size` bytes. The same shape and size always
+ *        give the same program. Names and numbers are drawn from small pools, so larger
+ *        programs do not run into the limits on constants and globals.
+ */
+class Generator {
+public:
+    explicit Generator(Shape shape) : m_shape(shape) {}
+
+    [[nodiscard]] std::string generate(std::size_t size) {
+        // the chains start with `x`, so constant folding does not remove them
+        std::string source = "var x = 1;\n";
+        source.reserve(size + 64 * 1024);
+        for (std::size_t unit = 0; source.size() < size; ++unit) {
+            const auto shape = m_shape == Shape::Mixed ? static_cast<Shape>(unit % 4) : m_shape;
+            appendUnit(source, shape, unit);
+        }
+        return source;
+    }
+
+private:
+    // a number from a pool of a thousand different constants
+    [[nodiscard]] std::string number() {
+        const auto value = m_random() % 1000;
+        return value % 3 == 0 ? fmt::format("{}.5", value) : fmt::format("{}", value);
+    }
+
+    void appendUnit(std::string& source, Shape shape, std::size_t unit) {
+        switch (shape) {
+            case Shape::ExpressionChains: {
+                // a long left associative chain with a bit of grouping, `x + a * (b + c) - d / e + ...`
+                source += "print x";
+                for (int term = 0; term < 64; ++term) {
+                    source += " +-*/"[1 + m_random() % 4];
+                    source += ' ';
+                    if (term % 8 == 7) {
+                        source += fmt::format("({} + {})", number(), number());
+                    } else {
+                        source += number();
+                    }
+                }
+                source += ";\n";
+                break;
+            }
+            case Shape::Globals: {
+                // 4096 different globals, each reads the one defined before it
+                const auto name = unit % 4096;
+                if (m_lastGlobal) {
+                    source += fmt::format("var g{} = g{} + {};\n", name, *m_lastGlobal, number());
+                } else {
+                    source += fmt::format("var g{} = {};\n", name, number());
+                }
+                m_lastGlobal = name;
+                break;
+            }
+            case Shape::NestedBlocks: {
+                // 64 levels, each with a local that reads the one of the enclosing block
+                constexpr int depth = 64;
+                for (int level = 0; level < depth; ++level) {
+                    source += std::string(static_cast<std::size_t>(level), ' ');
+                    source += level == 0 ? fmt::format("{{ var b0 = {};\n", number()) : fmt::format("{{ var b{} = b{} * 2;\n", level, level - 1);
+                }
+                source += fmt::format("print b{};\n", depth - 1);
+                source += std::string(depth, '}');
+                source += '\n';
+                break;
+            }
+            case Shape::StringLiterals: {
+                // 16 KiB literals with a line break every 128 bytes, each one a new constant
+                source += fmt::format("var s{} = \"{}:", unit % 64, unit);
+                for (int line = 0; line < 128; ++line) {
+                    for (int byte = 0; byte < 127; ++byte) {
+                        source += static_cast<char>('a' + m_random() % 26);
+                    }
+                    source += '\n';
+                }
+                source += "\";\n";
+                break;
+            }
+            case Shape::Mixed:
+                break;
+        }
+    }
+
+private:
+    Shape m_shape;
+    std::mt19937 m_random { 20240 };
+    // mixed programs only define a global every few units
+    std::optional<std::size_t> m_lastGlobal;
+};
+
+// the sizes of the generated programs, 64 KiB to 4 MiB
+constexpr std::int64_t MIN_SIZE { 64 << 10 };
+constexpr std::int64_t MAX_SIZE { 4 << 20 };
+
+const std::string& generatedSource(Shape shape, std::int64_t size) {
+    // each benchmark runs with one size after the other, so only the last program is kept
+    thread_local Shape cachedShape {};
+    thread_local std::int64_t cachedSize { -1 };
+    thread_local std::string source;
+    if (cachedShape != shape || cachedSize != size) {
+        source = Generator(shape).generate(static_cast<std::size_t>(size));
+        cachedShape = shape;
+        cachedSize = size;
+    }
+    return source;
+}
+
+void scanGenerated(benchmark::State& state, Shape shape) {
+    const auto& source = generatedSource(shape, state.range(0));
+    std::size_t tokens = 0;
+    for (auto _ : state) {
+        Scanner scanner(source);
+        tokens = 0;
+        for (auto token = scanner.scanToken(); token.type != TokenType::Eof; token = scanner.scanToken()) {
+            benchmark::DoNotOptimize(token);
+            ++tokens;
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(source.size()));
+    state.counters["tokens"] = benchmark::Counter(static_cast<double>(tokens) * static_cast<double>(state.iterations()), benchmark::Counter::kIsRate);
+    state.SetComplexityN(static_cast<std::int64_t>(source.size()));
+}
+
+void compileGenerated(benchmark::State& state, Shape shape, Backend backend, Lexing lexing) {
+    const auto& source = generatedSource(shape, state.range(0));
+    std::size_t tokens = 0;
+    for (Scanner scanner(source); scanner.scanToken().type != TokenType::Eof;) {
+        ++tokens;
+    }
+
+    std::size_t bytecode = 0;
+    for (auto _ : state) {
+        Chunk chunk;
+        Heap heap;
+        Globals globals;
+        Compiler compiler(chunk, heap, globals, backend);
+        // lexing ahead is timed as well, the buffer is part of the front end
+        const auto compiled = lexing == Lexing::Ahead ? compiler.compile(TokenBuffer(source)) : compiler.compile(source);
+        if (not compiled) {
+            state.SkipWithError("the generated program does not compile");
+            return;
+        }
+        bytecode = chunk.bytecode().size();
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<std::int64_t>(source.size()));
+    state.counters["tokens"] = benchmark::Counter(static_cast<double>(tokens) * static_cast<double>(state.iterations()), benchmark::Counter::kIsRate);
+    state.counters["bytecode/byte"] = static_cast<double>(bytecode) / static_cast<double>(source.size());
+    state.SetComplexityN(static_cast<std::int64_t>(source.size()));
+}
+
+[[maybe_unused]] const bool registered = [] {
+    for (const auto shape : { Shape::ExpressionChains, Shape::Globals, Shape::NestedBlocks, Shape::StringLiterals, Shape::Mixed }) {
+        benchmark::RegisterBenchmark(fmt::format("BM_ScanGenerated/{}", shapeName(shape)).c_str(), scanGenerated, shape)
+            ->RangeMultiplier(4)->Range(MIN_SIZE, MAX_SIZE)->Complexity(benchmark::oN)->Unit(benchmark::kMillisecond);
+        for (const auto& [backend, name] : { std::pair { Backend::Stack, "stack" }, std::pair { Backend::Register, "register" } }) {
+            benchmark::RegisterBenchmark(fmt::format("BM_CompileGenerated/{}/{}", name, shapeName(shape)).c_str(), compileGenerated, shape, backend, Lexing::OnDemand)
+                ->RangeMultiplier(4)->Range(MIN_SIZE, MAX_SIZE)->Complexity(benchmark::oN)->Unit(benchmark::kMillisecond);
+            benchmark::RegisterBenchmark(fmt::format("BM_CompileGenerated/{}_ahead/{}", name, shapeName(shape)).c_str(), compileGenerated, shape, backend, Lexing::Ahead)
+                ->RangeMultiplier(4)->Range(MIN_SIZE, MAX_SIZE)->Complexity(benchmark::oN)->Unit(benchmark::kMillisecond);
+        }
+    }
+    return true;
+}();
+
+} // namespace
@@ -0,0 +1,98 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fmt/core.h>
+#include <string>
+#include <thread>
+
+#include "vm.h"
+
+namespace {
+
+// some global traffic, local arithmetic and a few strings, but no output
+constexpr const char *SCRIPT = R"(
+    var count = 0;
+    var text = "";
+    {
+        var i = 0;
+        var sum = 0;
+        while (i < 20000) {
+            sum = sum + i * 2 - 1;
+            if (i / 1000 == count) {
+                count = count + 1;
+                text = text + "x";
+            }
+            i = i + 1;
+        }
+    }
+)";
+
+const int MAX_THREADS = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+
+std::shared_ptr<const Program> compile(Backend backend) {
+    std::string diagnostics;
+    auto program = Program::compile(SCRIPT, diagnostics, backend, OptimizationLevel::Basic);
+    if (program == nullptr) {
+        fmt::print(stderr, "{}", diagnostics);
+        std::abort();
+    }
+    return program;
+}
+
+// the benchmark argument selects the backend, 0 is the stack and 1 the register backend
+const std::shared_ptr<const Program>& compiledScript(Backend backend) {
+    static const std::shared_ptr<const Program> programs[] = { compile(Backend::Stack), compile(Backend::Register) };
+    return programs[static_cast<int>(backend)];
+}
+
+} // namespace
+
+// Every thread is an isolate that runs the one shared program. With the code shared and
+// nothing else in common the runs per second should grow with the number of threads.
+static void BM_SharedProgram(benchmark::State& state) {
+    const auto program = compiledScript(static_cast<Backend>(state.range(0)));
+    VM vm;
+    for (auto _ : state) {
+        auto result = vm.run(program);
+        benchmark::DoNotOptimize(result);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SharedProgram)->ArgName("backend")->Arg(0)->Arg(1)->ThreadRange(1, MAX_THREADS)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+// The same work but every run compiles the script again, as VM::interpret() does.
+static void BM_CompileEveryRun(benchmark::State& state) {
+    const auto backend = static_cast<Backend>(state.range(0));
+    VM vm;
+    vm.setOptimizationLevel(OptimizationLevel::Basic);
+    for (auto _ : state) {
+        auto result = vm.interpret(SCRIPT, backend);
+        benchmark::DoNotOptimize(result);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_CompileEveryRun)->ArgName("backend")->Arg(0)->Arg(1)->ThreadRange(1, MAX_THREADS)->UseRealTime()->Unit(benchmark::kMicrosecond);
+
+// The start of an isolate: mapping its stack and running the prelude. Paid once per script
+// in batch mode, so it has to stay small next to compiling a tiny script.
+static void BM_ConstructVM(benchmark::State& state) {
+    for (auto _ : state) {
+        VM vm(static_cast<std::size_t>(state.range(0)));
+        benchmark::DoNotOptimize(vm);
+    }
+}
+BENCHMARK(BM_ConstructVM)->ArgName("stack")->Arg(256)->Arg(VM::STACK_MAX)->Unit(benchmark::kMicrosecond);
+
+// A fresh VM for a one line script, as the batch runner does for every file.
+static void BM_FreshVMPerScript(benchmark::State& state) {
+    std::string output;
+    for (auto _ : state) {
+        VM vm;
+        vm.printTo(output);
+        output.clear();
+        auto result = vm.interpret("print 1;");
+        benchmark::DoNotOptimize(result);
+    }
+}
+BENCHMARK(BM_FreshVMPerScript)->Unit(benchmark::kMicrosecond);
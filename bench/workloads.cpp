@@ -0,0 +1,178 @@
+#include <benchmark/benchmark.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <fmt/format.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "vm.h"
+
+namespace {
+
+struct Workload {
+    std::string name;
+    std::string source;
+};
+
+// a block per level, each declaring a local that reads the one of the enclosing block
+std::string nestedBlocks(int depth) {
+    std::string source = "var total = 0;\nvar round = 0;\nwhile (round < 200) {\n";
+    for (int level = 0; level < depth; ++level) {
+        source += level == 0 ? "{ var d0 = round;\n" : fmt::format("{{ var d{} = d{} + 1;\n", level, level - 1);
+    }
+    source += fmt::format("total = total + d{};\n", depth - 1);
+    source += std::string(static_cast<std::size_t>(depth), '}');
+    source += "\nround = round + 1;\n}\n";
+    return source;
+}
+
+const std::vector<Workload>& workloads() {
+    static const std::vector<Workload> corpus = {
+        { "numeric_loop", R"(
+            {
+                var i = 0;
+                var sum = 0;
+                var product = 1;
+                while (i < 50000) {
+                    sum = sum + i * 3 - i / 2;
+                    product = product * 1.000001;
+                    i = i + 1;
+                }
+                print sum;
+            }
+        )" },
+        { "string_concat", R"(
+            var text = "";
+            var i = 0;
+            while (i < 5000) {
+                text = text + "ab" + "c";
+                if (text == "abc") {
+                    print "never";
+                }
+                i = i + 1;
+            }
+            print text == text + "";
+        )" },
+        { "global_traffic", R"(
+            var a = 0;
+            var b = 1;
+            var c = 2;
+            var i = 0;
+            while (i < 30000) {
+                a = b + c;
+                b = c - a;
+                c = a * 2;
+                i = i + 1;
+            }
+            print a + b + c;
+        )" },
+        { "local_traffic", R"(
+            {
+                var a = 0;
+                var b = 1;
+                var c = 2;
+                var i = 0;
+                while (i < 30000) {
+                    a = b + c;
+                    b = c - a;
+                    c = a * 2;
+                    i = i + 1;
+                }
+                print a + b + c;
+            }
+        )" },
+        { "nested_blocks", nestedBlocks(48) },
+        { "branches", R"(
+            {
+                var i = 0;
+                var hits = 0;
+                while (i < 30000) {
+                    if (i > 100 and i < 20000 or i == 7) {
+                        hits = hits + 1;
+                    } else if (!(i > 25000) and i != 3) {
+                        hits = hits - 1;
+                    }
+                    if (hits > 1000 or hits < -1000 and true) {
+                        hits = 0;
+                    }
+                    i = i + 1;
+                }
+                print hits;
+            }
+        )" },
+    };
+    return corpus;
+}
+
+std::shared_ptr<const Program> compile(const Workload& workload, Backend backend, OptimizationLevel optimization) {
+    std::string diagnostics;
+    auto program = Program::compile(workload.source, diagnostics, backend, optimization);
+    if (program == nullptr) {
+        fmt::print(stderr, "The workload {} does not compile:\n{}", workload.name, diagnostics);
+        std::abort();
+    }
+    return program;
+}
+
+// the benchmark arguments select the backend (0 stack, 1 register) and the optimization level (0 none, 1 basic)
+Backend backendArg(const benchmark::State& state) { return static_cast<Backend>(state.range(0)); }
+OptimizationLevel optimizationArg(const benchmark::State& state) { return static_cast<OptimizationLevel>(state.range(1)); }
+
+// only the front end: scanning, parsing, code generation and the optimizer
+void compileWorkload(benchmark::State& state, const Workload& workload) {
+    for (auto _ : state) {
+        auto program = compile(workload, backendArg(state), optimizationArg(state));
+        benchmark::DoNotOptimize(program);
+    }
+    state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations()) * static_cast<std::int64_t>(workload.source.size()));
+}
+
+// only the execution of code that was compiled up front, each run in a fresh VM
+void runWorkload(benchmark::State& state, const Workload& workload) {
+    const auto program = compile(workload, backendArg(state), optimizationArg(state));
+    std::string output;
+    for (auto _ : state) {
+        state.PauseTiming();
+        VM vm;
+        vm.printTo(output);
+        output.clear();
+        state.ResumeTiming();
+        auto result = vm.run(program);
+        benchmark::DoNotOptimize(result);
+    }
+}
+
+// both together, as VM::interpret() does it
+void interpretWorkload(benchmark::State& state, const Workload& workload) {
+    std::string output;
+    for (auto _ : state) {
+        state.PauseTiming();
+        VM vm;
+        vm.setOptimizationLevel(optimizationArg(state));
+        vm.printTo(output);
+        output.clear();
+        state.ResumeTiming();
+        auto result = vm.interpret(workload.source, backendArg(state));
+        benchmark::DoNotOptimize(result);
+    }
+}
+
+[[maybe_unused]] const bool registered = [] {
+    for (const auto& workload : workloads()) {
+        const auto add = [&workload](const char *kind, void (*function)(benchmark::State&, const Workload&)) {
+            benchmark::RegisterBenchmark(fmt::format("BM_{}/{}", kind, workload.name).c_str(), function, std::cref(workload))
+                ->ArgNames({ "backend", "opt" })
+                ->ArgsProduct({ { 0, 1 }, { 0, 1 } })
+                ->Unit(benchmark::kMillisecond);
+        };
+        add("Compile", compileWorkload);
+        add("Run", runWorkload);
+        add("Interpret", interpretWorkload);
+    }
+    return true;
+}();
+
+} // namespace
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+/**
+ * @brief Allocator for heap objects. Small allocations are rounded up to a size class and
+ *        served from a free list of equally sized slots that are carved out of large blocks,
+ *        everything bigger goes to operator new. Blocks are only released with the Arena, so
+ *        freed slots are reused by the next object of the same size class.
+ */
+class Arena {
+public:
+    static constexpr std::size_t BLOCK_SIZE { 64 * 1024 };
+    static constexpr std::array<std::size_t, 5> SIZE_CLASSES { 16, 32, 64, 128, 256 };
+
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    [[nodiscard]] void *allocate(std::size_t size);
+    void deallocate(void *pointer, std::size_t size);
+
+    // memory that is reserved for small objects, used or not
+    [[nodiscard]] std::size_t reservedBytes() const { return m_blocks.size() * BLOCK_SIZE; }
+
+private:
+    // index into SIZE_CLASSES or SIZE_CLASSES.size() if the object is too big for every class
+    [[nodiscard]] static constexpr std::size_t sizeClass(std::size_t size) {
+        std::size_t index = 0;
+        while (index < SIZE_CLASSES.size() && SIZE_CLASSES[index] < size) {
+            index++;
+        }
+        return index;
+    }
+
+    void refill(std::size_t sizeClass);
+
+    struct FreeSlot {
+        FreeSlot *next;
+    };
+
+private:
+    std::array<FreeSlot *, SIZE_CLASSES.size()> m_freeLists {};
+    std::vector<std::unique_ptr<std::byte[]>> m_blocks;
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <span>
+#include <string>
+#include <vector>
+#include "compile_driver.h"
+#include "vm.h"
+
+struct ScriptResult {
+    std::filesystem::path path;
+    // CompileError as well if the file could not be read
+    InterpretResult result { InterpretResult::Ok };
+    // everything the script printed
+    std::string output;
+    // compile and runtime errors
+    std::string diagnostics;
+    // from reading the file until the script finished, including the start of its VM
+    std::chrono::microseconds wallTime { 0 };
+};
+
+// every .lox file below `directory`, sorted so a batch always runs in the same order
+[[nodiscard]] std::vector<std::filesystem::path> findScripts(const std::filesystem::path& directory);
+
+/**
+ * @brief Runs every script in a fresh VM, in this process and on a pool of worker threads.
+ *        The scripts are dealt out to one queue per worker up front; a worker that runs out
+ *        of scripts steals from the other end of another queue, so a few slow scripts do
+ *        not leave the rest of the pool idle. Nothing is printed, the output and the errors of
+ *        the scripts are returned with the results in the order of `paths`. The trace and
+ *        listings of a debug build are dropped.
+ */
+[[nodiscard]] std::vector<ScriptResult> runScripts(std::span<const std::filesystem::path> paths, const CompileOptions& options = {});
+
+// one object with a "scripts" array that holds path, status, wall time, stdout and stderr of each script
+[[nodiscard]] std::string resultsToJson(std::span<const ScriptResult> results);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "chunk.h"
+#include "globals.h"
+#include "heap.h"
+#include "mapped_file.h"
+
+/**
+ * @brief Layout of a .loxc file, every integer is little endian:
+ *
+ *        header     magic "LOXC", u16 version, u8 backend, u8 reserved, u32 registerCount,
+ *                   u32 code size, u32 checksum of everything behind the header
+ *        code       the bytes of Chunk::code, executed in place after loading
+ *        constants  u32 count, then a u8 tag per constant followed by an f64 for numbers or
+ *                   a u32 length and the characters for strings
+ *        globals    u32 count, then a u32 length and the characters of every global name,
+ *                   the index of a name is the operand the code uses for it
+ *        lines      u32 count, then u32 offset and u32 line of every run of the LineTable
+ */
+struct BytecodeFile {
+    static constexpr std::uint16_t VERSION { 1 };
+    static constexpr std::size_t HEADER_SIZE { 20 };
+};
+
+[[nodiscard]] std::vector<std::uint8_t> serializeChunk(const Chunk& chunk, const Globals& globals);
+[[nodiscard]] bool writeBytecodeFile(const std::filesystem::path& path, const Chunk& chunk, const Globals& globals);
+
+/**
+ * @brief Checks that the code of `chunk` can be executed without leaving the chunk or its
+ *        stack, with `globalCount` global slots. Returns the reason if it can not.
+ */
+[[nodiscard]] std::optional<std::string_view> verifyBytecode(const Chunk& chunk, std::size_t globalCount);
+
+/**
+ * @brief Loads bytes written by writeBytecodeFile(), `name` is only used to report errors.
+ *        Strings are interned in `heap`, the global names are kept in Chunk::globalNames and
+ *        resolved by every VM that runs the chunk. The code is used in place, so `bytes` have
+ *        to outlive the chunk. The code is verified before it is used, so a file with a valid
+ *        checksum still can not make the VM leave the chunk or its stack. Appends the problem
+ *        to `diagnostics`, or prints it to stderr without one, and returns nullptr if the
+ *        bytes are not valid.
+ */
+[[nodiscard]] std::unique_ptr<Chunk> loadBytecode(std::span<const std::uint8_t> bytes, std::string_view name, Heap& heap, std::string *diagnostics = nullptr);
+
+// maps the file and loads it with loadBytecode(), the chunk owns the mapping
+[[nodiscard]] std::unique_ptr<Chunk> loadBytecodeFile(const std::filesystem::path& path, Heap& heap, std::string *diagnostics = nullptr);
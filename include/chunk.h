@@ -1,92 +1,114 @@
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
 #include <fmt/format.h>
+#include <memory>
+#include <span>
+#include <string>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
-#include <variant>
 #include "opcode.h"
-
-// StackAllocated DataTypes
-using Number = double;
-using Bool = bool;
-using Nil = std::monostate;
-
-// HeapAllocated DataTypes
-using Obj = std::variant<std::string, std::monostate>;
-
-// Value Variant holding all types
-using Value = std::variant<Bool, Number, Nil, Obj>;
-
-template <typename ObjType>
-static bool holds_obj_type(const Value& value) {
-    return (std::holds_alternative<Obj>(value) && std::holds_alternative<ObjType>(std::get<Obj>(value)));
-}
-
-template <typename ObjType>
-static ObjType get_objtype_unchecked(const Value& value) {
-    return std::get<ObjType>(std::get<Obj>(value));
-}
+#include "value.h"
 
 /**
- * @brief Visitor that returns the string representation of every case in the Value variant.
- *        IMPORTANT all the types in the Value variant have to be printable by fmt::format or
- *        should have a special case defined.
+ * @brief Identifies a constant by its exact bits, so 0 and -0 stay different constants and
+ *        strings are the same constant exactly when they are the same interned object.
  */
-struct PrintVisitor {
-    // Base case for Obj Value
-    std::string operator()(const Obj& obj) { return std::visit(PrintVisitor{}, obj); }
-
-    // The Nil (std::monostate) variant cannot be formatted by fmt::format by default, so we can catch it here.
-    std::string operator()(Nil) { return "Nil"; }
-    std::string operator()(Bool b) { return b ? "true" : "false"; }
+struct ConstantHash {
+    [[nodiscard]] std::size_t operator()(const Value& value) const;
+};
 
-    // This matches every other type than std::monostate. 
-    std::string operator()(const auto& x) { return fmt::format("{}", x); }
+struct ConstantEqual {
+    [[nodiscard]] bool operator()(const Value& lhs, const Value& rhs) const;
 };
 
 /**
- * @brief Visitor that checks if the values holds in two different
- *        std::variants are the same type and the same value. It returns false
- *        in every other case.
- *
+ * @brief Run-length encoded line information. Every run maps the bytes from its offset up
+ *        to the offset of the next run to the same source line, so a whole statement usually
+ *        costs a single run instead of one line per byte.
  */
-struct EqualityVisitor {
-    // Base case for Obj Value
-    bool operator()(const Obj& a, const Obj& b) {
-        return std::visit(EqualityVisitor{}, a, b);
-    }
-
-    // If the types are the same, they have to implement operator==
-    template<typename T>
-    bool operator()(const T& a, const T& b) {
-        return a == b;
-    }
+class LineTable {
+public:
+    struct Run {
+        std::uint32_t offset;
+        std::uint32_t line;
+    };
+
+    // bytes have to be added in order of their offset
+    void add(std::size_t offset, std::size_t line);
+    // forgets the lines of every byte from `size` on
+    void truncate(std::size_t size);
+    [[nodiscard]] std::size_t getLine(std::size_t offset) const;
+
+    [[nodiscard]] const std::vector<Run>& runs() const { return m_runs; }
+    [[nodiscard]] std::size_t bytes() const { return m_runs.capacity() * sizeof(Run); }
+
+private:
+    std::vector<Run> m_runs;
+};
 
-    template<typename T, typename U>
-    bool operator()(const T&, const U&) {
-#ifdef DEBUG_PRINT_CODE
-        fmt::print(stderr, "Equality operator failed with different types.");
-#endif
-        return false;
-    }
+/**
+ * @brief Bytes a Chunk occupies on the heap, split by what they are used for.
+ */
+struct ChunkMemory {
+    std::size_t code;
+    std::size_t constants;
+    std::size_t lines;
+    std::size_t constantIndex;
 };
 
 struct Chunk {
     void push(OpCode opcode, std::size_t line);
+    void push(RegOpCode opcode, std::size_t line);
     void push(std::uint8_t opcode, std::size_t line);
-    void disassembleChunk(const std::string_view name) const;
+    // the listings are appended to `output`, or printed to stdout if it is nullptr
+    void disassembleChunk(const std::string_view name, std::string *output = nullptr) const;
 
-    [[nodiscard]] std::size_t disassembleInstruction(std::size_t offset) const;
-    [[nodiscard]] std::size_t simpleInstruction(const std::string_view name, std::size_t offset) const;
-    [[nodiscard]] std::size_t byteInstruction(const std::string_view name, std::size_t offset) const;
-    [[nodiscard]] std::size_t jumpInstruction(const std::string_view name, int sign, std::size_t offset) const;
+    // the bytes that are executed, `code` unless the chunk was loaded with loadBytecode()
+    [[nodiscard]] std::span<const std::uint8_t> bytecode() const {
+        return externalCode.data() != nullptr ? externalCode : std::span<const std::uint8_t>(code);
+    }
+    [[nodiscard]] ChunkMemory memoryUsage() const;
+    void printMemoryReport(const std::string_view name, std::string *output = nullptr) const;
+
+    [[nodiscard]] std::size_t disassembleInstruction(std::size_t offset, std::string *output = nullptr) const;
+    [[nodiscard]] std::size_t disassembleInstruction(std::string& out, std::size_t offset) const;
+    [[nodiscard]] std::size_t simpleInstruction(std::string& out, const std::string_view name, std::size_t offset) const;
+    [[nodiscard]] std::size_t byteInstruction(std::string& out, const std::string_view name, std::size_t offset) const;
+    [[nodiscard]] std::size_t bytePairInstruction(std::string& out, const std::string_view name, std::size_t offset) const;
+    [[nodiscard]] std::size_t shortInstruction(std::string& out, const std::string_view name, std::size_t offset) const;
+    [[nodiscard]] std::size_t jumpTarget(std::size_t offset) const;
+    [[nodiscard]] std::size_t jumpInstruction(std::string& out, const std::string_view name, int sign, std::size_t offset) const;
+    [[nodiscard]] std::size_t longJumpInstruction(std::string& out, const std::string_view name, int sign, std::size_t offset) const;
 
     [[nodiscard]] std::size_t addConstant(const Value& value);
-    [[nodiscard]] std::size_t constantInstruction(const std::string_view name, std::size_t offset) const;
+    [[nodiscard]] std::size_t constantInstruction(std::string& out, const std::string_view name, std::size_t offset) const;
+    [[nodiscard]] std::size_t constantLongInstruction(std::string& out, const std::string_view name, std::size_t offset) const;
+
+    [[nodiscard]] std::size_t disassembleRegisterInstruction(std::string& out, std::size_t offset) const;
+    [[nodiscard]] std::size_t registerInstruction(std::string& out, const std::string_view name, std::size_t registers, std::size_t offset) const;
+    [[nodiscard]] std::size_t loadConstantInstruction(std::string& out, const std::string_view name, bool isLong, std::size_t offset) const;
+    [[nodiscard]] std::size_t globalRegisterInstruction(std::string& out, const std::string_view name, std::size_t offset) const;
+    [[nodiscard]] std::size_t registerJumpInstruction(std::string& out, const std::string_view name, bool conditional, bool isLong, int sign, std::size_t offset) const;
 
     std::vector<std::uint8_t> code;
     std::vector<Value> constants;
-    std::vector<std::size_t> lines;
+    LineTable lines;
+    // index of every value in constants, so addConstant() never stores a value twice
+    std::unordered_map<Value, std::size_t, ConstantHash, ConstantEqual> constantIndex;
+
+    // set by loadBytecode(), the code is used in place from a .loxc mapping or the embedded
+    // prelude, the owner of those bytes stays alive as long as the chunk does
+    std::shared_ptr<const void> codeOwner;
+    std::span<const std::uint8_t> externalCode;
+    // the global operands index these names, every VM maps them to its own slots. Empty if the
+    // operands already are the slots of the Globals the chunk was compiled with
+    std::vector<ObjString *> globalNames;
+
+    Backend backend { Backend::Stack };
+    // highest number of registers that are used at the same time, only set by the register backend
+    std::size_t registerCount { 0 };
 };
 
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+#include "program.h"
+
+struct CompileOptions {
+    Backend backend { Backend::Stack };
+    OptimizationLevel optimization { OptimizationLevel::None };
+    Lexing lexing { Lexing::OnDemand };
+    // 0 uses one thread per core
+    unsigned threads { 0 };
+};
+
+struct CompiledFile {
+    std::filesystem::path path;
+    // everything that was reported for this file, empty if it compiled cleanly
+    std::string diagnostics;
+    // nullptr if the file could not be read or did not compile
+    std::shared_ptr<const Program> program;
+};
+
+/**
+ * @brief Compiles every file on its own thread pool worker, each with its own Scanner,
+ *        Compiler, Chunk and Heap. Nothing is printed while compiling, the results are
+ *        returned in the order of `paths` so diagnostics can be reported in a stable order.
+ */
+[[nodiscard]] std::vector<CompiledFile> compileFiles(std::span<const std::filesystem::path> paths, const CompileOptions& options = {});
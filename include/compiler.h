@@ -1,9 +1,15 @@
 #pragma once
 
 #include <string_view>
-#include <functional>
+#include <array>
+#include <optional>
+#include <string>
 #include "chunk.h"
+#include "globals.h"
+#include "heap.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "token_buffer.h"
 
 enum class Precedence : std::uint8_t {
     None,
@@ -19,7 +25,9 @@ enum class Precedence : std::uint8_t {
     Primary
 };
 
-using ParseFn = std::function<void(bool)>;
+struct Compiler;
+
+using ParseFn = void (Compiler::*)(bool);
 struct ParseRule {
     ParseFn prefix;
     ParseFn infix;
@@ -30,67 +38,61 @@ struct Parser {
     Parser() = default;
     Token current {};
     Token previous {};
+    // values of the tokens if they are number literals from a TokenBuffer
+    double currentNumber { 0 };
+    double previousNumber { 0 };
     bool hadError { false };
     bool panicMode { false };
 };
 
+/**
+ * @brief Describes where the value of the last parsed expression lives when compiling for
+ *        the register backend. Values are only materialized into a register when an
+ *        instruction needs them, so locals are used in place and constants cost nothing
+ *        until they are read.
+ */
+struct ExprDesc {
+    enum class Kind : std::uint8_t {
+        Void,        // nothing, only after an error
+        Nil,
+        True,
+        False,
+        Constant,    // index into the constant table
+        Global,      // global slot
+        Local,       // register of a local variable
+        Temp,        // temporary register on top of the used registers
+        Relocatable, // offset of an already emitted instruction whose destination is not set yet
+    };
+    Kind kind { Kind::Void };
+    std::size_t index { 0 };
+};
+
 // user defined literals turns a ULL into u8
 inline constexpr std::uint8_t operator""_u8(unsigned long long arg) noexcept { return static_cast<std::uint8_t>(arg); }
 
 template <typename opcode>
-concept IsOpcode = std::is_same_v<opcode, std::uint8_t> || std::is_same_v<opcode, OpCode>;
-
-
-#define BIND(func_name) std::bind(&Compiler::func_name, this, std::placeholders::_1)
+concept IsOpcode = std::is_same_v<opcode, std::uint8_t> || std::is_same_v<opcode, OpCode> || std::is_same_v<opcode, RegOpCode>;
 
 struct Compiler {
-    Compiler(Chunk& chunk) : chunk(chunk) {
-        TokenTypeFunction = {
-           /*TOKEN_LEFT_PAREN */   ParseRule {.prefix { BIND(grouping) }, .infix { nullptr }, .precedence {   Precedence::None} },
-           /*TOKEN_RIGHT_PAREN */  ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_LEFT_BRACE */   ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} }, 
-           /*TOKEN_RIGHT_BRACE */  ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_COMMA */        ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_DOT */          ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_MINUS */        ParseRule {.prefix { BIND(unary) }, .infix { BIND(binary) }, .precedence { Precedence::Term} },
-           /*TOKEN_PLUS */         ParseRule {.prefix { nullptr }, .infix { BIND(binary) }, .precedence { Precedence::Term} },
-           /*TOKEN_SEMICOLON */    ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_SLASH */        ParseRule {.prefix { nullptr }, .infix { BIND(binary) }, .precedence { Precedence::Factor} },
-           /*TOKEN_STAR */         ParseRule {.prefix { nullptr }, .infix { BIND(binary) }, .precedence { Precedence::Factor} },
-           /*TOKEN_BANG */         ParseRule {.prefix { BIND(unary) }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_BANG_EQUAL */   ParseRule {.prefix { nullptr }, .infix { BIND(binary) }, .precedence { Precedence::Equality} },
-           /*TOKEN_EQUAL */        ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_EQUAL_EQUAL */  ParseRule {.prefix { nullptr }, .infix { BIND(binary) }, .precedence { Precedence::Equality} },
-           /*TOKEN_GREATER */      ParseRule {.prefix { nullptr }, .infix { BIND(binary) }, .precedence { Precedence::Comparison} },
-           /*TOKEN_GREATER_EQUAL */ParseRule {.prefix { nullptr }, .infix { BIND(binary) }, .precedence { Precedence::Comparison} },
-           /*TOKEN_LESS */         ParseRule {.prefix { nullptr }, .infix { BIND(binary) }, .precedence { Precedence::Comparison} },
-           /*TOKEN_LESS_EQUAL */   ParseRule {.prefix { nullptr }, .infix { BIND(binary) }, .precedence { Precedence::Comparison} },
-           /*TOKEN_IDENTIFIER */   ParseRule {.prefix { BIND(variable) }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_STRING */       ParseRule {.prefix { BIND(string) }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_NUMBER */       ParseRule {.prefix { BIND(number) }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_AND */          ParseRule {.prefix { nullptr }, .infix { BIND(and_) }, .precedence { Precedence::And} },
-           /*TOKEN_CLASS */        ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_ELSE */         ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_FALSE */        ParseRule {.prefix { BIND(literal) }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_FOR */          ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_FUN */          ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_IF */           ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_NIL */          ParseRule {.prefix { BIND(literal) }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_OR */           ParseRule {.prefix { nullptr }, .infix { BIND(or_) }, .precedence { Precedence::Or} },
-           /*TOKEN_PRINT */        ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_RETURN */       ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_SUPER */        ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_THIS */         ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_TRUE */         ParseRule {.prefix { BIND(literal) }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_VAR */          ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_WHILE */        ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_ERROR */        ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-           /*TOKEN_EOF */          ParseRule {.prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
-        };
+    Compiler(Chunk& chunk, Heap& heap, Globals& globals, Backend backend = Backend::Stack,
+             OptimizationLevel optimization = OptimizationLevel::None)
+        : chunk(chunk), heap(heap), globals(globals), backend(backend), optimization(optimization) {
+        chunk.backend = backend;
     }
+    // scans the tokens while parsing
     [[nodiscard]] bool compile(const std::string_view source);
+    // parses tokens that were lexed ahead, see TokenBuffer
+    [[nodiscard]] bool compile(const TokenBuffer& buffer);
+
+    // errors are appended to `sink` instead of being printed to stderr
+    void reportTo(std::string& sink) { diagnostics = &sink; }
+    // the listing of a DEBUG_PRINT_CODE build is appended to `sink` instead of being printed to stdout
+    void printTo(std::string& sink) { listing = &sink; }
 
 private:
+    [[nodiscard]] bool compileTokens();
+    [[nodiscard]] bool compilePass();
+
     void advance();
     void consume(TokenType type, const char *msg);
     void expression();
@@ -110,12 +112,12 @@ private:
     void parsePrecedence(Precedence precedence);
 
     [[nodiscard]] bool identifiersEqual(const Token& lhs, const Token& rhs);
-    [[nodiscard]] std::uint8_t parseVariable(const char *errorMessage);
-    [[nodiscard]] std::uint8_t identifierConstant(const Token& name);
-    void defineVariable(std::uint8_t global);
+    [[nodiscard]] std::uint16_t parseVariable(const char *errorMessage);
+    [[nodiscard]] std::uint16_t globalSlot(const Token& name);
+    void defineVariable(std::uint16_t global);
     void patchJump(int offset);
 
-    [[nodiscard]] ParseRule getRule(TokenType type);
+    [[nodiscard]] static const ParseRule& getRule(TokenType type);
     [[nodiscard]] bool match(TokenType type);
     [[nodiscard]] bool check(TokenType type);
 
@@ -148,17 +150,35 @@ private:
     template<typename opcode>
     requires IsOpcode<opcode>
     int emitJump(opcode instruction) {
-        emitByte(instruction);
+        emitByte(longJumps ? longJump(instruction) : instruction);
+        return emitJumpOffset();
+    }
+
+    // placeholder for the offset of a forward jump, returns where patchJump() has to write it
+    int emitJumpOffset() {
         emitByte(0xff_u8);
         emitByte(0xff_u8);
+        if (longJumps) {
+            emitByte(0xff_u8);
+            return static_cast<int>(chunk.code.size()) - 3;
+        }
         return static_cast<int>(chunk.code.size()) - 2;
     }
 
+    template<typename opcode>
+    requires IsOpcode<opcode>
+    void emitShort(opcode byte, std::uint16_t operand) {
+        emitByte(byte);
+        emitByte(static_cast<std::uint8_t>((operand >> 8) & 0xff));
+        emitByte(static_cast<std::uint8_t>(operand & 0xff));
+    }
+
     void emitConstant(const Value& value);
     void emitReturn();
     void emitLoop(std::size_t loopStart);
+    void emitLong(std::size_t operand);
 
-    std::uint8_t makeConstant(const Value& value);
+    std::size_t makeConstant(const Value& value);
 
     void errorAtCurrent(const char *msg);
     void error(const char *msg);
@@ -167,18 +187,123 @@ private:
     void beginScope();
     void endScope();
 
+    // register backend, see compiler_register.cpp
+    void whileStatementRegister();
+    void ifStatementRegister();
+    void printStatementRegister();
+    void expressionStatementRegister();
+    void varDeclarationRegister();
+    void unaryRegister(TokenType operatorType);
+    void binaryRegister(TokenType operatorType, Precedence precedence);
+    void namedVariableRegister(const Token& name, bool canAssign);
+    void logicalRegister(RegOpCode jump, Precedence precedence);
+
+    [[nodiscard]] std::uint8_t reserveRegister();
+    void freeRegister(std::size_t reg);
+    void freeExpr(const ExprDesc& expr);
+    void freeExprs(const ExprDesc& first, const ExprDesc& second);
+    void dischargeToRegister(ExprDesc& expr, std::uint8_t reg);
+    void exprToRegister(ExprDesc& expr, std::uint8_t reg);
+    std::uint8_t exprToNextRegister(ExprDesc& expr);
+    std::uint8_t exprToAnyRegister(ExprDesc& expr);
+    [[nodiscard]] bool assignsAhead(const Token& name);
+    [[nodiscard]] int emitRegisterJump(RegOpCode instruction, std::uint8_t reg);
+    [[nodiscard]] std::optional<Value> constantValue(const ExprDesc& desc) const;
+    [[nodiscard]] ExprDesc constantExpr(const Value& value);
+
+    // constant folding, operators whose operands are all constants are evaluated at compile time
+    [[nodiscard]] std::optional<Value> foldUnary(TokenType operatorType, const Value& operand);
+    [[nodiscard]] std::optional<Value> foldBinary(TokenType operatorType, const Value& lhs, const Value& rhs);
+    void emitFolded(std::size_t start, const Value& value);
+
+    // the instruction at [start, end) pushes `value`, see constantOperand()
+    struct FoldableConstant {
+        std::size_t start;
+        std::size_t end;
+        Value value;
+    };
+    [[nodiscard]] std::optional<FoldableConstant> constantOperand() const;
+
 private:
     struct Local {
         Token name;
         int depth;
     };
+    // wide instructions address locals with 16 bits
+    static constexpr std::size_t MAX_LOCALS { UINT16_MAX + 1 };
+    static constexpr std::size_t MAX_LONG_OPERAND { 0xffffff };
     struct Variables {
-        std::array<Local, UINT8_MAX + 1> locals;
+        std::vector<Local> locals;
         int localCount { 0 };
         int scopeDepth { 0 };
     } variables;
-    std::array<ParseRule, 40> TokenTypeFunction;
+    std::string_view source;
     Scanner scanner;
+    // tokens are read from here instead of the scanner if it is set
+    const TokenBuffer *tokens { nullptr };
+    TokenBuffer::Cursor cursor {};
+    std::string *diagnostics { nullptr };
+    std::string *listing { nullptr };
     Parser parser;
     Chunk& chunk;
+    Heap& heap;
+    Globals& globals;
+
+    Backend backend;
+    OptimizationLevel optimization;
+    // state of the register backend
+    ExprDesc expr {};
+    std::size_t nextRegister { 0 };
+
+    // Forward jumps are emitted with 16 bit offsets. If one of them turns out to be too
+    // short, the whole source is compiled again with 24 bit offsets for every forward jump.
+    bool longJumps { false };
+    bool jumpOverflow { false };
+
+    // last constant the stack backend emitted, it is only an operand while it ends the code
+    std::optional<FoldableConstant> lastConstant;
+
+    // indexed by TokenType, shared by every Compiler so parsing a token never copies a rule
+    static constexpr std::array<ParseRule, static_cast<std::size_t>(TokenType::Eof) + 1> rules {
+        /*TOKEN_LEFT_PAREN */   ParseRule { .prefix { &Compiler::grouping }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_RIGHT_PAREN */  ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_LEFT_BRACE */   ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_RIGHT_BRACE */  ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_COMMA */        ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_DOT */          ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_MINUS */        ParseRule { .prefix { &Compiler::unary }, .infix { &Compiler::binary }, .precedence { Precedence::Term} },
+        /*TOKEN_PLUS */         ParseRule { .prefix { nullptr }, .infix { &Compiler::binary }, .precedence { Precedence::Term} },
+        /*TOKEN_SEMICOLON */    ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_SLASH */        ParseRule { .prefix { nullptr }, .infix { &Compiler::binary }, .precedence { Precedence::Factor} },
+        /*TOKEN_STAR */         ParseRule { .prefix { nullptr }, .infix { &Compiler::binary }, .precedence { Precedence::Factor} },
+        /*TOKEN_BANG */         ParseRule { .prefix { &Compiler::unary }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_BANG_EQUAL */   ParseRule { .prefix { nullptr }, .infix { &Compiler::binary }, .precedence { Precedence::Equality} },
+        /*TOKEN_EQUAL */        ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_EQUAL_EQUAL */  ParseRule { .prefix { nullptr }, .infix { &Compiler::binary }, .precedence { Precedence::Equality} },
+        /*TOKEN_GREATER */      ParseRule { .prefix { nullptr }, .infix { &Compiler::binary }, .precedence { Precedence::Comparison} },
+        /*TOKEN_GREATER_EQUAL */ParseRule { .prefix { nullptr }, .infix { &Compiler::binary }, .precedence { Precedence::Comparison} },
+        /*TOKEN_LESS */         ParseRule { .prefix { nullptr }, .infix { &Compiler::binary }, .precedence { Precedence::Comparison} },
+        /*TOKEN_LESS_EQUAL */   ParseRule { .prefix { nullptr }, .infix { &Compiler::binary }, .precedence { Precedence::Comparison} },
+        /*TOKEN_IDENTIFIER */   ParseRule { .prefix { &Compiler::variable }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_STRING */       ParseRule { .prefix { &Compiler::string }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_NUMBER */       ParseRule { .prefix { &Compiler::number }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_AND */          ParseRule { .prefix { nullptr }, .infix { &Compiler::and_ }, .precedence { Precedence::And} },
+        /*TOKEN_CLASS */        ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_ELSE */         ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_FALSE */        ParseRule { .prefix { &Compiler::literal }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_FOR */          ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_FUN */          ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_IF */           ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_NIL */          ParseRule { .prefix { &Compiler::literal }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_OR */           ParseRule { .prefix { nullptr }, .infix { &Compiler::or_ }, .precedence { Precedence::Or} },
+        /*TOKEN_PRINT */        ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_RETURN */       ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_SUPER */        ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_THIS */         ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_TRUE */         ParseRule { .prefix { &Compiler::literal }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_VAR */          ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_WHILE */        ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_ERROR */        ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+        /*TOKEN_EOF */          ParseRule { .prefix { nullptr }, .infix { nullptr }, .precedence { Precedence::None} },
+    };
 };
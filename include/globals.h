@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <unordered_map>
+#include <vector>
+#include "object.h"
+#include "value.h"
+
+/**
+ * @brief Dense table of all global variables. The compiler resolves every global name
+ *        to a slot once, the VM only indexes into `values`. Slots which were resolved
+ *        but never defined hold the undefined sentinel.
+ */
+class Globals {
+public:
+    [[nodiscard]] std::size_t resolve(ObjString *name);
+    [[nodiscard]] ObjString *name(std::size_t slot) const { return m_names[slot]; }
+    [[nodiscard]] std::size_t size() const { return m_names.size(); }
+
+    std::vector<Value> values;
+
+private:
+    std::unordered_map<ObjString *, std::size_t, ObjStringHash> m_slots;
+    std::vector<ObjString *> m_names;
+};
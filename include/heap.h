@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+#include "arena.h"
+#include "object.h"
+#include "value.h"
+
+/**
+ * @brief Tunables of the garbage collector.
+ */
+struct GCConfig {
+    // bytes that can be allocated before the first collection
+    std::size_t initialThreshold { 1024 * 1024 };
+    // after a collection the next one happens once the live bytes grew by this factor
+    double growthFactor { 2.0 };
+    // never collect below this threshold, so small heaps are not collected all the time
+    std::size_t minimumThreshold { 64 * 1024 };
+    // collect on every check, only useful to find missing roots
+    bool stress { false };
+    // split every collection into steps that are interleaved with allocations
+    bool incremental { false };
+    // time one incremental step may take, a step ends early rather than running over it
+    std::chrono::microseconds pauseBudget { 1000 };
+    // objects one incremental step may mark or sweep, by default only the pause budget limits a step
+    std::size_t stepBudget { std::numeric_limits<std::size_t>::max() };
+};
+
+/**
+ * @brief CPU time of the calling thread. The collector measures its pauses with it, so a step
+ *        is not charged for the time the OS spent running other threads.
+ */
+struct ThreadClock {
+    using duration = std::chrono::nanoseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point<ThreadClock>;
+    static constexpr bool is_steady = true;
+
+    [[nodiscard]] static time_point now() noexcept;
+};
+
+struct GCStats {
+    std::size_t bytesAllocated { 0 };       // bytes of all objects that are not freed yet
+    std::size_t totalBytesAllocated { 0 };
+    std::size_t totalBytesFreed { 0 };
+    std::size_t collections { 0 };          // finished collection cycles
+    std::size_t steps { 0 };                // pauses, a stop-the-world collection is a single step
+    std::size_t lastStepWork { 0 };         // objects marked or swept in the last step
+    std::size_t maxStepWork { 0 };
+    std::chrono::nanoseconds lastPause { 0 };   // ThreadClock time of the last step
+    std::chrono::nanoseconds maxPause { 0 };
+    std::chrono::nanoseconds totalPause { 0 };
+};
+
+/**
+ * @brief Owner of every heap allocated Obj. Strings are interned, so two ObjString's with
+ *        the same content are always the same pointer.
+ *
+ *        Objects are reclaimed by a precise tri-color mark-sweep collector. The Heap does not
+ *        know the roots, whoever starts a collection marks them with markValue() and
+ *        markObject(). White objects are unmarked, gray ones are marked and wait on the gray
+ *        stack, black ones are marked and their references are marked as well.
+ *
+ *        In incremental mode step() only does as much marking and sweeping as fits into the
+ *        pause budget, and no more than GCConfig::stepBudget objects. The roots are marked
+ *        once at the start of a cycle, afterwards the mutator has to report every stored Value through writeBarrier() so no black object
+ *        or root ever references a white object. Objects allocated during a cycle are black.
+ *        The intern table only holds weak references, strings found in it are shaded.
+ */
+class Heap {
+public:
+    explicit Heap(GCConfig config = {}) : m_config(config), m_nextGC(config.initialThreshold) {}
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+    ~Heap();
+
+    [[nodiscard]] ObjString *copyString(std::string_view chars);
+    [[nodiscard]] ObjString *takeString(std::string&& chars);
+
+    // strings shorter than this are concatenated into a flat interned string right away
+    static constexpr std::size_t ROPE_THRESHOLD { 64 };
+
+    // both operands are ObjString or ObjRope, the result is a rope unless it is short
+    [[nodiscard]] Obj *concatenate(Obj *left, Obj *right);
+    [[nodiscard]] ObjString *flatten(Obj *string);
+
+    [[nodiscard]] bool shouldCollect() const {
+        return m_phase != Phase::Idle || m_config.stress || m_stats.bytesAllocated > m_nextGC;
+    }
+
+    // runs a whole collection, an unfinished incremental cycle is finished first
+    template <typename MarkRoots>
+    void collect(MarkRoots&& markRoots) {
+        const auto start = ThreadClock::now();
+        std::size_t done = 0;
+        if (m_phase != Phase::Idle) {
+            done += work(UNBOUNDED, ThreadClock::time_point::max());
+        }
+        beginCycle();
+        markRoots(*this);
+        done += work(UNBOUNDED, ThreadClock::time_point::max());
+        recordPause(ThreadClock::now() - start, done);
+    }
+
+    // does one slice of the current cycle, or starts a new one if it is time to collect
+    template <typename MarkRoots>
+    void step(MarkRoots&& markRoots) {
+        if (not m_config.incremental) {
+            return collect(std::forward<MarkRoots>(markRoots));
+        }
+        const auto start = ThreadClock::now();
+        if (m_phase == Phase::Idle) {
+            beginCycle();
+            markRoots(*this);
+        }
+        const auto done = work(std::max<std::size_t>(m_config.stepBudget, 1), start + m_config.pauseBudget);
+        recordPause(ThreadClock::now() - start, done);
+    }
+
+    /**
+     * @brief Has to be called with every Value that is stored into a root or an object
+     *        while a collection may be running.
+     */
+    void writeBarrier(const Value& value) {
+        if (m_phase == Phase::Marking) {
+            markValue(value);
+        }
+    }
+
+    void markValue(const Value& value);
+    void markObject(Obj *object);
+
+    void configure(const GCConfig& config);
+    [[nodiscard]] const GCStats& stats() const { return m_stats; }
+    [[nodiscard]] std::size_t nextCollection() const { return m_nextGC; }
+    [[nodiscard]] bool collecting() const { return m_phase != Phase::Idle; }
+
+private:
+    [[nodiscard]] ObjString *allocateString(std::string chars, std::uint32_t hash);
+    void track(Obj *object);
+    void freeObject(Obj *object);
+    [[nodiscard]] static std::size_t objectSize(const Obj *object);
+
+    [[nodiscard]] bool isMarked(const Obj *object) const { return object->mark == m_mark; }
+    void shade(Obj *object);
+
+    void beginCycle();
+    // marks and sweeps up to `budget` objects, or less if the deadline comes first, returns how many it did
+    std::size_t work(std::size_t budget, ThreadClock::time_point deadline);
+    void blackenObject(Obj *object);
+    void sweepObject();
+    void finishCycle();
+    void recordPause(std::chrono::nanoseconds pause, std::size_t work);
+
+    enum class Phase : std::uint8_t {
+        Idle,
+        Marking,
+        Sweeping,
+    };
+
+    static constexpr std::size_t UNBOUNDED { std::numeric_limits<std::size_t>::max() };
+    // the clock is only read after this many objects were marked or swept
+    static constexpr std::size_t WORK_BETWEEN_CLOCK_CHECKS { 64 };
+
+    struct StringKey {
+        std::string_view chars;
+        std::uint32_t hash;
+    };
+
+    struct StringKeyHash {
+        using is_transparent = void;
+        [[nodiscard]] std::size_t operator()(const ObjString *str) const { return str->hash; }
+        [[nodiscard]] std::size_t operator()(const StringKey& key) const { return key.hash; }
+    };
+
+    struct StringKeyEqual {
+        using is_transparent = void;
+        [[nodiscard]] bool operator()(const ObjString *lhs, const ObjString *rhs) const { return lhs == rhs; }
+        [[nodiscard]] bool operator()(const StringKey& lhs, const ObjString *rhs) const { return lhs.chars == rhs->chars; }
+        [[nodiscard]] bool operator()(const ObjString *lhs, const StringKey& rhs) const { return lhs->chars == rhs.chars; }
+    };
+
+private:
+    GCConfig m_config;
+    GCStats m_stats;
+    std::size_t m_nextGC;
+
+    Phase m_phase { Phase::Idle };
+    // longest time WORK_BETWEEN_CLOCK_CHECKS objects took so far, a step keeps at least that much of its budget free
+    ThreadClock::duration m_slowestSlice { 0 };
+    bool m_mark { true };
+    // link to the next object that has to be swept
+    Obj **m_sweepLink { nullptr };
+
+    Arena m_arena;
+    Obj *m_objects { nullptr };
+    std::vector<Obj *> m_grayStack;
+    std::unordered_set<ObjString *, StringKeyHash, StringKeyEqual> m_strings;
+};
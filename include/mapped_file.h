@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <span>
+
+/**
+ * @brief Read only mapping of a whole file. The pages are shared with every other process
+ *        that maps the same file.
+ */
+class MappedFile {
+public:
+    // nullptr if the file cannot be opened or is empty
+    [[nodiscard]] static std::shared_ptr<const MappedFile> open(const std::filesystem::path& path);
+    // maps `size` bytes of an open file followed by at least one zero byte, even if the size is
+    // a multiple of the page size, nullptr if the file cannot be mapped
+    [[nodiscard]] static std::shared_ptr<const MappedFile> openTerminated(int fd, std::size_t size);
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    [[nodiscard]] std::span<const std::uint8_t> bytes() const { return { m_data, m_size }; }
+
+private:
+    MappedFile(const std::uint8_t *data, std::size_t size, std::size_t mappedSize)
+        : m_data(data), m_size(size), m_mappedSize(mappedSize) {}
+
+private:
+    const std::uint8_t *m_data;
+    std::size_t m_size;
+    // the whole reserved range, it can be larger than the file
+    std::size_t m_mappedSize;
+};
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+enum class ObjType : std::uint8_t {
+    String,
+    Rope,
+};
+
+/**
+ * @brief Header of every heap allocated object. The objects form an intrusive list
+ *        so the Heap can free all of them without knowing who still references them.
+ *        An object is marked when `mark` equals the current mark of the Heap, which flips
+ *        with every collection so the marks never have to be cleared. A permanent object
+ *        belongs to a Program and is shared by every VM that runs it, no Heap ever marks it.
+ */
+struct Obj {
+    explicit Obj(ObjType type) : type(type) {}
+
+    ObjType type;
+    bool mark { false };
+    bool permanent { false };
+    Obj *next { nullptr };
+};
+
+struct ObjString : Obj {
+    static constexpr ObjType TYPE { ObjType::String };
+
+    ObjString(std::string chars, std::uint32_t hash) : Obj(TYPE), chars(std::move(chars)), hash(hash) {}
+
+    std::string chars;
+    std::uint32_t hash;
+};
+
+/**
+ * @brief String that is the concatenation of two other strings (ObjString or ObjRope).
+ *        Concatenating is O(1), the characters are only copied once the string is
+ *        flattened because it is printed, compared or hashed. The flat string is interned
+ *        and cached, the children are dropped afterwards.
+ */
+struct ObjRope : Obj {
+    static constexpr ObjType TYPE { ObjType::Rope };
+
+    ObjRope(Obj *left, Obj *right, std::size_t length) : Obj(TYPE), left(left), right(right), length(length) {}
+
+    Obj *left;
+    Obj *right;
+    std::size_t length;
+    ObjString *flat { nullptr };
+};
+
+[[nodiscard]] inline bool isString(const Obj *object) {
+    return object->type == ObjType::String || object->type == ObjType::Rope;
+}
+
+[[nodiscard]] inline std::size_t stringLength(const Obj *string) {
+    if (string->type == ObjType::String) {
+        return static_cast<const ObjString *>(string)->chars.size();
+    }
+    return static_cast<const ObjRope *>(string)->length;
+}
+
+/**
+ * @brief Copies the characters of all leaves in order. Iterative, since ropes that are
+ *        built in a loop are as deep as the loop ran.
+ */
+[[nodiscard]] inline std::string ropeToString(const ObjRope *rope) {
+    std::string chars;
+    chars.reserve(rope->length);
+
+    std::vector<const Obj *> pending { rope };
+    while (not pending.empty()) {
+        const Obj *object = pending.back();
+        pending.pop_back();
+
+        if (object->type == ObjType::String) {
+            chars += static_cast<const ObjString *>(object)->chars;
+            continue;
+        }
+        const auto *node = static_cast<const ObjRope *>(object);
+        if (node->flat != nullptr) {
+            chars += node->flat->chars;
+        } else {
+            pending.push_back(node->right);
+            pending.push_back(node->left);
+        }
+    }
+    return chars;
+}
+
+/**
+ * @brief FNV-1a hash, computed once when a string is interned and cached in ObjString::hash.
+ */
+[[nodiscard]] constexpr std::uint32_t hashString(std::string_view chars) {
+    std::uint32_t hash = 2166136261u;
+    for (const char c : chars) {
+        hash ^= static_cast<std::uint8_t>(c);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Hashes interned strings by their cached hash, so lookups keyed by ObjString* never touch the chars.
+ */
+struct ObjStringHash {
+    [[nodiscard]] std::size_t operator()(const ObjString *str) const { return str->hash; }
+};
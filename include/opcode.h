@@ -2,6 +2,14 @@
 
 #include <fmt/format.h>
 
+/**
+ * @brief Code generator and execution loop that is used for a chunk.
+ */
+enum class Backend : std::uint8_t {
+    Stack,
+    Register,
+};
+
 enum class OpCode : std::uint8_t {
     Constant,
     Nil,
@@ -10,9 +18,9 @@ enum class OpCode : std::uint8_t {
     Pop,
     GetLocal,
     SetLocal,
-    GetGlobal,
-    DefineGlobal,
-    SetGlobal,
+    GetGlobalSlot,
+    DefineGlobalSlot,
+    SetGlobalSlot,
     Equal,
     Greater,
     Less,
@@ -26,9 +34,162 @@ enum class OpCode : std::uint8_t {
     JumpIfFalse,
     Print,
     Loop,
+    // Variants with wider operands, the constant index and jump offsets take 24 bits and the local slot 16 bits
+    ConstantLong,
+    GetLocalWide,
+    SetLocalWide,
+    JumpLong,
+    JumpIfFalseLong,
+    LoopLong,
+    // Superinstructions, only emitted by fuseSuperinstructions()
+    AddLocals,
+    AddConstant,
+    NotEqual,
+    NotLess,
+    NotGreater,
+    JumpIfNotLess,
+    JumpIfNotGreater,
     Return,
 };
 
+/**
+ * @brief Size of the instruction in bytes, including its operands.
+ */
+[[nodiscard]] constexpr std::size_t instructionSize(OpCode opcode) {
+    switch (opcode) {
+        case OpCode::Constant:
+        case OpCode::GetLocal:
+        case OpCode::SetLocal:
+        case OpCode::AddConstant:
+            return 2;
+        case OpCode::GetLocalWide:
+        case OpCode::SetLocalWide:
+        case OpCode::GetGlobalSlot:
+        case OpCode::DefineGlobalSlot:
+        case OpCode::SetGlobalSlot:
+        case OpCode::Jump:
+        case OpCode::JumpIfFalse:
+        case OpCode::Loop:
+        case OpCode::AddLocals:
+        case OpCode::JumpIfNotLess:
+        case OpCode::JumpIfNotGreater:
+            return 3;
+        case OpCode::ConstantLong:
+        case OpCode::JumpLong:
+        case OpCode::JumpIfFalseLong:
+        case OpCode::LoopLong:
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+/**
+ * @brief Three-address instructions of the register backend. Operands are one byte registers
+ *        unless noted otherwise, the first operand is the destination.
+ */
+enum class RegOpCode : std::uint8_t {
+    LoadConstant,     // dst constant
+    LoadConstantLong, // dst constant(24)
+    LoadNil,          // dst
+    LoadTrue,         // dst
+    LoadFalse,        // dst
+    Move,             // dst src
+    GetGlobal,        // dst slot(16)
+    DefineGlobal,     // slot(16) src
+    SetGlobal,        // slot(16) src
+    Equal,            // dst a b
+    NotEqual,
+    Greater,
+    NotGreater,
+    Less,
+    NotLess,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Not,              // dst src
+    Negate,           // dst src
+    Jump,             // offset(16)
+    JumpIfFalse,      // src offset(16)
+    JumpIfTrue,       // src offset(16)
+    Loop,             // offset(16)
+    JumpLong,         // offset(24)
+    JumpIfFalseLong,  // src offset(24)
+    JumpIfTrueLong,   // src offset(24)
+    LoopLong,         // offset(24)
+    Print,            // src
+    Return,
+};
+
+/**
+ * @brief Size of the register instruction in bytes, including its operands.
+ */
+[[nodiscard]] constexpr std::size_t instructionSize(RegOpCode opcode) {
+    switch (opcode) {
+        case RegOpCode::Return:
+            return 1;
+        case RegOpCode::LoadNil:
+        case RegOpCode::LoadTrue:
+        case RegOpCode::LoadFalse:
+        case RegOpCode::Print:
+            return 2;
+        case RegOpCode::LoadConstant:
+        case RegOpCode::Move:
+        case RegOpCode::Not:
+        case RegOpCode::Negate:
+        case RegOpCode::Jump:
+        case RegOpCode::Loop:
+            return 3;
+        case RegOpCode::LoadConstantLong:
+        case RegOpCode::JumpIfFalseLong:
+        case RegOpCode::JumpIfTrueLong:
+            return 5;
+        default:
+            return 4;
+    }
+}
+
+[[nodiscard]] constexpr bool isJump(OpCode opcode) {
+    switch (opcode) {
+        case OpCode::Jump:
+        case OpCode::JumpIfFalse:
+        case OpCode::Loop:
+        case OpCode::JumpIfNotLess:
+        case OpCode::JumpIfNotGreater:
+        case OpCode::JumpLong:
+        case OpCode::JumpIfFalseLong:
+        case OpCode::LoopLong:
+            return true;
+        default:
+            return false;
+    }
+}
+
+[[nodiscard]] constexpr bool isLongJump(OpCode opcode) {
+    return opcode == OpCode::JumpLong || opcode == OpCode::JumpIfFalseLong || opcode == OpCode::LoopLong;
+}
+
+/**
+ * @brief Variant of a forward jump with a 24 bit offset, used once a chunk is too large for 16 bit jumps.
+ */
+[[nodiscard]] constexpr OpCode longJump(OpCode opcode) {
+    switch (opcode) {
+        case OpCode::Jump: return OpCode::JumpLong;
+        case OpCode::JumpIfFalse: return OpCode::JumpIfFalseLong;
+        default: return opcode;
+    }
+}
+
+[[nodiscard]] constexpr RegOpCode longJump(RegOpCode opcode) {
+    switch (opcode) {
+        case RegOpCode::Jump: return RegOpCode::JumpLong;
+        case RegOpCode::JumpIfFalse: return RegOpCode::JumpIfFalseLong;
+        case RegOpCode::JumpIfTrue: return RegOpCode::JumpIfTrueLong;
+        default: return opcode;
+    }
+}
+
 template<>
 struct fmt::formatter<OpCode> {
     template<typename ParseContext>
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "chunk.h"
+
+/**
+ * @brief How much work the Compiler spends on the emitted code. Superinstructions are
+ *        always fused, everything else is opt-in.
+ */
+enum class OptimizationLevel : std::uint8_t {
+    None,
+    Basic, // -O, cleanupControlFlow()
+};
+
+/**
+ * @brief Splits the chunk into basic blocks and simplifies its control flow. Chains of
+ *        jumps are threaded, JumpIfFalse behind a literal is decided at compile time,
+ *        literals that are popped right away, unreachable blocks and jumps to the next
+ *        instruction are removed. Jump offsets and lines are rewritten to match.
+ *        Only understands the instructions the Compiler emits, so it has to run before
+ *        fuseSuperinstructions().
+ */
+void cleanupControlFlow(Chunk& chunk);
+
+/**
+ * @brief Rewrites common instruction sequences emitted by the Compiler into single
+ *        superinstructions, e.g. `GetLocal a; GetLocal b; Add` into `AddLocals a b`.
+ *        Sequences are never fused if a jump lands in the middle of them. Jump offsets
+ *        and the line of every byte are rewritten to match the shorter code.
+ */
+void fuseSuperinstructions(Chunk& chunk);
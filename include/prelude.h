@@ -0,0 +1,11 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+
+/**
+ * @brief prelude/prelude.lox in the format of writeBytecodeFile(). The definition is generated
+ *        by tools/embed_prelude.cpp while building, so the prelude is never scanned or parsed
+ *        at runtime.
+ */
+[[nodiscard]] std::span<const std::uint8_t> preludeBytecode();
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include "chunk.h"
+#include "heap.h"
+#include "optimizer.h"
+#include "token_buffer.h"
+
+/**
+ * @brief A compiled script that depends on no VM. It holds a verified chunk together with
+ *        the heap of its constants and global names, which are permanent objects. VM::run()
+ *        executes the chunk in place and maps Chunk::globalNames to its own slots, nothing is
+ *        copied or loaded again. A Program is never modified after compiling and can be shared
+ *        by any number of threads.
+ */
+class Program {
+public:
+    // nullptr if the source does not compile, the errors are appended to `diagnostics`
+    [[nodiscard]] static std::shared_ptr<const Program> compile(std::string_view source, std::string& diagnostics,
+                                                                Backend backend = Backend::Stack,
+                                                                OptimizationLevel optimization = OptimizationLevel::None,
+                                                                Lexing lexing = Lexing::OnDemand);
+
+    [[nodiscard]] const Chunk& chunk() const { return m_chunk; }
+
+private:
+    Program() = default;
+
+private:
+    // owns the strings of the chunk, it never collects after compiling
+    Heap m_heap;
+    Chunk m_chunk;
+};
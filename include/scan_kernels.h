@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * @brief The hot loops of the Scanner. Every kernel starts at `p`, never reads at or behind
+ *        `end` and returns the first byte it does not skip, or `end`. The kernels that can
+ *        cross lines add the skipped newlines to `lines`.
+ *
+ *        The SIMD versions classify a whole vector of bytes at once and only finish the
+ *        last few bytes before `end` one at a time.
+ */
+struct ScanKernels {
+    // spaces, tabs, carriage returns and newlines
+    const char *(*skipBlanks)(const char *p, const char *end, std::size_t& lines);
+    // everything up to the newline that ends a comment
+    const char *(*skipComment)(const char *p, const char *end);
+    // letters, digits and underscores
+    const char *(*skipIdentifier)(const char *p, const char *end);
+    const char *(*skipDigits)(const char *p, const char *end);
+    // everything up to the closing quote of a string
+    const char *(*skipString)(const char *p, const char *end, std::size_t& lines);
+    const char *name;
+};
+
+// the fastest kernels this CPU supports, chosen on the first call
+[[nodiscard]] const ScanKernels& scanKernels();
+
+// every set of kernels this CPU supports, the scalar ones first
+[[nodiscard]] std::vector<const ScanKernels *> supportedScanKernels();
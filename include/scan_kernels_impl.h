@@ -0,0 +1,153 @@
+#pragma once
+
+// Only included by the translation units in src/scan_kernels*.cpp. Every one of them is
+// compiled for a different instruction set, so nothing in here may have external linkage,
+// otherwise the linker could pick an AVX2 copy for code that runs on every CPU.
+
+#include <cstddef>
+#include <cstdint>
+#include "scan_kernels.h"
+
+namespace {
+
+[[nodiscard]] inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+[[nodiscard]] inline bool isDigitChar(char c) {
+    return c >= '0' && c <= '9';
+}
+
+[[nodiscard]] inline bool isIdentifierChar(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || isDigitChar(c) || c == '_';
+}
+
+namespace scalar {
+
+const char *skipBlanks(const char *p, const char *end, std::size_t& lines) {
+    for (; p != end && isBlank(*p); ++p) {
+        lines += *p == '\n';
+    }
+    return p;
+}
+
+const char *skipComment(const char *p, const char *end) {
+    while (p != end && *p != '\n') {
+        ++p;
+    }
+    return p;
+}
+
+const char *skipIdentifier(const char *p, const char *end) {
+    while (p != end && isIdentifierChar(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+const char *skipDigits(const char *p, const char *end) {
+    while (p != end && isDigitChar(*p)) {
+        ++p;
+    }
+    return p;
+}
+
+const char *skipString(const char *p, const char *end, std::size_t& lines) {
+    for (; p != end && *p != '"'; ++p) {
+        lines += *p == '\n';
+    }
+    return p;
+}
+
+} // namespace scalar
+
+/**
+ * Kernels for a vector type V that provides WIDTH, a FULL mask with one bit per byte, load(),
+ * splat(), eq(), either(), inRange() and mask(). A mask has bit i set if byte i matches.
+ */
+template <typename V>
+struct SimdKernels {
+    [[nodiscard]] static std::uint32_t identifierMask(const typename V::Vec chunk) {
+        // setting 0x20 folds the upper case letters onto the lower case ones
+        const auto letter = V::inRange(V::either(chunk, V::splat(0x20)), 'a', 'z');
+        const auto digit = V::inRange(chunk, '0', '9');
+        return V::mask(V::either(V::either(letter, digit), V::eq(chunk, V::splat('_'))));
+    }
+
+    // number of set bits in `newlines` below `count`, count is always smaller than 32
+    [[nodiscard]] static std::size_t linesBefore(std::uint32_t newlines, unsigned count) {
+        return static_cast<std::size_t>(__builtin_popcount(newlines & ((1u << count) - 1)));
+    }
+
+    static const char *skipBlanks(const char *p, const char *end, std::size_t& lines) {
+        for (; end - p >= static_cast<std::ptrdiff_t>(V::WIDTH); p += V::WIDTH) {
+            const auto chunk = V::load(p);
+            const auto newline = V::eq(chunk, V::splat('\n'));
+            const auto blank = V::either(V::either(newline, V::eq(chunk, V::splat(' '))),
+                                         V::either(V::eq(chunk, V::splat('\t')), V::eq(chunk, V::splat('\r'))));
+            const auto stop = ~V::mask(blank) & V::FULL;
+            const auto newlines = V::mask(newline);
+            if (stop != 0) {
+                const auto count = static_cast<unsigned>(__builtin_ctz(stop));
+                lines += linesBefore(newlines, count);
+                return p + count;
+            }
+            lines += static_cast<std::size_t>(__builtin_popcount(newlines));
+        }
+        return scalar::skipBlanks(p, end, lines);
+    }
+
+    static const char *skipComment(const char *p, const char *end) {
+        for (; end - p >= static_cast<std::ptrdiff_t>(V::WIDTH); p += V::WIDTH) {
+            if (const auto stop = V::mask(V::eq(V::load(p), V::splat('\n'))); stop != 0) {
+                return p + __builtin_ctz(stop);
+            }
+        }
+        return scalar::skipComment(p, end);
+    }
+
+    static const char *skipIdentifier(const char *p, const char *end) {
+        for (; end - p >= static_cast<std::ptrdiff_t>(V::WIDTH); p += V::WIDTH) {
+            if (const auto stop = ~identifierMask(V::load(p)) & V::FULL; stop != 0) {
+                return p + __builtin_ctz(stop);
+            }
+        }
+        return scalar::skipIdentifier(p, end);
+    }
+
+    static const char *skipDigits(const char *p, const char *end) {
+        for (; end - p >= static_cast<std::ptrdiff_t>(V::WIDTH); p += V::WIDTH) {
+            if (const auto stop = ~V::mask(V::inRange(V::load(p), '0', '9')) & V::FULL; stop != 0) {
+                return p + __builtin_ctz(stop);
+            }
+        }
+        return scalar::skipDigits(p, end);
+    }
+
+    static const char *skipString(const char *p, const char *end, std::size_t& lines) {
+        for (; end - p >= static_cast<std::ptrdiff_t>(V::WIDTH); p += V::WIDTH) {
+            const auto chunk = V::load(p);
+            const auto newlines = V::mask(V::eq(chunk, V::splat('\n')));
+            if (const auto stop = V::mask(V::eq(chunk, V::splat('"'))); stop != 0) {
+                const auto count = static_cast<unsigned>(__builtin_ctz(stop));
+                lines += linesBefore(newlines, count);
+                return p + count;
+            }
+            lines += static_cast<std::size_t>(__builtin_popcount(newlines));
+        }
+        return scalar::skipString(p, end, lines);
+    }
+
+    static constexpr ScanKernels kernels(const char *name) {
+        return ScanKernels {
+            .skipBlanks { skipBlanks },
+            .skipComment { skipComment },
+            .skipIdentifier { skipIdentifier },
+            .skipDigits { skipDigits },
+            .skipString { skipString },
+            .name { name },
+        };
+    }
+};
+
+} // namespace
@@ -1,11 +1,15 @@
 #pragma once
 
+#include "scan_kernels.h"
 #include "token.h"
 #include <string_view>
 
 struct Scanner {
     Scanner() = default;
+    // scans up to the NUL terminator
     Scanner(const char *source);
+    // scans exactly the characters of `source`, no terminator is needed
+    explicit Scanner(std::string_view source);
 
     [[nodiscard]] Token scanToken();
 
@@ -18,7 +22,8 @@ private:
     [[nodiscard]] char peek() const;
     [[nodiscard]] char peekNext() const;
     [[nodiscard]] bool match(char expected);
-    [[nodiscard]] bool isAlpha(char c);
+    [[nodiscard]] static bool isAlpha(char c);
+    [[nodiscard]] static bool isDigit(char c);
 
     [[nodiscard]] TokenType identifierType();
     [[nodiscard]] TokenType checkKeyword(std::size_t start, std::size_t length, const char *rest, TokenType type);
@@ -32,5 +37,8 @@ private:
 public:
     const char *m_start { nullptr };
     const char *m_current { nullptr };
+    // one past the last character, nothing at or behind it is read
+    const char *m_end { nullptr };
     std::size_t m_line = 1;
+    const ScanKernels *m_kernels { &scanKernels() };
 };
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include "mapped_file.h"
+
+/**
+ * @brief Text of a script. Regular files are mapped without copying them, pipes, terminals
+ *        and other streams that cannot be mapped are read in large blocks. The text is always
+ *        followed by a zero byte, but the Scanner does not depend on it.
+ */
+class SourceFile {
+public:
+    // std::nullopt if the file cannot be read, the problem is appended to `diagnostics` or
+    // printed to stderr without one
+    [[nodiscard]] static std::optional<SourceFile> load(const std::filesystem::path& path, std::string *diagnostics = nullptr);
+    // reads everything up to the end of the stream, used for stdin
+    [[nodiscard]] static std::optional<SourceFile> read(int fd);
+
+    [[nodiscard]] std::string_view text() const;
+    [[nodiscard]] bool isMapped() const { return m_mapping != nullptr; }
+
+private:
+    std::shared_ptr<const MappedFile> m_mapping;
+    std::string m_buffer;
+};
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <vector>
+#include "token.h"
+
+// value of a number literal, literals too big for a double are infinite
+[[nodiscard]] double parseNumberLiteral(std::string_view text);
+
+// how the compiler gets its tokens
+enum class Lexing : std::uint8_t {
+    OnDemand, // the scanner runs while parsing
+    Ahead,    // the whole source is lexed into a TokenBuffer first
+};
+
+/**
+ * @brief Every token of a source, lexed before parsing starts into parallel arrays. A token
+ *        takes 9 bytes instead of the 32 of a Token, lines are only stored where they change
+ *        and number literals are parsed once while lexing.
+ *
+ *        Offsets are 32 bits, see fits(). The source has to outlive the buffer.
+ */
+class TokenBuffer {
+public:
+    // position of a parser in the buffer, next() moves it one token ahead
+    struct Cursor {
+        std::size_t token { 0 };
+        std::size_t lineRun { 0 };
+        // number literals before `token`
+        std::size_t numbers { 0 };
+    };
+
+    // a token together with its value if it is a number literal
+    struct Lexeme {
+        Token token;
+        double number { 0 };
+    };
+
+    explicit TokenBuffer(std::string_view source);
+
+    [[nodiscard]] static bool fits(std::string_view source) { return source.size() <= UINT32_MAX; }
+
+    // the token at the cursor, the Eof token is returned again and again at the end
+    [[nodiscard]] Lexeme next(Cursor& cursor) const;
+    // value of the index-th number literal of the source
+    [[nodiscard]] double number(std::size_t index) const { return m_numbers[index]; }
+
+    [[nodiscard]] std::size_t size() const { return m_types.size(); }
+    [[nodiscard]] TokenType type(std::size_t index) const { return m_types[index]; }
+
+private:
+    struct LineRun {
+        std::uint32_t firstToken;
+        std::uint32_t line;
+    };
+
+    const char *m_source;
+    std::vector<TokenType> m_types;
+    std::vector<std::uint32_t> m_offsets;
+    std::vector<std::uint32_t> m_lengths;
+    std::vector<LineRun> m_lines;
+    std::vector<double> m_numbers;
+    // messages of the error tokens, the offset of an error token is an index into it
+    std::vector<const char *> m_errors;
+};
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <fmt/format.h>
+#include <string>
+#include <variant>
+#include "object.h"
+
+// StackAllocated DataTypes
+using Number = double;
+using Bool = bool;
+using Nil = std::monostate;
+
+#ifdef NAN_BOXING
+
+/**
+ * @brief 8 byte Value that stores every type inside the bits of a double.
+ *
+ *        Every double which is not a quiet NaN is a Number. The quiet NaN space is used
+ *        to store Nil and Bool as small tags and Obj pointers with the sign bit set.
+ */
+class Value {
+public:
+    static constexpr std::uint64_t SIGN_BIT { 0x8000000000000000 };
+    static constexpr std::uint64_t QNAN { 0x7ffc000000000000 };
+
+    static constexpr std::uint64_t TAG_NIL { 1 };
+    static constexpr std::uint64_t TAG_FALSE { 2 };
+    static constexpr std::uint64_t TAG_TRUE { 3 };
+
+    constexpr Value() : m_bits(QNAN | TAG_NIL) {}
+    constexpr Value(Nil) : m_bits(QNAN | TAG_NIL) {}
+    constexpr Value(Bool b) : m_bits(b ? (QNAN | TAG_TRUE) : (QNAN | TAG_FALSE)) {}
+    constexpr Value(Number n) : m_bits(std::bit_cast<std::uint64_t>(n)) {}
+    Value(Obj *obj) : m_bits(SIGN_BIT | QNAN | reinterpret_cast<std::uintptr_t>(obj)) {}
+
+    // a string literal would silently be converted to Bool
+    Value(const char *) = delete;
+
+    [[nodiscard]] constexpr bool isNumber() const { return (m_bits & QNAN) != QNAN; }
+    [[nodiscard]] constexpr bool isNil() const { return m_bits == (QNAN | TAG_NIL); }
+    [[nodiscard]] constexpr bool isBool() const { return (m_bits | 1) == (QNAN | TAG_TRUE); }
+    [[nodiscard]] constexpr bool isObj() const { return (m_bits & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT); }
+
+    [[nodiscard]] constexpr Number asNumber() const { return std::bit_cast<Number>(m_bits); }
+    [[nodiscard]] constexpr Bool asBool() const { return m_bits == (QNAN | TAG_TRUE); }
+    [[nodiscard]] Obj *asObj() const { return reinterpret_cast<Obj *>(static_cast<std::uintptr_t>(m_bits & ~(SIGN_BIT | QNAN))); }
+
+    [[nodiscard]] constexpr std::uint64_t bits() const { return m_bits; }
+
+private:
+    std::uint64_t m_bits;
+};
+
+static_assert(sizeof(Value) == 8, "NaN boxed Value has to fit in a single double.");
+
+#else
+
+// Value Variant holding all types, HeapAllocated types are only referenced by pointer
+using Value = std::variant<Bool, Number, Nil, Obj *>;
+
+#endif
+
+/**
+ * @brief Checks if the Value holds one of the stack allocated types (Bool, Number, Nil).
+ */
+template <typename Type>
+static bool holds_type(const Value& value) {
+#ifdef NAN_BOXING
+    if constexpr (std::is_same_v<Type, Number>) {
+        return value.isNumber();
+    } else if constexpr (std::is_same_v<Type, Bool>) {
+        return value.isBool();
+    } else {
+        static_assert(std::is_same_v<Type, Nil>, "holds_type only works for Number, Bool and Nil.");
+        return value.isNil();
+    }
+#else
+    return std::holds_alternative<Type>(value);
+#endif
+}
+
+template <typename Type>
+static Type get_type_unchecked(const Value& value) {
+#ifdef NAN_BOXING
+    if constexpr (std::is_same_v<Type, Number>) {
+        return value.asNumber();
+    } else if constexpr (std::is_same_v<Type, Bool>) {
+        return value.asBool();
+    } else {
+        static_assert(std::is_same_v<Type, Nil>, "get_type_unchecked only works for Number, Bool and Nil.");
+        return Nil{};
+    }
+#else
+    return std::get<Type>(value);
+#endif
+}
+
+/**
+ * @brief Sentinel for global slots that the compiler resolved but the script never defined.
+ *        It is a null Obj pointer, so it can never be confused with a real Value.
+ */
+inline Value undefined_value() {
+    return Value { static_cast<Obj *>(nullptr) };
+}
+
+inline bool is_undefined(const Value& value) {
+#ifdef NAN_BOXING
+    return value.bits() == (Value::SIGN_BIT | Value::QNAN);
+#else
+    return std::holds_alternative<Obj *>(value) && std::get<Obj *>(value) == nullptr;
+#endif
+}
+
+template <typename ObjT>
+static bool holds_obj_type(const Value& value) {
+#ifdef NAN_BOXING
+    return value.isObj() && value.asObj()->type == ObjT::TYPE;
+#else
+    return (std::holds_alternative<Obj *>(value) && std::get<Obj *>(value)->type == ObjT::TYPE);
+#endif
+}
+
+template <typename ObjT>
+static ObjT *get_objtype_unchecked(const Value& value) {
+#ifdef NAN_BOXING
+    return static_cast<ObjT *>(value.asObj());
+#else
+    return static_cast<ObjT *>(std::get<Obj *>(value));
+#endif
+}
+
+/**
+ * @brief Checks if the Value is a string, no matter if it is flat or a rope.
+ */
+inline bool holds_string(const Value& value) {
+#ifdef NAN_BOXING
+    return value.isObj() && value.asObj() != nullptr && isString(value.asObj());
+#else
+    return std::holds_alternative<Obj *>(value) && std::get<Obj *>(value) != nullptr && isString(std::get<Obj *>(value));
+#endif
+}
+
+/**
+ * @brief Calls the visitor with the type that is stored in the Value.
+ */
+template <typename Visitor>
+static decltype(auto) visitValue(Visitor&& visitor, const Value& value) {
+#ifdef NAN_BOXING
+    if (value.isNumber()) {
+        return visitor(value.asNumber());
+    } else if (value.isBool()) {
+        return visitor(value.asBool());
+    } else if (value.isObj()) {
+        return visitor(value.asObj());
+    }
+    return visitor(Nil{});
+#else
+    return std::visit(std::forward<Visitor>(visitor), value);
+#endif
+}
+
+template <typename Visitor>
+static decltype(auto) visitValues(Visitor&& visitor, const Value& a, const Value& b) {
+#ifdef NAN_BOXING
+    return visitValue([&](const auto& lhs) {
+        return visitValue([&](const auto& rhs) { return visitor(lhs, rhs); }, b);
+    }, a);
+#else
+    return std::visit(std::forward<Visitor>(visitor), a, b);
+#endif
+}
+
+/**
+ * @brief Visitor that returns the string representation of every case in the Value variant.
+ *        IMPORTANT all the types in the Value variant have to be printable by fmt::format or
+ *        should have a special case defined.
+ */
+struct PrintVisitor {
+    // Base case for Obj Value
+    std::string operator()(Obj *obj) {
+        switch (obj->type) {
+            case ObjType::String: return static_cast<ObjString *>(obj)->chars;
+            case ObjType::Rope: return ropeToString(static_cast<ObjRope *>(obj));
+        }
+        return "<obj>";
+    }
+
+    // The Nil (std::monostate) variant cannot be formatted by fmt::format by default, so we can catch it here.
+    std::string operator()(Nil) { return "Nil"; }
+    std::string operator()(Bool b) { return b ? "true" : "false"; }
+
+    // This matches every other type than std::monostate.
+    std::string operator()(const auto& x) { return fmt::format("{}", x); }
+};
+
+/**
+ * @brief Visitor that checks if the values holds in two different
+ *        std::variants are the same type and the same value. It returns false
+ *        in every other case.
+ *        Strings are interned, so comparing two Obj pointers is enough.
+ */
+struct EqualityVisitor {
+    // If the types are the same, they have to implement operator==
+    template<typename T>
+    bool operator()(const T& a, const T& b) {
+        return a == b;
+    }
+
+    template<typename T, typename U>
+    bool operator()(const T&, const U&) {
+#ifdef DEBUG_PRINT_CODE
+        fmt::print(stderr, "Equality operator failed with different types.");
+#endif
+        return false;
+    }
+};
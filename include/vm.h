@@ -1,11 +1,15 @@
 #pragma once
 
+#include "bytecode_file.h"
+#include "program.h"
 #include "chunk.h"
 #include "token.h"
 #include "compiler.h"
+#include "globals.h"
+#include "heap.h"
 #include <memory>
 #include <stack>
-#include <unordered_map>
+#include <vector>
 
 enum class InterpretResult : std::uint8_t {
     Ok,
@@ -13,44 +17,130 @@ enum class InterpretResult : std::uint8_t {
     RuntimeError,
 };
 
-// we have to push b in the error case since we can't peek the stack beforehand
-#define BINARY_OP(op) \
+// only usable inside VM::run() since it syncs the local instruction pointer before reporting an error
+#define BINARY_OP(op) BINARY_OP_RESULT(a_value op b_value)
+
+// replaces the left operand with any expression of the two operands a_value and b_value, e.g. not (a_value < b_value)
+#define BINARY_OP_RESULT(result) \
     do { \
-      auto b = m_stack.back(); \
-      if (not std::holds_alternative<Number>(b)) { \
+      const auto& b = peek(0); \
+      auto& a = peek(1); \
+      if (not holds_type<Number>(a) || not holds_type<Number>(b)) { \
+        m_ip = ip; \
         runtimeError("Operands must be numbers."); \
         return InterpretResult::RuntimeError; \
-      }\
-      m_stack.pop_back(); \
-      auto a = m_stack.back(); \
-      if (not std::holds_alternative<Number>(a)) {\
+      } \
+      const auto a_value = get_type_unchecked<Number>(a); \
+      const auto b_value = get_type_unchecked<Number>(b); \
+      a = (result); \
+      m_stackTop--; \
+    } while (false)
+
+// pushes a value and reports a runtime error if the stack is full, only usable inside VM::run()
+#define PUSH(value) \
+    do { \
+      if (m_stackTop == m_stackEnd) { \
+        m_ip = ip; \
+        runtimeError("Stack overflow."); \
+        return InterpretResult::RuntimeError; \
+      } \
+      *m_stackTop++ = (value); \
+    } while (false)
+
+// register version of BINARY_OP_RESULT, reads the three operands of the instruction itself
+// only usable inside VM::runRegisters()
+#define REGISTER_BINARY_OP(result) \
+    do { \
+      const auto dst = readByte(); \
+      const auto& a = registers[readByte()]; \
+      const auto& b = registers[readByte()]; \
+      if (not holds_type<Number>(a) || not holds_type<Number>(b)) { \
+        m_ip = ip; \
         runtimeError("Operands must be numbers."); \
-        m_stack.emplace_back(b); \
         return InterpretResult::RuntimeError; \
-      }\
-      m_stack.pop_back(); \
-      const auto a_value = std::get<Number>(a);\
-      const auto b_value = std::get<Number>(b);\
-      m_stack.emplace_back(a_value op b_value); \
+      } \
+      const auto a_value = get_type_unchecked<Number>(a); \
+      const auto b_value = get_type_unchecked<Number>(b); \
+      registers[dst] = (result); \
     } while (false)
 
+// unmaps the stack of a VM, see VM::VM()
+struct StackDeleter {
+    std::size_t size;
+    void operator()(Value *stack) const;
+};
+
+/**
+ * @brief An isolate with its own stack, globals and heap. A VM is used by one thread at a
+ *        time, but VMs share no state, so every thread can run its own VM. They can all run
+ *        the same Program, which is never copied or modified.
+ */
 class VM {
 public:
-    VM() = default;
-    [[nodiscard]] InterpretResult interpret(const std::string_view source);
+    // every local a wide instruction can address plus as much room again for expressions
+    static constexpr std::size_t STACK_MAX { (UINT16_MAX + 1) * 2 };
+
+    // starts with the globals of the embedded prelude already defined
+    explicit VM(std::size_t stackSize = STACK_MAX);
+
+    [[nodiscard]] InterpretResult interpret(const std::string_view source, Backend backend = Backend::Stack);
+    // runs a chunk that was written by writeBytecodeFile(), with the backend it was compiled for
+    [[nodiscard]] InterpretResult runBytecodeFile(const std::filesystem::path& path);
+    // runs a Program compiled on any thread, the VM keeps it alive since its values may reference the program's strings
+    [[nodiscard]] InterpretResult run(std::shared_ptr<const Program> program);
+    // compiles against the globals of this VM, the file still runs in any VM
+    [[nodiscard]] bool compileBytecodeFile(const std::string_view source, const std::filesystem::path& path, Backend backend = Backend::Stack);
+
+    // applies to every following interpret() call
+    void setOptimizationLevel(OptimizationLevel level) { m_optimization = level; }
+    // the values of print statements are appended to `sink` instead of being written to stdout
+    void printTo(std::string& sink) { m_output = &sink; }
+    // compile and runtime errors are appended to `sink` instead of being printed to stderr
+    void reportTo(std::string& sink) { m_diagnostics = &sink; }
+    // the listings and the execution trace of a debug build are appended to `sink` instead of being written to stdout
+    void traceTo(std::string& sink) { m_debugOutput = &sink; }
+
+    // runs a whole collection, the roots are the stack, the globals and the current chunk
+    void collectGarbage();
+    [[nodiscard]] Heap& heap() { return m_heap; }
 private:
     void runtimeError(const std::string& msg);
+    void print(const Value& value);
     void resetStack(); 
     void concatenate();
+    [[nodiscard]] Obj *concatenate(const Value& a, const Value& b);
+    [[nodiscard]] Value flatten(const Value& value);
+    [[nodiscard]] InterpretResult execute(std::shared_ptr<const Chunk> chunk);
     [[nodiscard]] InterpretResult run();
+    [[nodiscard]] InterpretResult runRegisters();
+    void markRoots(Heap& heap);
     [[nodiscard]] bool isFalsey(const Value& value);
     [[nodiscard]] bool valuesEqual(const Value& a, const Value& b);
-    [[nodiscard]] Value peek(std::size_t many = 0);
-    [[nodiscard]] Value pop();
+    [[nodiscard]] Value& peek(std::size_t distance = 0);
+    [[nodiscard]] const Value& pop();
+#ifdef DEBUG_TRACE_EXECUTION
+    void traceExecution();
+#endif
 
 private:
-    std::unique_ptr<Chunk> m_chunk;
-    std::vector<std::uint8_t>::const_iterator m_ip;
-    std::vector<Value> m_stack;
-    std::unordered_map<std::string, Value> globals;
+    std::shared_ptr<const Chunk> m_chunk;
+    // the slot in `globals` of every global operand of the current chunk
+    std::vector<std::size_t> m_globalSlots;
+    // every Program that ran, the globals may still hold its strings
+    std::vector<std::shared_ptr<const Program>> m_programs;
+    OptimizationLevel m_optimization { OptimizationLevel::None };
+    const std::uint8_t *m_ip { nullptr };
+    std::unique_ptr<Value[], StackDeleter> m_stack;
+    // one past the top most value
+    Value *m_stackTop;
+    Value *m_stackEnd;
+    Heap m_heap;
+    Globals globals;
+    std::string *m_output { nullptr };
+    std::string *m_diagnostics { nullptr };
+    std::string *m_debugOutput { nullptr };
+#ifdef DEBUG_TRACE_EXECUTION
+    // off while the constructor runs the prelude, before a sink for the trace can be set
+    bool m_trace { false };
+#endif
 };
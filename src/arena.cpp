@@ -0,0 +1,40 @@
+#include "arena.h"
+#include <new>
+
+void *Arena::allocate(std::size_t size) {
+    const auto index = sizeClass(size);
+    if (index == SIZE_CLASSES.size()) {
+        return ::operator new(size);
+    }
+
+    if (m_freeLists[index] == nullptr) {
+        refill(index);
+    }
+    FreeSlot *slot = m_freeLists[index];
+    m_freeLists[index] = slot->next;
+    return slot;
+}
+
+void Arena::deallocate(void *pointer, std::size_t size) {
+    const auto index = sizeClass(size);
+    if (index == SIZE_CLASSES.size()) {
+        ::operator delete(pointer);
+        return;
+    }
+
+    auto *slot = static_cast<FreeSlot *>(pointer);
+    slot->next = m_freeLists[index];
+    m_freeLists[index] = slot;
+}
+
+void Arena::refill(std::size_t sizeClass) {
+    const auto slotSize = SIZE_CLASSES[sizeClass];
+    auto& block = m_blocks.emplace_back(std::make_unique_for_overwrite<std::byte[]>(BLOCK_SIZE));
+
+    // the slots are pushed in reverse, so the first allocations are next to each other
+    for (std::size_t i = BLOCK_SIZE / slotSize; i-- > 0;) {
+        auto *slot = reinterpret_cast<FreeSlot *>(block.get() + i * slotSize);
+        slot->next = m_freeLists[sizeClass];
+        m_freeLists[sizeClass] = slot;
+    }
+}
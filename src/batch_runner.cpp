@@ -0,0 +1,162 @@
+#include "batch_runner.h"
+#include <algorithm>
+#include <deque>
+#include <fmt/format.h>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include "source_file.h"
+
+namespace {
+
+/**
+ * @brief One queue of script indices per worker. The owner takes from the front of its
+ *        queue and thieves take from the back, so they only meet on the last script.
+ */
+class WorkQueues {
+public:
+    // deals the indices out in contiguous blocks, one per worker
+    WorkQueues(std::size_t count, std::size_t workers) : m_queues(workers) {
+        for (std::size_t index = 0; index < count; ++index) {
+            m_queues[index * workers / count].indices.push_back(index);
+        }
+    }
+
+    [[nodiscard]] std::optional<std::size_t> next(std::size_t worker) {
+        if (auto index = take(m_queues[worker], false)) {
+            return index;
+        }
+        // nothing is ever added, so once every queue was seen empty the batch is done
+        for (std::size_t i = 1; i < m_queues.size(); ++i) {
+            if (auto index = take(m_queues[(worker + i) % m_queues.size()], true)) {
+                return index;
+            }
+        }
+        return std::nullopt;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::size_t> indices;
+    };
+
+    [[nodiscard]] static std::optional<std::size_t> take(Queue& queue, bool steal) {
+        std::scoped_lock lock(queue.mutex);
+        if (queue.indices.empty()) {
+            return std::nullopt;
+        }
+        if (steal) {
+            const auto index = queue.indices.back();
+            queue.indices.pop_back();
+            return index;
+        }
+        const auto index = queue.indices.front();
+        queue.indices.pop_front();
+        return index;
+    }
+
+private:
+    std::vector<Queue> m_queues;
+};
+
+void runScript(ScriptResult& script, const CompileOptions& options) {
+    const auto start = std::chrono::steady_clock::now();
+    if (const auto source = SourceFile::load(script.path, &script.diagnostics)) {
+        VM vm;
+        vm.setOptimizationLevel(options.optimization);
+        vm.printTo(script.output);
+        vm.reportTo(script.diagnostics);
+        // the listings and the trace of a debug build are neither output nor errors of the script
+        std::string debugOutput;
+        vm.traceTo(debugOutput);
+        script.result = vm.interpret(source->text(), options.backend);
+    } else {
+        script.result = InterpretResult::CompileError;
+    }
+    script.wallTime = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+}
+
+std::string_view statusName(InterpretResult result) {
+    switch (result) {
+        case InterpretResult::Ok: return "ok";
+        case InterpretResult::CompileError: return "compile_error";
+        case InterpretResult::RuntimeError: return "runtime_error";
+    }
+    return "unknown";
+}
+
+void appendJsonString(std::string& json, std::string_view text) {
+    json += '"';
+    for (const auto c : text) {
+        switch (c) {
+            case '"': json += "\\\""; break;
+            case '\\': json += "\\\\"; break;
+            case '\n': json += "\\n"; break;
+            case '\r': json += "\\r"; break;
+            case '\t': json += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    json += fmt::format("\\u{:04x}", static_cast<unsigned>(c));
+                } else {
+                    json += c;
+                }
+        }
+    }
+    json += '"';
+}
+
+} // namespace
+
+std::vector<std::filesystem::path> findScripts(const std::filesystem::path& directory) {
+    std::vector<std::filesystem::path> paths;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(directory)) {
+        if (entry.is_regular_file() && entry.path().extension() == ".lox") {
+            paths.push_back(entry.path());
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    return paths;
+}
+
+std::vector<ScriptResult> runScripts(std::span<const std::filesystem::path> paths, const CompileOptions& options) {
+    std::vector<ScriptResult> scripts(paths.size());
+    for (std::size_t i = 0; i < paths.size(); ++i) {
+        scripts[i].path = paths[i];
+    }
+    if (scripts.empty()) {
+        return scripts;
+    }
+
+    const auto threads = std::min<std::size_t>(options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency()), scripts.size());
+    WorkQueues queues(scripts.size(), threads);
+    const auto work = [&](std::size_t worker) {
+        while (const auto index = queues.next(worker)) {
+            runScript(scripts[*index], options);
+        }
+    };
+    {
+        std::vector<std::jthread> workers;
+        for (std::size_t worker = 1; worker < threads; ++worker) {
+            workers.emplace_back(work, worker);
+        }
+        work(0);
+    }
+    return scripts;
+}
+
+std::string resultsToJson(std::span<const ScriptResult> results) {
+    std::string json = "{\"scripts\": [";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const auto& script = results[i];
+        json += i == 0 ? "\n  {\"path\": " : ",\n  {\"path\": ";
+        appendJsonString(json, script.path.string());
+        json += fmt::format(", \"status\": \"{}\", \"wall_time_us\": {}, \"stdout\": ", statusName(script.result), script.wallTime.count());
+        appendJsonString(json, script.output);
+        json += ", \"stderr\": ";
+        appendJsonString(json, script.diagnostics);
+        json += "}";
+    }
+    json += results.empty() ? "]}\n" : "\n]}\n";
+    return json;
+}
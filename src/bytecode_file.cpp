@@ -0,0 +1,635 @@
+#include "bytecode_file.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <fstream>
+#include <initializer_list>
+#include <limits>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace {
+
+constexpr std::array<std::uint8_t, 4> MAGIC { 'L', 'O', 'X', 'C' };
+
+enum class ConstantTag : std::uint8_t {
+    Nil,
+    False,
+    True,
+    Number,
+    String,
+};
+
+// appends the message to the sink if there is one, otherwise it goes to stderr
+void report(std::string *diagnostics, const std::string& message) {
+    if (diagnostics != nullptr) {
+        *diagnostics += message;
+    } else {
+        fmt::print(stderr, "{}", message);
+    }
+}
+
+std::uint32_t checksum(std::span<const std::uint8_t> bytes) {
+    return hashString(std::string_view(reinterpret_cast<const char *>(bytes.data()), bytes.size()));
+}
+
+class Writer {
+public:
+    void u8(std::uint8_t value) { m_bytes.push_back(value); }
+    void u16(std::uint16_t value) { little(value, 2); }
+    void u32(std::size_t value) { little(value, 4); }
+    void u64(std::uint64_t value) { little(value, 8); }
+    void string(std::string_view chars) {
+        u32(chars.size());
+        m_bytes.insert(m_bytes.end(), chars.begin(), chars.end());
+    }
+    void bytes(std::span<const std::uint8_t> data) { m_bytes.insert(m_bytes.end(), data.begin(), data.end()); }
+
+    // writes a u32 at an offset that was already written
+    void patch32(std::size_t offset, std::uint32_t value) {
+        for (std::size_t i = 0; i < 4; ++i) {
+            m_bytes[offset + i] = static_cast<std::uint8_t>(value >> (8 * i));
+        }
+    }
+
+    [[nodiscard]] std::vector<std::uint8_t>& result() { return m_bytes; }
+
+private:
+    void little(std::uint64_t value, std::size_t size) {
+        for (std::size_t i = 0; i < size; ++i) {
+            m_bytes.push_back(static_cast<std::uint8_t>(value >> (8 * i)));
+        }
+    }
+
+private:
+    std::vector<std::uint8_t> m_bytes;
+};
+
+// every read past the end yields zero and marks the reader as failed
+class Reader {
+public:
+    explicit Reader(std::span<const std::uint8_t> bytes) : m_bytes(bytes) {}
+
+    [[nodiscard]] std::uint8_t u8() { return static_cast<std::uint8_t>(little(1)); }
+    [[nodiscard]] std::uint16_t u16() { return static_cast<std::uint16_t>(little(2)); }
+    [[nodiscard]] std::uint32_t u32() { return static_cast<std::uint32_t>(little(4)); }
+    [[nodiscard]] std::uint64_t u64() { return little(8); }
+    [[nodiscard]] std::span<const std::uint8_t> bytes(std::size_t size) {
+        if (not fits(size)) {
+            return {};
+        }
+        const auto result = m_bytes.subspan(m_offset, size);
+        m_offset += size;
+        return result;
+    }
+    [[nodiscard]] std::string_view string() {
+        const auto chars = bytes(u32());
+        return { reinterpret_cast<const char *>(chars.data()), chars.size() };
+    }
+
+    [[nodiscard]] bool failed() const { return m_failed; }
+    [[nodiscard]] bool atEnd() const { return m_offset == m_bytes.size(); }
+
+private:
+    [[nodiscard]] bool fits(std::size_t size) {
+        if (m_failed || m_bytes.size() - m_offset < size) {
+            m_failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    [[nodiscard]] std::uint64_t little(std::size_t size) {
+        if (not fits(size)) {
+            return 0;
+        }
+        std::uint64_t value = 0;
+        for (std::size_t i = 0; i < size; ++i) {
+            value |= static_cast<std::uint64_t>(m_bytes[m_offset + i]) << (8 * i);
+        }
+        m_offset += size;
+        return value;
+    }
+
+private:
+    std::span<const std::uint8_t> m_bytes;
+    std::size_t m_offset { 0 };
+    bool m_failed { false };
+};
+
+std::optional<Value> readConstant(Reader& reader, Heap& heap) {
+    switch (static_cast<ConstantTag>(reader.u8())) {
+        case ConstantTag::Nil: return Value { Nil{} };
+        case ConstantTag::False: return Value { false };
+        case ConstantTag::True: return Value { true };
+        case ConstantTag::Number: return Value { std::bit_cast<Number>(reader.u64()) };
+        case ConstantTag::String: return Value { heap.copyString(reader.string()) };
+    }
+    return std::nullopt;
+}
+
+void writeConstant(Writer& writer, const Value& value) {
+    if (holds_type<Nil>(value)) {
+        writer.u8(static_cast<std::uint8_t>(ConstantTag::Nil));
+    } else if (holds_type<Bool>(value)) {
+        writer.u8(static_cast<std::uint8_t>(get_type_unchecked<Bool>(value) ? ConstantTag::True : ConstantTag::False));
+    } else if (holds_type<Number>(value)) {
+        writer.u8(static_cast<std::uint8_t>(ConstantTag::Number));
+        writer.u64(std::bit_cast<std::uint64_t>(get_type_unchecked<Number>(value)));
+    } else {
+        // the compiler only creates flat string constants
+        writer.u8(static_cast<std::uint8_t>(ConstantTag::String));
+        writer.string(get_objtype_unchecked<ObjString>(value)->chars);
+    }
+}
+
+enum class Operand : std::uint8_t {
+    Register,
+    Local8,
+    Local16,
+    Constant8,
+    Constant24,
+    Global16,
+    Forward16,
+    Backward16,
+    Forward24,
+    Backward24,
+};
+
+[[nodiscard]] constexpr std::size_t operandSize(Operand operand) {
+    switch (operand) {
+        case Operand::Register:
+        case Operand::Local8:
+        case Operand::Constant8:
+            return 1;
+        case Operand::Local16:
+        case Operand::Global16:
+        case Operand::Forward16:
+        case Operand::Backward16:
+            return 2;
+        case Operand::Constant24:
+        case Operand::Forward24:
+        case Operand::Backward24:
+            return 3;
+    }
+    return 0;
+}
+
+// at most three operands follow an opcode
+class Operands {
+public:
+    constexpr Operands(std::initializer_list<Operand> operands) : m_count(operands.size()) {
+        std::copy(operands.begin(), operands.end(), m_operands.begin());
+    }
+
+    [[nodiscard]] constexpr const Operand *begin() const { return m_operands.data(); }
+    [[nodiscard]] constexpr const Operand *end() const { return m_operands.data() + m_count; }
+
+private:
+    std::array<Operand, 3> m_operands {};
+    std::size_t m_count;
+};
+
+// the operands of every instruction in the order they follow the opcode, nullopt for unknown opcodes
+std::optional<Operands> operands(OpCode opcode) {
+    using enum Operand;
+    switch (opcode) {
+        case OpCode::Constant:
+        case OpCode::AddConstant:
+            return Operands { Constant8 };
+        case OpCode::ConstantLong: return Operands { Constant24 };
+        case OpCode::GetLocal:
+        case OpCode::SetLocal:
+            return Operands { Local8 };
+        case OpCode::GetLocalWide:
+        case OpCode::SetLocalWide:
+            return Operands { Local16 };
+        case OpCode::AddLocals: return Operands { Local8, Local8 };
+        case OpCode::GetGlobalSlot:
+        case OpCode::DefineGlobalSlot:
+        case OpCode::SetGlobalSlot:
+            return Operands { Global16 };
+        case OpCode::Jump:
+        case OpCode::JumpIfFalse:
+        case OpCode::JumpIfNotLess:
+        case OpCode::JumpIfNotGreater:
+            return Operands { Forward16 };
+        case OpCode::Loop: return Operands { Backward16 };
+        case OpCode::JumpLong:
+        case OpCode::JumpIfFalseLong:
+            return Operands { Forward24 };
+        case OpCode::LoopLong: return Operands { Backward24 };
+        case OpCode::Nil:
+        case OpCode::True:
+        case OpCode::False:
+        case OpCode::Pop:
+        case OpCode::Equal:
+        case OpCode::Greater:
+        case OpCode::Less:
+        case OpCode::Add:
+        case OpCode::Subtract:
+        case OpCode::Multiply:
+        case OpCode::Divide:
+        case OpCode::Not:
+        case OpCode::Negate:
+        case OpCode::Print:
+        case OpCode::NotEqual:
+        case OpCode::NotLess:
+        case OpCode::NotGreater:
+        case OpCode::Return:
+            return Operands {};
+    }
+    return std::nullopt;
+}
+
+std::optional<Operands> operands(RegOpCode opcode) {
+    using enum Operand;
+    switch (opcode) {
+        case RegOpCode::LoadConstant: return Operands { Register, Constant8 };
+        case RegOpCode::LoadConstantLong: return Operands { Register, Constant24 };
+        case RegOpCode::LoadNil:
+        case RegOpCode::LoadTrue:
+        case RegOpCode::LoadFalse:
+        case RegOpCode::Print:
+            return Operands { Register };
+        case RegOpCode::Move:
+        case RegOpCode::Not:
+        case RegOpCode::Negate:
+            return Operands { Register, Register };
+        case RegOpCode::GetGlobal: return Operands { Register, Global16 };
+        case RegOpCode::DefineGlobal:
+        case RegOpCode::SetGlobal:
+            return Operands { Global16, Register };
+        case RegOpCode::Equal:
+        case RegOpCode::NotEqual:
+        case RegOpCode::Greater:
+        case RegOpCode::NotGreater:
+        case RegOpCode::Less:
+        case RegOpCode::NotLess:
+        case RegOpCode::Add:
+        case RegOpCode::Subtract:
+        case RegOpCode::Multiply:
+        case RegOpCode::Divide:
+            return Operands { Register, Register, Register };
+        case RegOpCode::Jump: return Operands { Forward16 };
+        case RegOpCode::JumpIfFalse:
+        case RegOpCode::JumpIfTrue:
+            return Operands { Register, Forward16 };
+        case RegOpCode::Loop: return Operands { Backward16 };
+        case RegOpCode::JumpLong: return Operands { Forward24 };
+        case RegOpCode::JumpIfFalseLong:
+        case RegOpCode::JumpIfTrueLong:
+            return Operands { Register, Forward24 };
+        case RegOpCode::LoopLong: return Operands { Backward24 };
+        case RegOpCode::Return: return Operands {};
+    }
+    return std::nullopt;
+}
+
+// values a stack instruction needs on the stack and how it changes their number, on the
+// path that falls through and on the one that jumps
+struct StackEffect {
+    std::size_t needs { 0 };
+    std::ptrdiff_t next { 0 };
+    std::ptrdiff_t jump { 0 };
+    bool fallsThrough { true };
+};
+
+StackEffect stackEffect(OpCode opcode) {
+    switch (opcode) {
+        case OpCode::Constant:
+        case OpCode::ConstantLong:
+        case OpCode::Nil:
+        case OpCode::True:
+        case OpCode::False:
+        case OpCode::GetLocal:
+        case OpCode::GetLocalWide:
+        case OpCode::GetGlobalSlot:
+        case OpCode::AddLocals:
+            return StackEffect { .next { 1 } };
+        case OpCode::Pop:
+        case OpCode::Print:
+        case OpCode::DefineGlobalSlot:
+            return StackEffect { .needs { 1 }, .next { -1 } };
+        case OpCode::SetLocal:
+        case OpCode::SetLocalWide:
+        case OpCode::SetGlobalSlot:
+        case OpCode::Not:
+        case OpCode::Negate:
+        case OpCode::AddConstant:
+        case OpCode::JumpIfFalse:
+        case OpCode::JumpIfFalseLong:
+            return StackEffect { .needs { 1 } };
+        case OpCode::Equal:
+        case OpCode::Greater:
+        case OpCode::Less:
+        case OpCode::Add:
+        case OpCode::Subtract:
+        case OpCode::Multiply:
+        case OpCode::Divide:
+        case OpCode::NotEqual:
+        case OpCode::NotLess:
+        case OpCode::NotGreater:
+            return StackEffect { .needs { 2 }, .next { -1 } };
+        // the comparison replaces both operands, it is only popped if the jump is not taken
+        case OpCode::JumpIfNotLess:
+        case OpCode::JumpIfNotGreater:
+            return StackEffect { .needs { 2 }, .next { -2 }, .jump { -1 } };
+        case OpCode::Jump:
+        case OpCode::JumpLong:
+        case OpCode::Loop:
+        case OpCode::LoopLong:
+        case OpCode::Return:
+            return StackEffect { .fallsThrough { false } };
+    }
+    return StackEffect {};
+}
+
+// the register backend keeps everything in registers, the stack stays empty
+StackEffect stackEffect(RegOpCode opcode) {
+    switch (opcode) {
+        case RegOpCode::Jump:
+        case RegOpCode::JumpLong:
+        case RegOpCode::Loop:
+        case RegOpCode::LoopLong:
+        case RegOpCode::Return:
+            return StackEffect { .fallsThrough { false } };
+        default:
+            return StackEffect {};
+    }
+}
+
+struct Decoded {
+    std::size_t size { 1 };
+    std::array<std::size_t, 3> values {};
+    // offset the instruction can jump to
+    std::optional<std::size_t> target;
+};
+
+/**
+ * @brief Checks that the code can be executed without leaving the chunk or its part of the
+ *        stack. Every opcode is known, every instruction fits, every operand addresses an
+ *        existing constant, global and register and every jump lands on the start of an
+ *        instruction. Then every path through the code is followed from the start: the stack
+ *        holds as many values as an instruction pops, it has the same depth whichever path
+ *        reaches an instruction, a local is below the top of the stack and no path runs past
+ *        the last instruction. Returns the reason if the code is not valid.
+ */
+std::optional<std::string_view> verifyCode(std::span<const std::uint8_t> code, const Chunk& chunk, std::size_t globalCount) {
+    const bool registers = chunk.backend == Backend::Register;
+    const auto decode = [&](std::size_t offset, const Operands& layout) {
+        Decoded instruction;
+        for (const auto operand : layout) {
+            instruction.size += operandSize(operand);
+        }
+        std::size_t position = offset + 1;
+        std::size_t index = 0;
+        for (const auto operand : layout) {
+            std::size_t value = 0;
+            for (std::size_t i = 0; i < operandSize(operand); ++i) {
+                value = value << 8 | code[position++];
+            }
+            instruction.values[index++] = value;
+            const auto next = offset + instruction.size;
+            if (operand == Operand::Forward16 || operand == Operand::Forward24) {
+                instruction.target = next + value;
+            } else if (operand == Operand::Backward16 || operand == Operand::Backward24) {
+                // wraps around to an offset past the end if it jumps in front of the code
+                instruction.target = next - value;
+            }
+        }
+        return instruction;
+    };
+    const auto layoutAt = [&](std::size_t offset) {
+        return registers ? operands(static_cast<RegOpCode>(code[offset])) : operands(static_cast<OpCode>(code[offset]));
+    };
+
+    std::vector<bool> starts(code.size(), false);
+    std::vector<std::size_t> targets;
+    for (std::size_t offset = 0; offset < code.size();) {
+        starts[offset] = true;
+        const auto layout = layoutAt(offset);
+        if (not layout) {
+            return "unknown opcode";
+        }
+        std::size_t size = 1;
+        for (const auto operand : *layout) {
+            size += operandSize(operand);
+        }
+        if (code.size() - offset < size) {
+            return "truncated instruction";
+        }
+
+        const auto instruction = decode(offset, *layout);
+        const auto *value = instruction.values.data();
+        for (const auto operand : *layout) {
+            switch (operand) {
+                case Operand::Register:
+                    if (*value >= chunk.registerCount) {
+                        return "register out of range";
+                    }
+                    break;
+                case Operand::Constant8:
+                case Operand::Constant24:
+                    if (*value >= chunk.constants.size()) {
+                        return "constant out of range";
+                    }
+                    break;
+                case Operand::Global16:
+                    if (*value >= globalCount) {
+                        return "global out of range";
+                    }
+                    break;
+                default:
+                    break;
+            }
+            ++value;
+        }
+        if (instruction.target) {
+            targets.push_back(*instruction.target);
+        }
+        offset += size;
+    }
+    if (std::any_of(targets.begin(), targets.end(), [&](std::size_t target) { return target >= code.size() || not starts[target]; })) {
+        return "jump out of range";
+    }
+
+    // the depth of the stack in front of every instruction that can be reached
+    constexpr auto UNREACHED = std::numeric_limits<std::size_t>::max();
+    std::vector<std::size_t> depths(code.size(), UNREACHED);
+    std::vector<std::size_t> worklist;
+    const auto reach = [&](std::size_t offset, std::size_t depth) -> std::optional<std::string_view> {
+        if (offset >= code.size()) {
+            return "code runs past the end";
+        }
+        if (depths[offset] == UNREACHED) {
+            depths[offset] = depth;
+            worklist.push_back(offset);
+        } else if (depths[offset] != depth) {
+            return "stack depth differs between paths";
+        }
+        return std::nullopt;
+    };
+    if (const auto reason = reach(0, 0)) {
+        return reason;
+    }
+
+    while (not worklist.empty()) {
+        const auto offset = worklist.back();
+        worklist.pop_back();
+        const auto depth = depths[offset];
+        const auto layout = *layoutAt(offset);
+        const auto instruction = decode(offset, layout);
+        const auto effect = registers ? stackEffect(static_cast<RegOpCode>(code[offset])) : stackEffect(static_cast<OpCode>(code[offset]));
+        if (depth < effect.needs) {
+            return "stack underflow";
+        }
+
+        // locals live below the top of the stack, which the VM keeps inside its stack
+        const auto *value = instruction.values.data();
+        for (const auto operand : layout) {
+            if ((operand == Operand::Local8 || operand == Operand::Local16) && *value >= depth) {
+                return "local out of range";
+            }
+            ++value;
+        }
+
+        if (instruction.target) {
+            if (const auto reason = reach(*instruction.target, static_cast<std::size_t>(static_cast<std::ptrdiff_t>(depth) + effect.jump))) {
+                return reason;
+            }
+        }
+        if (effect.fallsThrough) {
+            if (const auto reason = reach(offset + instruction.size, static_cast<std::size_t>(static_cast<std::ptrdiff_t>(depth) + effect.next))) {
+                return reason;
+            }
+        }
+    }
+    return std::nullopt;
+}
+
+} // namespace
+
+std::vector<std::uint8_t> serializeChunk(const Chunk& chunk, const Globals& globals) {
+    const auto code = chunk.bytecode();
+
+    Writer writer;
+    writer.bytes(MAGIC);
+    writer.u16(BytecodeFile::VERSION);
+    writer.u8(static_cast<std::uint8_t>(chunk.backend));
+    writer.u8(0);
+    writer.u32(chunk.registerCount);
+    writer.u32(code.size());
+    writer.u32(0);
+
+    writer.bytes(code);
+    writer.u32(chunk.constants.size());
+    for (const auto& constant : chunk.constants) {
+        writeConstant(writer, constant);
+    }
+    writer.u32(globals.size());
+    for (std::size_t slot = 0; slot < globals.size(); ++slot) {
+        writer.string(globals.name(slot)->chars);
+    }
+    writer.u32(chunk.lines.runs().size());
+    for (const auto& run : chunk.lines.runs()) {
+        writer.u32(run.offset);
+        writer.u32(run.line);
+    }
+
+    auto& bytes = writer.result();
+    writer.patch32(BytecodeFile::HEADER_SIZE - 4, checksum(std::span(bytes).subspan(BytecodeFile::HEADER_SIZE)));
+    return std::move(bytes);
+}
+
+bool writeBytecodeFile(const std::filesystem::path& path, const Chunk& chunk, const Globals& globals) {
+    const auto bytes = serializeChunk(chunk, globals);
+    std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+    if (not ofs.is_open()) {
+        return false;
+    }
+    ofs.write(reinterpret_cast<const char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+    return ofs.good();
+}
+
+std::optional<std::string_view> verifyBytecode(const Chunk& chunk, std::size_t globalCount) {
+    return verifyCode(chunk.bytecode(), chunk, globalCount);
+}
+
+std::unique_ptr<Chunk> loadBytecode(std::span<const std::uint8_t> bytes, std::string_view name, Heap& heap, std::string *diagnostics) {
+    const auto invalid = [&](std::string_view reason) -> std::unique_ptr<Chunk> {
+        report(diagnostics, fmt::format("{} is not a valid bytecode file: {}\n", name, reason));
+        return nullptr;
+    };
+
+    Reader reader(bytes);
+    const auto magic = reader.bytes(MAGIC.size());
+    if (reader.failed() || not std::equal(magic.begin(), magic.end(), MAGIC.begin())) {
+        return invalid("wrong magic number");
+    }
+    if (reader.u16() != BytecodeFile::VERSION) {
+        return invalid("unsupported version");
+    }
+    const auto backend = reader.u8();
+    if (backend > static_cast<std::uint8_t>(Backend::Register)) {
+        return invalid("unknown backend");
+    }
+    std::ignore = reader.u8();
+    const auto registerCount = reader.u32();
+    const auto codeSize = reader.u32();
+    const auto expectedChecksum = reader.u32();
+    if (reader.failed() || expectedChecksum != checksum(bytes.subspan(BytecodeFile::HEADER_SIZE))) {
+        return invalid("checksum mismatch");
+    }
+
+    auto chunk = std::make_unique<Chunk>();
+    chunk->backend = static_cast<Backend>(backend);
+    chunk->registerCount = registerCount;
+    const auto code = reader.bytes(codeSize);
+
+    const auto constantCount = reader.u32();
+    for (std::uint32_t i = 0; i < constantCount && not reader.failed(); ++i) {
+        const auto constant = readConstant(reader, heap);
+        if (not constant) {
+            return invalid("unknown constant type");
+        }
+        chunk->constants.push_back(*constant);
+    }
+
+    const auto globalCount = reader.u32();
+    for (std::uint32_t i = 0; i < globalCount && not reader.failed(); ++i) {
+        chunk->globalNames.push_back(heap.copyString(reader.string()));
+    }
+
+    const auto runCount = reader.u32();
+    for (std::uint32_t i = 0; i < runCount && not reader.failed(); ++i) {
+        const auto offset = reader.u32();
+        chunk->lines.add(offset, reader.u32());
+    }
+
+    if (reader.failed() || not reader.atEnd()) {
+        return invalid("truncated or oversized sections");
+    }
+    if (const auto reason = verifyCode(code, *chunk, chunk->globalNames.size())) {
+        return invalid(*reason);
+    }
+
+    chunk->externalCode = code;
+    return chunk;
+}
+
+std::unique_ptr<Chunk> loadBytecodeFile(const std::filesystem::path& path, Heap& heap, std::string *diagnostics) {
+    auto file = MappedFile::open(path);
+    if (file == nullptr) {
+        report(diagnostics, fmt::format("The file: {} does not exists or can not be opened\n", path.string()));
+        return nullptr;
+    }
+
+    auto chunk = loadBytecode(file->bytes(), path.string(), heap, diagnostics);
+    if (chunk != nullptr) {
+        chunk->codeOwner = std::move(file);
+    }
+    return chunk;
+}
@@ -1,113 +1,342 @@
 #include "chunk.h"
+#include <algorithm>
+#include <iterator>
+#include <type_traits>
+
+void LineTable::add(std::size_t offset, std::size_t line) {
+    if (m_runs.empty() || m_runs.back().line != line) {
+        m_runs.push_back(Run { .offset { static_cast<std::uint32_t>(offset) }, .line { static_cast<std::uint32_t>(line) } });
+    }
+}
+
+void LineTable::truncate(std::size_t size) {
+    while (not m_runs.empty() && m_runs.back().offset >= size) {
+        m_runs.pop_back();
+    }
+}
+
+std::size_t LineTable::getLine(std::size_t offset) const {
+    // the last run that starts at or before the offset
+    const auto run = std::upper_bound(m_runs.begin(), m_runs.end(), offset, [](std::size_t value, const Run& r) {
+        return value < r.offset;
+    });
+    if (run == m_runs.begin()) {
+        return 0;
+    }
+    return std::prev(run)->line;
+}
 
 void Chunk::push(OpCode opcode, std::size_t line) {
-    code.push_back(static_cast<std::uint8_t>(opcode));
-    lines.push_back(line);
+    push(static_cast<std::uint8_t>(opcode), line);
+}
+
+void Chunk::push(RegOpCode opcode, std::size_t line) {
+    push(static_cast<std::uint8_t>(opcode), line);
 }
 
 void Chunk::push(std::uint8_t opcode, std::size_t line) {
+    lines.add(code.size(), line);
     code.push_back(opcode);
-    lines.push_back(line);
 }
 
-void Chunk::disassembleChunk(const std::string_view name) const {
-    fmt::print("== {} ({}) ==\n", name, code.size());
+ChunkMemory Chunk::memoryUsage() const {
+    return ChunkMemory {
+        .code { code.capacity() },
+        .constants { constants.capacity() * sizeof(Value) },
+        .lines { lines.bytes() },
+        // a node per entry plus the bucket array, the exact layout is up to the standard library
+        .constantIndex { constantIndex.size() * (sizeof(Value) + 2 * sizeof(std::size_t)) + constantIndex.bucket_count() * sizeof(void *) },
+    };
+}
+
+namespace {
+
+// appends to `output`, or prints to stdout if there is none
+void emit(std::string *output, const std::string& text) {
+    if (output != nullptr) {
+        *output += text;
+    } else {
+        fmt::print("{}", text);
+    }
+}
+
+} // namespace
+
+void Chunk::printMemoryReport(const std::string_view name, std::string *output) const {
+    const auto memory = memoryUsage();
+    std::string out;
+    fmt::format_to(std::back_inserter(out), "== {} memory ==\n", name);
+    fmt::format_to(std::back_inserter(out), "code           {:10d} bytes\n", memory.code);
+    fmt::format_to(std::back_inserter(out), "constants      {:10d} bytes ({} values)\n", memory.constants, constants.size());
+    fmt::format_to(std::back_inserter(out), "lines          {:10d} bytes ({} runs)\n", memory.lines, lines.runs().size());
+    fmt::format_to(std::back_inserter(out), "constant index {:10d} bytes\n", memory.constantIndex);
+    emit(output, out);
+}
+
+void Chunk::disassembleChunk(const std::string_view name, std::string *output) const {
+    std::string out = fmt::format("== {} ({}) ==\n", name, bytecode().size());
 
-    for (std::size_t offset = 0; offset < code.size();) {
-        offset = disassembleInstruction(offset);
+    for (std::size_t offset = 0; offset < bytecode().size();) {
+        offset = disassembleInstruction(out, offset);
     }
+    emit(output, out);
 }
 
-std::size_t Chunk::disassembleInstruction(std::size_t offset) const {
-    fmt::print("{:04d} ", offset);
+std::size_t Chunk::disassembleInstruction(std::size_t offset, std::string *output) const {
+    std::string out;
+    offset = disassembleInstruction(out, offset);
+    emit(output, out);
+    return offset;
+}
+
+std::size_t Chunk::disassembleInstruction(std::string& out, std::size_t offset) const {
+    fmt::format_to(std::back_inserter(out), "{:04d} ", offset);
 
-    if (offset > 0 && lines[offset] == lines[offset - 1]) {
-        fmt::print("   | ");
+    const auto line = lines.getLine(offset);
+    if (offset > 0 && line == lines.getLine(offset - 1)) {
+        fmt::format_to(std::back_inserter(out), "   | ");
     } else {
-        fmt::print("{:4d} ", lines[offset]);
+        fmt::format_to(std::back_inserter(out), "{:4d} ", line);
+    }
+
+    if (backend == Backend::Register) {
+        return disassembleRegisterInstruction(out, offset);
     }
 
-    const auto instruction = static_cast<OpCode>(code[offset]);
+    const auto instruction = static_cast<OpCode>(bytecode()[offset]);
 
     switch (instruction) {
-        case OpCode::Constant: return constantInstruction("Constant", offset);
-        case OpCode::Nil: return simpleInstruction("Nil", offset);
-        case OpCode::True: return simpleInstruction("True", offset);
-        case OpCode::False: return simpleInstruction("False", offset);
-        case OpCode::Pop: return simpleInstruction("Pop", offset);
-        case OpCode::GetLocal: return byteInstruction("GetLocal", offset);
-        case OpCode::SetLocal: return byteInstruction("SetLocal", offset);
-        case OpCode::GetGlobal: return constantInstruction("GetGlobal", offset);
-        case OpCode::DefineGlobal: return constantInstruction("DefineGlobal", offset);
-        case OpCode::SetGlobal: return constantInstruction("SetGlobal", offset);
-        case OpCode::Equal: return simpleInstruction("Equal", offset);
-        case OpCode::Greater: return simpleInstruction("Greater", offset);
-        case OpCode::Less: return simpleInstruction("Less", offset);
-        case OpCode::Add: return simpleInstruction("Add", offset);
-        case OpCode::Subtract: return simpleInstruction("Subtract", offset);
-        case OpCode::Multiply: return simpleInstruction("Multiply", offset);
-        case OpCode::Divide: return simpleInstruction("Divide", offset);
-        case OpCode::Not: return simpleInstruction("Not", offset);
-        case OpCode::Negate: return simpleInstruction("Negate", offset);
-        case OpCode::Jump: return jumpInstruction("Jump", 1, offset);
-        case OpCode::JumpIfFalse: return jumpInstruction("JumpIfFalse", 1, offset);
-        case OpCode::Print: return simpleInstruction("Print", offset);
-        case OpCode::Loop: return jumpInstruction("Loop", -1, offset);
-        case OpCode::Return: return simpleInstruction("Return", offset);
+        case OpCode::Constant: return constantInstruction(out, "Constant", offset);
+        case OpCode::Nil: return simpleInstruction(out, "Nil", offset);
+        case OpCode::True: return simpleInstruction(out, "True", offset);
+        case OpCode::False: return simpleInstruction(out, "False", offset);
+        case OpCode::Pop: return simpleInstruction(out, "Pop", offset);
+        case OpCode::GetLocal: return byteInstruction(out, "GetLocal", offset);
+        case OpCode::SetLocal: return byteInstruction(out, "SetLocal", offset);
+        case OpCode::GetGlobalSlot: return shortInstruction(out, "GetGlobalSlot", offset);
+        case OpCode::DefineGlobalSlot: return shortInstruction(out, "DefineGlobalSlot", offset);
+        case OpCode::SetGlobalSlot: return shortInstruction(out, "SetGlobalSlot", offset);
+        case OpCode::Equal: return simpleInstruction(out, "Equal", offset);
+        case OpCode::Greater: return simpleInstruction(out, "Greater", offset);
+        case OpCode::Less: return simpleInstruction(out, "Less", offset);
+        case OpCode::Add: return simpleInstruction(out, "Add", offset);
+        case OpCode::Subtract: return simpleInstruction(out, "Subtract", offset);
+        case OpCode::Multiply: return simpleInstruction(out, "Multiply", offset);
+        case OpCode::Divide: return simpleInstruction(out, "Divide", offset);
+        case OpCode::Not: return simpleInstruction(out, "Not", offset);
+        case OpCode::Negate: return simpleInstruction(out, "Negate", offset);
+        case OpCode::Jump: return jumpInstruction(out, "Jump", 1, offset);
+        case OpCode::JumpIfFalse: return jumpInstruction(out, "JumpIfFalse", 1, offset);
+        case OpCode::Print: return simpleInstruction(out, "Print", offset);
+        case OpCode::Loop: return jumpInstruction(out, "Loop", -1, offset);
+        case OpCode::ConstantLong: return constantLongInstruction(out, "ConstantLong", offset);
+        case OpCode::GetLocalWide: return shortInstruction(out, "GetLocalWide", offset);
+        case OpCode::SetLocalWide: return shortInstruction(out, "SetLocalWide", offset);
+        case OpCode::JumpLong: return longJumpInstruction(out, "JumpLong", 1, offset);
+        case OpCode::JumpIfFalseLong: return longJumpInstruction(out, "JumpIfFalseLong", 1, offset);
+        case OpCode::LoopLong: return longJumpInstruction(out, "LoopLong", -1, offset);
+        case OpCode::AddLocals: return bytePairInstruction(out, "AddLocals", offset);
+        case OpCode::AddConstant: return constantInstruction(out, "AddConstant", offset);
+        case OpCode::NotEqual: return simpleInstruction(out, "NotEqual", offset);
+        case OpCode::NotLess: return simpleInstruction(out, "NotLess", offset);
+        case OpCode::NotGreater: return simpleInstruction(out, "NotGreater", offset);
+        case OpCode::JumpIfNotLess: return jumpInstruction(out, "JumpIfNotLess", 1, offset);
+        case OpCode::JumpIfNotGreater: return jumpInstruction(out, "JumpIfNotGreater", 1, offset);
+        case OpCode::Return: return simpleInstruction(out, "Return", offset);
         default:
-            fmt::print("Unknown opcode {}\n", instruction);
+            fmt::format_to(std::back_inserter(out), "Unknown opcode {}\n", instruction);
             return offset + 1;
     }
 }
 
-std::size_t Chunk::simpleInstruction(const std::string_view name, std::size_t offset) const {
-    fmt::print("{}\n", name);
+std::size_t Chunk::simpleInstruction(std::string& out, const std::string_view name, std::size_t offset) const {
+    fmt::format_to(std::back_inserter(out), "{}\n", name);
     return offset + 1;
 }
 
 std::size_t Chunk::addConstant(const Value& value) {
-    constants.push_back(value);
-    return constants.size() - 1;
+    const auto [it, inserted] = constantIndex.try_emplace(value, constants.size());
+    if (inserted) {
+        constants.push_back(value);
+    }
+    return it->second;
 }
 
-std::size_t Chunk::constantInstruction(const std::string_view name, std::size_t offset) const {
-    std::uint8_t constant = code[offset + 1];
-    auto variant = constants[constant];
-    fmt::print("{:16} {:4d} '{}'\n", name, constant, std::visit(PrintVisitor{}, variant));
-    return offset + 2;
+namespace {
+
+// type of the value in the low bits of the key, only needed if the bits alone are ambiguous
+std::pair<std::uint64_t, std::size_t> constantKey(const Value& value) {
+#ifdef NAN_BOXING
+    return { value.bits(), 0 };
+#else
+    const auto bits = visitValue([](const auto& v) -> std::uint64_t {
+        using T = std::decay_t<decltype(v)>;
+        if constexpr (std::is_same_v<T, Number>) {
+            return std::bit_cast<std::uint64_t>(v);
+        } else if constexpr (std::is_same_v<T, Obj *>) {
+            return reinterpret_cast<std::uintptr_t>(v);
+        } else if constexpr (std::is_same_v<T, Bool>) {
+            return v ? 1 : 0;
+        } else {
+            return 0;
+        }
+    }, value);
+    return { bits, value.index() };
+#endif
 }
 
+} // namespace
 
-std::size_t Chunk::byteInstruction(const std::string_view name, std::size_t offset) const {
-    std::uint8_t slot = code[offset + 1];
-    fmt::print("{:16} {:4d}\n", name, slot);
-    return offset + 2;
+std::size_t ConstantHash::operator()(const Value& value) const {
+    const auto [bits, type] = constantKey(value);
+    return std::hash<std::uint64_t>{}(bits) ^ type;
 }
 
-std::size_t Chunk::jumpInstruction(const std::string_view name, int sign, std::size_t offset) const {
-    auto jump = static_cast<std::uint16_t>(code[offset + 1] << 8);
-    jump |= code[offset + 2];
-    fmt::print("{:16} {:4d} -> {}\n", name, offset, offset + 3 + static_cast<std::size_t>(sign) * jump);
-    return offset + 3;
+bool ConstantEqual::operator()(const Value& lhs, const Value& rhs) const {
+    return constantKey(lhs) == constantKey(rhs);
 }
 
+std::size_t Chunk::constantInstruction(std::string& out, const std::string_view name, std::size_t offset) const {
+    std::uint8_t constant = bytecode()[offset + 1];
+    const auto& variant = constants[constant];
+    fmt::format_to(std::back_inserter(out), "{:16} {:4d} '{}'\n", name, constant, visitValue(PrintVisitor{}, variant));
+    return offset + 2;
+}
 
 
+std::size_t Chunk::constantLongInstruction(std::string& out, const std::string_view name, std::size_t offset) const {
+    const auto constant = static_cast<std::size_t>(bytecode()[offset + 1] << 16 | bytecode()[offset + 2] << 8 | bytecode()[offset + 3]);
+    fmt::format_to(std::back_inserter(out), "{:16} {:4d} '{}'\n", name, constant, visitValue(PrintVisitor{}, constants[constant]));
+    return offset + 4;
+}
 
+std::size_t Chunk::byteInstruction(std::string& out, const std::string_view name, std::size_t offset) const {
+    std::uint8_t slot = bytecode()[offset + 1];
+    fmt::format_to(std::back_inserter(out), "{:16} {:4d}\n", name, slot);
+    return offset + 2;
+}
 
+std::size_t Chunk::bytePairInstruction(std::string& out, const std::string_view name, std::size_t offset) const {
+    fmt::format_to(std::back_inserter(out), "{:16} {:4d} {:4d}\n", name, bytecode()[offset + 1], bytecode()[offset + 2]);
+    return offset + 3;
+}
 
+std::size_t Chunk::shortInstruction(std::string& out, const std::string_view name, std::size_t offset) const {
+    auto operand = static_cast<std::uint16_t>(bytecode()[offset + 1] << 8);
+    operand |= bytecode()[offset + 2];
+    fmt::format_to(std::back_inserter(out), "{:16} {:4d}\n", name, operand);
+    return offset + 3;
+}
 
+std::size_t Chunk::jumpTarget(std::size_t offset) const {
+    const auto opcode = static_cast<OpCode>(bytecode()[offset]);
+    if (isLongJump(opcode)) {
+        const auto jump = static_cast<std::size_t>(bytecode()[offset + 1] << 16 | bytecode()[offset + 2] << 8 | bytecode()[offset + 3]);
+        return opcode == OpCode::LoopLong ? offset + 4 - jump : offset + 4 + jump;
+    }
 
+    auto jump = static_cast<std::uint16_t>(bytecode()[offset + 1] << 8);
+    jump |= bytecode()[offset + 2];
+    if (opcode == OpCode::Loop) {
+        return offset + 3 - jump;
+    }
+    return offset + 3 + jump;
+}
 
+std::size_t Chunk::jumpInstruction(std::string& out, const std::string_view name, int sign, std::size_t offset) const {
+    auto jump = static_cast<std::uint16_t>(bytecode()[offset + 1] << 8);
+    jump |= bytecode()[offset + 2];
+    fmt::format_to(std::back_inserter(out), "{:16} {:4d} -> {}\n", name, offset, offset + 3 + static_cast<std::size_t>(sign) * jump);
+    return offset + 3;
+}
 
+std::size_t Chunk::longJumpInstruction(std::string& out, const std::string_view name, int sign, std::size_t offset) const {
+    const auto jump = static_cast<std::size_t>(bytecode()[offset + 1] << 16 | bytecode()[offset + 2] << 8 | bytecode()[offset + 3]);
+    fmt::format_to(std::back_inserter(out), "{:16} {:4d} -> {}\n", name, offset, offset + 4 + static_cast<std::size_t>(sign) * jump);
+    return offset + 4;
+}
 
+std::size_t Chunk::disassembleRegisterInstruction(std::string& out, std::size_t offset) const {
+    const auto instruction = static_cast<RegOpCode>(bytecode()[offset]);
 
+    switch (instruction) {
+        case RegOpCode::LoadConstant: return loadConstantInstruction(out, "LoadConstant", false, offset);
+        case RegOpCode::LoadConstantLong: return loadConstantInstruction(out, "LoadConstantLong", true, offset);
+        case RegOpCode::LoadNil: return registerInstruction(out, "LoadNil", 1, offset);
+        case RegOpCode::LoadTrue: return registerInstruction(out, "LoadTrue", 1, offset);
+        case RegOpCode::LoadFalse: return registerInstruction(out, "LoadFalse", 1, offset);
+        case RegOpCode::Move: return registerInstruction(out, "Move", 2, offset);
+        case RegOpCode::GetGlobal: return globalRegisterInstruction(out, "GetGlobal", offset);
+        case RegOpCode::DefineGlobal: return globalRegisterInstruction(out, "DefineGlobal", offset);
+        case RegOpCode::SetGlobal: return globalRegisterInstruction(out, "SetGlobal", offset);
+        case RegOpCode::Equal: return registerInstruction(out, "Equal", 3, offset);
+        case RegOpCode::NotEqual: return registerInstruction(out, "NotEqual", 3, offset);
+        case RegOpCode::Greater: return registerInstruction(out, "Greater", 3, offset);
+        case RegOpCode::NotGreater: return registerInstruction(out, "NotGreater", 3, offset);
+        case RegOpCode::Less: return registerInstruction(out, "Less", 3, offset);
+        case RegOpCode::NotLess: return registerInstruction(out, "NotLess", 3, offset);
+        case RegOpCode::Add: return registerInstruction(out, "Add", 3, offset);
+        case RegOpCode::Subtract: return registerInstruction(out, "Subtract", 3, offset);
+        case RegOpCode::Multiply: return registerInstruction(out, "Multiply", 3, offset);
+        case RegOpCode::Divide: return registerInstruction(out, "Divide", 3, offset);
+        case RegOpCode::Not: return registerInstruction(out, "Not", 2, offset);
+        case RegOpCode::Negate: return registerInstruction(out, "Negate", 2, offset);
+        case RegOpCode::Jump: return registerJumpInstruction(out, "Jump", false, false, 1, offset);
+        case RegOpCode::JumpIfFalse: return registerJumpInstruction(out, "JumpIfFalse", true, false, 1, offset);
+        case RegOpCode::JumpIfTrue: return registerJumpInstruction(out, "JumpIfTrue", true, false, 1, offset);
+        case RegOpCode::Loop: return registerJumpInstruction(out, "Loop", false, false, -1, offset);
+        case RegOpCode::JumpLong: return registerJumpInstruction(out, "JumpLong", false, true, 1, offset);
+        case RegOpCode::JumpIfFalseLong: return registerJumpInstruction(out, "JumpIfFalseLong", true, true, 1, offset);
+        case RegOpCode::JumpIfTrueLong: return registerJumpInstruction(out, "JumpIfTrueLong", true, true, 1, offset);
+        case RegOpCode::LoopLong: return registerJumpInstruction(out, "LoopLong", false, true, -1, offset);
+        case RegOpCode::Print: return registerInstruction(out, "Print", 1, offset);
+        case RegOpCode::Return: return simpleInstruction(out, "Return", offset);
+        default:
+            fmt::format_to(std::back_inserter(out), "Unknown opcode {}\n", bytecode()[offset]);
+            return offset + 1;
+    }
+}
 
+std::size_t Chunk::registerInstruction(std::string& out, const std::string_view name, std::size_t registers, std::size_t offset) const {
+    fmt::format_to(std::back_inserter(out), "{:16}", name);
+    for (std::size_t i = 1; i <= registers; ++i) {
+        fmt::format_to(std::back_inserter(out), " r{:<3d}", bytecode()[offset + i]);
+    }
+    fmt::format_to(std::back_inserter(out), "\n");
+    return offset + 1 + registers;
+}
 
+std::size_t Chunk::loadConstantInstruction(std::string& out, const std::string_view name, bool isLong, std::size_t offset) const {
+    std::size_t constant = bytecode()[offset + 2];
+    if (isLong) {
+        constant = static_cast<std::size_t>(bytecode()[offset + 2] << 16 | bytecode()[offset + 3] << 8 | bytecode()[offset + 4]);
+    }
+    fmt::format_to(std::back_inserter(out), "{:16} r{:<3d} {:4d} '{}'\n", name, bytecode()[offset + 1], constant, visitValue(PrintVisitor{}, constants[constant]));
+    return offset + (isLong ? 5 : 3);
+}
 
+std::size_t Chunk::globalRegisterInstruction(std::string& out, const std::string_view name, std::size_t offset) const {
+    if (static_cast<RegOpCode>(bytecode()[offset]) == RegOpCode::GetGlobal) {
+        auto slot = static_cast<std::uint16_t>((bytecode()[offset + 2] << 8) | bytecode()[offset + 3]);
+        fmt::format_to(std::back_inserter(out), "{:16} r{:<3d} {:4d}\n", name, bytecode()[offset + 1], slot);
+    } else {
+        auto slot = static_cast<std::uint16_t>((bytecode()[offset + 1] << 8) | bytecode()[offset + 2]);
+        fmt::format_to(std::back_inserter(out), "{:16} {:4d} r{}\n", name, slot, bytecode()[offset + 3]);
+    }
+    return offset + 4;
+}
 
-
-
-
-
-
+std::size_t Chunk::registerJumpInstruction(std::string& out, const std::string_view name, bool conditional, bool isLong, int sign, std::size_t offset) const {
+    const std::size_t operand = conditional ? offset + 2 : offset + 1;
+    const std::size_t next = operand + (isLong ? 3 : 2);
+    auto jump = static_cast<std::size_t>((bytecode()[operand] << 8) | bytecode()[operand + 1]);
+    if (isLong) {
+        jump = jump << 8 | bytecode()[operand + 2];
+    }
+    if (conditional) {
+        fmt::format_to(std::back_inserter(out), "{:16} r{:<3d} {:4d} -> {}\n", name, bytecode()[offset + 1], offset, next + static_cast<std::size_t>(sign) * jump);
+    } else {
+        fmt::format_to(std::back_inserter(out), "{:16} {:4d} -> {}\n", name, offset, next + static_cast<std::size_t>(sign) * jump);
+    }
+    return next;
+}
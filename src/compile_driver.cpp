@@ -0,0 +1,43 @@
+#include "compile_driver.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include "source_file.h"
+
+namespace {
+
+void compileFile(CompiledFile& file, const CompileOptions& options) {
+    const auto source = SourceFile::load(file.path, &file.diagnostics);
+    if (not source) {
+        return;
+    }
+    file.program = Program::compile(source->text(), file.diagnostics, options.backend, options.optimization, options.lexing);
+}
+
+} // namespace
+
+std::vector<CompiledFile> compileFiles(std::span<const std::filesystem::path> paths, const CompileOptions& options) {
+    std::vector<CompiledFile> files(paths.size());
+    for (std::size_t i = 0; i < paths.size(); ++i) {
+        files[i].path = paths[i];
+    }
+
+    // the workers take the next file from a shared counter, so a few large files do not
+    // leave the other threads idle
+    std::atomic<std::size_t> next { 0 };
+    const auto work = [&] {
+        for (auto index = next++; index < files.size(); index = next++) {
+            compileFile(files[index], options);
+        }
+    };
+
+    const auto threads = std::min<std::size_t>(options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency()), files.size());
+    {
+        std::vector<std::jthread> workers;
+        for (std::size_t i = 1; i < threads; ++i) {
+            workers.emplace_back(work);
+        }
+        work();
+    }
+    return files;
+}
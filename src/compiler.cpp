@@ -1,10 +1,54 @@
 #include "compiler.h"
 #include "opcode.h"
+#include "optimizer.h"
 #include <cassert>
 #include <iostream>
 
 bool Compiler::compile(const std::string_view source) {
-    scanner = Scanner(source.data());
+    this->source = source;
+    tokens = nullptr;
+    return compileTokens();
+}
+
+bool Compiler::compile(const TokenBuffer& buffer) {
+    tokens = &buffer;
+    return compileTokens();
+}
+
+bool Compiler::compileTokens() {
+    if (compilePass() && jumpOverflow) {
+        chunk = Chunk {};
+        chunk.backend = backend;
+        variables = Variables {};
+        expr = ExprDesc {};
+        nextRegister = 0;
+        lastConstant.reset();
+        longJumps = true;
+        std::ignore = compilePass();
+    }
+
+    if (not parser.hadError && backend == Backend::Stack) {
+        if (optimization >= OptimizationLevel::Basic) {
+            cleanupControlFlow(chunk);
+        }
+        fuseSuperinstructions(chunk);
+    }
+#ifdef DEBUG_PRINT_CODE
+if (not parser.hadError) {
+    chunk.disassembleChunk("code", listing);
+    chunk.printMemoryReport("code", listing);
+}
+#endif
+
+    return not parser.hadError;
+}
+
+bool Compiler::compilePass() {
+    if (tokens != nullptr) {
+        cursor = TokenBuffer::Cursor {};
+    } else {
+        scanner = Scanner(source);
+    }
 
     parser.panicMode = false;
     parser.hadError = false;
@@ -17,12 +61,6 @@ bool Compiler::compile(const std::string_view source) {
 
     // @todo this is endCompiler()
     emitReturn();
-#ifdef DEBUG_PRINT_CODE
-if (not parser.hadError) {
-    chunk.disassembleChunk("code");
-}
-#endif
-
     return not parser.hadError;
 }
 
@@ -63,6 +101,9 @@ void Compiler::block() {
 }
 
 void Compiler::whileStatement() {
+    if (backend == Backend::Register) {
+        return whileStatementRegister();
+    }
     auto loopStart = chunk.code.size();
     consume(TokenType::LeftParen, "Expect '(' after 'while'.");
     expression();
@@ -79,6 +120,9 @@ void Compiler::whileStatement() {
 }
 
 void Compiler::ifStatement() {
+    if (backend == Backend::Register) {
+        return ifStatementRegister();
+    }
     consume(TokenType::LeftParen, "Expect '('  after 'if'.");
     expression();
     consume(TokenType::RightParen, "Expect ')'  after condition.");
@@ -86,31 +130,41 @@ void Compiler::ifStatement() {
     int thenJump = emitJump(OpCode::JumpIfFalse);
     emitByte(OpCode::Pop);
     statement();
+
+    int elseJump = emitJump(OpCode::Jump);
+
     patchJump(thenJump);
     emitByte(OpCode::Pop);
 
     if (match(TokenType::Else)) {
         statement();
     }
-
-    int elseJump = emitJump(OpCode::Jump);
     patchJump(elseJump);
 }
 
 void Compiler::printStatement() {
+    if (backend == Backend::Register) {
+        return printStatementRegister();
+    }
     expression();
     consume(TokenType::Semicolon, "Expect ';' after value.");
     emitByte(OpCode::Print);
 }
 
 void Compiler::expressionStatement() {
+    if (backend == Backend::Register) {
+        return expressionStatementRegister();
+    }
     expression();
     consume(TokenType::Semicolon, "Expect ';' after expression.");
     emitByte(OpCode::Pop);
 }
 
 void Compiler::varDeclaration() {
-    std::uint8_t global = parseVariable("Expect variable name.");
+    if (backend == Backend::Register) {
+        return varDeclarationRegister();
+    }
+    std::uint16_t global = parseVariable("Expect variable name.");
 
     if (match(TokenType::Equal)) {
         expression();
@@ -124,7 +178,7 @@ void Compiler::varDeclaration() {
 }
 
 void Compiler::declareVariable() {
-    if (variables.scopeDepth > 0) {
+    if (variables.scopeDepth == 0) {
         return;
     }
     const auto name = parser.previous;
@@ -149,34 +203,42 @@ bool Compiler::identifiersEqual(const Token& lhs, const Token& rhs) {
 }
 
 void Compiler::addLocal(const Token& name) {
-    if (static_cast<std::size_t>(variables.localCount) == variables.locals.size()) {
+    if (static_cast<std::size_t>(variables.localCount) == MAX_LOCALS) {
         error("Too many local variables in function.");
         return;
     }
+    if (static_cast<std::size_t>(variables.localCount) == variables.locals.size()) {
+        variables.locals.emplace_back();
+    }
     Local& local = variables.locals[static_cast<std::size_t>(variables.localCount++)];
     local.name = name;
     local.depth = -1;
 }
 
-std::uint8_t Compiler::parseVariable(const char *errorMessage) {
+std::uint16_t Compiler::parseVariable(const char *errorMessage) {
     consume(TokenType::Identifier, errorMessage);
     declareVariable();
     if (variables.scopeDepth > 0) {
         return 0;
     }
-    return identifierConstant(parser.previous);
+    return globalSlot(parser.previous);
 }
 
-std::uint8_t Compiler::identifierConstant(const Token& name) {
-    return makeConstant(std::string(name.start, name.length));
+std::uint16_t Compiler::globalSlot(const Token& name) {
+    auto slot = globals.resolve(heap.copyString(std::string_view(name.start, name.length)));
+    if (slot > UINT16_MAX) {
+        error("Too many global variables.");
+        return 0;
+    }
+    return static_cast<std::uint16_t>(slot);
 }
 
-void Compiler::defineVariable(std::uint8_t global) {
+void Compiler::defineVariable(std::uint16_t global) {
     if (variables.scopeDepth > 0) {
         markInitialized();
         return;
     }
-    emitBytes(OpCode::DefineGlobal, global);
+    emitShort(OpCode::DefineGlobalSlot, global);
 }
 
 void Compiler::markInitialized() {
@@ -185,9 +247,16 @@ void Compiler::markInitialized() {
 
 void Compiler::advance() {
     parser.previous = parser.current;
+    parser.previousNumber = parser.currentNumber;
 
     while (true) {
-        parser.current = scanner.scanToken();
+        if (tokens != nullptr) {
+            const auto lexeme = tokens->next(cursor);
+            parser.current = lexeme.token;
+            parser.currentNumber = lexeme.number;
+        } else {
+            parser.current = scanner.scanToken();
+        }
 
         if (parser.current.type != TokenType::Error) {
             break;
@@ -201,8 +270,10 @@ void Compiler::expression() {
 }
 
 void Compiler::number(bool) {
-    auto value = std::strtod(parser.previous.start, NULL);
-    emitConstant(value);
+    if (tokens != nullptr) {
+        return emitConstant(parser.previousNumber);
+    }
+    emitConstant(parseNumberLiteral(std::string_view(parser.previous.start, parser.previous.length)));
 }
 
 void Compiler::grouping(bool) {
@@ -215,6 +286,16 @@ void Compiler::unary(bool) {
 
     parsePrecedence(Precedence::Unary);
 
+    if (backend == Backend::Register) {
+        return unaryRegister(operatorType);
+    }
+
+    if (const auto operand = constantOperand()) {
+        if (const auto folded = foldUnary(operatorType, operand->value)) {
+            return emitFolded(operand->start, *folded);
+        }
+    }
+
     switch (operatorType) {
         case TokenType::Minus: return emitByte(OpCode::Negate);
         case TokenType::Bang: return emitByte(OpCode::Not);
@@ -224,12 +305,22 @@ void Compiler::unary(bool) {
 
 void Compiler::binary(bool) {
     auto operatorType = parser.previous.type;
-    auto rule = getRule(operatorType);
+    const auto& rule = getRule(operatorType);
 
 
     auto newPrecedence = static_cast<std::uint8_t>(rule.precedence) + 1;
+    if (backend == Backend::Register) {
+        return binaryRegister(operatorType, static_cast<Precedence>(newPrecedence));
+    }
+    const auto left = constantOperand();
     parsePrecedence(static_cast<Precedence>(newPrecedence));
 
+    if (const auto right = constantOperand(); left && right && right->start == left->end) {
+        if (const auto folded = foldBinary(operatorType, left->value, right->value)) {
+            return emitFolded(left->start, *folded);
+        }
+    }
+
     switch (operatorType) {
         case TokenType::Plus: return emitByte(OpCode::Add);
         case TokenType::Minus: return emitByte(OpCode::Subtract);
@@ -247,16 +338,15 @@ void Compiler::binary(bool) {
 
 void Compiler::literal(bool) {
     switch (parser.previous.type) {
-        case TokenType::False: return emitByte(OpCode::False);
-        case TokenType::Nil: return emitByte(OpCode::Nil);
-        case TokenType::True: return emitByte(OpCode::True);
+        case TokenType::False: return emitConstant(false);
+        case TokenType::Nil: return emitConstant(Nil{});
+        case TokenType::True: return emitConstant(true);
         default: assert(false && "Unreachable TokenType in literal expression.");
     }
 }
 
 void Compiler::string(bool) {
-    std::string s(parser.previous.start + 1, parser.previous.length - 2);
-    emitConstant(s);
+    emitConstant(heap.copyString(std::string_view(parser.previous.start + 1, parser.previous.length - 2)));
 }
 
 void Compiler::variable(bool canAssign) {
@@ -264,23 +354,31 @@ void Compiler::variable(bool canAssign) {
 }
 
 void Compiler::namedVariable(const Token& name, bool canAssign) {
-    OpCode getOp, setOp;
+    if (backend == Backend::Register) {
+        return namedVariableRegister(name, canAssign);
+    }
     int arg = resolveLocal(name);
 
     if (arg != -1) {
-        getOp = OpCode::GetLocal;
-        setOp = OpCode::SetLocal;
-    } else {
-        arg = identifierConstant(name);
-        getOp = OpCode::GetGlobal;
-        setOp = OpCode::SetGlobal;
+        const bool assign = canAssign && match(TokenType::Equal);
+        if (assign) {
+            expression();
+        }
+        if (arg > UINT8_MAX) {
+            emitShort(assign ? OpCode::SetLocalWide : OpCode::GetLocalWide, static_cast<std::uint16_t>(arg));
+        } else {
+            emitBytes(assign ? OpCode::SetLocal : OpCode::GetLocal, static_cast<std::uint8_t>(arg));
+        }
+        return;
     }
 
+    auto slot = globalSlot(name);
+
     if (canAssign && match(TokenType::Equal)) {
         expression();
-        emitBytes(setOp, static_cast<std::uint8_t>(arg));
+        emitShort(OpCode::SetGlobalSlot, slot);
     } else {
-        emitBytes(getOp, static_cast<std::uint8_t>(arg));
+        emitShort(OpCode::GetGlobalSlot, slot);
     }
 }
 
@@ -298,13 +396,21 @@ int Compiler::resolveLocal(const Token& name) {
 }
 
 void Compiler::and_(bool) {
+    if (backend == Backend::Register) {
+        return logicalRegister(RegOpCode::JumpIfFalse, Precedence::And);
+    }
     auto endJump = emitJump(OpCode::JumpIfFalse);
     emitByte(OpCode::Pop);
     parsePrecedence(Precedence::And);
     patchJump(endJump);
+    // the right operand ends the code, but it is not the value of the whole expression
+    lastConstant.reset();
 }
 
 void Compiler::or_(bool) {
+    if (backend == Backend::Register) {
+        return logicalRegister(RegOpCode::JumpIfTrue, Precedence::Or);
+    }
     auto elseJump = emitJump(OpCode::JumpIfFalse);
     auto endJump = emitJump(OpCode::Jump);
 
@@ -313,25 +419,27 @@ void Compiler::or_(bool) {
 
     parsePrecedence(Precedence::Or);
     patchJump(endJump);
+    lastConstant.reset();
 }
 
 void Compiler::parsePrecedence(Precedence precedence) {
     advance();
 
-    auto prefixRule = getRule(parser.previous.type).prefix;
+    const auto prefixRule = getRule(parser.previous.type).prefix;
 
-    if (not prefixRule) {
+    if (prefixRule == nullptr) {
         error("Expect expression.");
         return;
     }
 
     bool canAssign = precedence <= Precedence::Assignment;
-    prefixRule(canAssign);
+    lastConstant.reset();
+    (this->*prefixRule)(canAssign);
 
     while (precedence <= getRule(parser.current.type).precedence) {
         advance();
-        auto infixRule = getRule(parser.previous.type).infix;
-        infixRule(canAssign);
+        const auto infixRule = getRule(parser.previous.type).infix;
+        (this->*infixRule)(canAssign);
     }
 
     if (canAssign && match(TokenType::Equal)) {
@@ -339,8 +447,8 @@ void Compiler::parsePrecedence(Precedence precedence) {
     }
 }
 
-ParseRule Compiler::getRule(TokenType type) {
-    return TokenTypeFunction[static_cast<std::uint8_t>(type)];
+const ParseRule& Compiler::getRule(TokenType type) {
+    return rules[static_cast<std::uint8_t>(type)];
 }
 
 bool Compiler::check(TokenType type) {
@@ -377,48 +485,159 @@ void Compiler::errorAt(Token& token, const char *msg) {
         return;
     }
     parser.panicMode = true;
-    fmt::print(stderr, "[line {}] Error", token.line);
+    std::string message = fmt::format("[line {}] Error", token.line);
 
     if (token.type == TokenType::Eof) {
-        fmt::print(stderr, " at end");
+        message += " at end";
     } else if (token.type == TokenType::Error) {
         // ignore that case
     } else {
-        fmt::print(stderr, " at '{:.{}}'", token.start, token.length);
+        message += fmt::format(" at '{:.{}}'", token.start, token.length);
     }
 
-    fmt::print(stderr, ": {}\n", msg);
+    message += fmt::format(": {}\n", msg);
+    if (diagnostics != nullptr) {
+        *diagnostics += message;
+    } else {
+        fmt::print(stderr, "{}", message);
+    }
     parser.hadError = true;
 }
 
 void Compiler::emitReturn() {
+    if (backend == Backend::Register) {
+        return emitByte(RegOpCode::Return);
+    }
     emitByte(OpCode::Return);
 }
 
 void Compiler::emitConstant(const Value& value) {
-    emitBytes(OpCode::Constant, makeConstant(value));
+    // the register backend only loads the constant once an instruction needs it
+    if (backend == Backend::Register) {
+        expr = constantExpr(value);
+        return;
+    }
+
+    const auto start = chunk.code.size();
+    if (holds_type<Bool>(value)) {
+        emitByte(get_type_unchecked<Bool>(value) ? OpCode::True : OpCode::False);
+    } else if (holds_type<Nil>(value)) {
+        emitByte(OpCode::Nil);
+    } else if (const auto constant = makeConstant(value); constant > UINT8_MAX) {
+        emitByte(OpCode::ConstantLong);
+        emitLong(constant);
+    } else {
+        emitBytes(OpCode::Constant, static_cast<std::uint8_t>(constant));
+    }
+    lastConstant = FoldableConstant { .start { start }, .end { chunk.code.size() }, .value { value } };
+}
+
+std::optional<Compiler::FoldableConstant> Compiler::constantOperand() const {
+    if (lastConstant && lastConstant->end == chunk.code.size()) {
+        return lastConstant;
+    }
+    return std::nullopt;
+}
+
+void Compiler::emitFolded(std::size_t start, const Value& value) {
+    // drops the instructions of the operands, they are all constants without side effects
+    chunk.code.resize(start);
+    chunk.lines.truncate(start);
+    emitConstant(value);
+}
+
+std::optional<Value> Compiler::foldUnary(TokenType operatorType, const Value& operand) {
+    switch (operatorType) {
+        case TokenType::Minus: {
+            // negating anything else is a runtime error, which is left to the VM
+            if (holds_type<Number>(operand)) {
+                return Value { -get_type_unchecked<Number>(operand) };
+            }
+            return std::nullopt;
+        }
+        case TokenType::Bang: {
+            const bool falsey = holds_type<Nil>(operand) || (holds_type<Bool>(operand) && not get_type_unchecked<Bool>(operand));
+            return Value { falsey };
+        }
+        default: return std::nullopt;
+    }
+}
+
+std::optional<Value> Compiler::foldBinary(TokenType operatorType, const Value& lhs, const Value& rhs) {
+    // constants are never ropes, so equal strings are the same interned object
+    if (operatorType == TokenType::EqualEqual || operatorType == TokenType::BangEqual) {
+        const bool equal = visitValues(EqualityVisitor{}, lhs, rhs);
+        return Value { operatorType == TokenType::EqualEqual ? equal : not equal };
+    }
+
+    if (holds_obj_type<ObjString>(lhs) && holds_obj_type<ObjString>(rhs)) {
+        if (operatorType != TokenType::Plus) {
+            return std::nullopt;
+        }
+        return Value { heap.takeString(get_objtype_unchecked<ObjString>(lhs)->chars + get_objtype_unchecked<ObjString>(rhs)->chars) };
+    }
+
+    // mixed operands are a runtime error, which is left to the VM
+    if (not holds_type<Number>(lhs) || not holds_type<Number>(rhs)) {
+        return std::nullopt;
+    }
+    const auto a = get_type_unchecked<Number>(lhs);
+    const auto b = get_type_unchecked<Number>(rhs);
+
+    // the same NaN semantics as the `Not` the VM executes after Less and Greater
+    switch (operatorType) {
+        case TokenType::Plus: return Value { a + b };
+        case TokenType::Minus: return Value { a - b };
+        case TokenType::Star: return Value { a * b };
+        case TokenType::Slash: return Value { a / b };
+        case TokenType::Greater: return Value { a > b };
+        case TokenType::GreaterEqual: return Value { not (a < b) };
+        case TokenType::Less: return Value { a < b };
+        case TokenType::LessEqual: return Value { not (a > b) };
+        default: return std::nullopt;
+    }
 }
 
 void Compiler::emitLoop(std::size_t loopStart) {
-    emitByte(OpCode::Loop);
+    // the distance is already known, so only loops that need it get the long encoding
+    std::size_t offset = chunk.code.size() - loopStart + 3;
+    if (offset <= UINT16_MAX) {
+        if (backend == Backend::Register) {
+            emitByte(RegOpCode::Loop);
+        } else {
+            emitByte(OpCode::Loop);
+        }
+        emitByte(static_cast<std::uint8_t>((offset >> 8) & 0xff));
+        emitByte(static_cast<std::uint8_t>(offset & 0xff));
+        return;
+    }
 
-    std::size_t offset = chunk.code.size() - loopStart + 2;
+    if (backend == Backend::Register) {
+        emitByte(RegOpCode::LoopLong);
+    } else {
+        emitByte(OpCode::LoopLong);
+    }
+    offset++;
 
-    if (offset > UINT16_MAX) {
+    if (offset > MAX_LONG_OPERAND) {
         error("Loop body too large");
     }
+    emitLong(offset);
+}
 
-    emitByte(static_cast<std::uint8_t>((offset >> 8) & 0xff));
-    emitByte(static_cast<std::uint8_t>(offset & 0xff));
+void Compiler::emitLong(std::size_t operand) {
+    emitByte(static_cast<std::uint8_t>((operand >> 16) & 0xff));
+    emitByte(static_cast<std::uint8_t>((operand >> 8) & 0xff));
+    emitByte(static_cast<std::uint8_t>(operand & 0xff));
 }
 
-std::uint8_t Compiler::makeConstant(const Value& value) {
+std::size_t Compiler::makeConstant(const Value& value) {
     auto constant = chunk.addConstant(value);
-    if (constant > UINT8_MAX) {
+    if (constant > MAX_LONG_OPERAND) {
         error("Too many constants in one chunk.");
         return 0;
     }
-    return static_cast<std::uint8_t>(constant);
+    return constant;
 }
 
 void Compiler::synchronize() {
@@ -451,6 +670,15 @@ void Compiler::beginScope() {
 void Compiler::endScope() {
     variables.scopeDepth--;
 
+    // locals of the register backend only occupy registers, there is nothing to pop
+    if (backend == Backend::Register) {
+        while (variables.localCount > 0 && variables.locals[static_cast<std::size_t>(variables.localCount - 1)].depth > variables.scopeDepth) {
+            variables.localCount--;
+        }
+        nextRegister = static_cast<std::size_t>(variables.localCount);
+        return;
+    }
+
     while (variables.localCount > 0 && variables.locals[static_cast<std::size_t>(variables.localCount - 1)].depth > variables.scopeDepth) {
         emitByte(OpCode::Pop);
         variables.localCount--;
@@ -459,10 +687,23 @@ void Compiler::endScope() {
 
 void Compiler::patchJump(int offset) {
     std::size_t offset_size = static_cast<std::size_t>(offset);
+
+    if (longJumps) {
+        std::size_t jump = chunk.code.size() - offset_size - 3;
+        if (jump > MAX_LONG_OPERAND) {
+            error("Too much code to jump over.");
+        }
+        chunk.code[offset_size] = (jump >> 16) & 0xff;
+        chunk.code[offset_size + 1] = (jump >> 8) & 0xff;
+        chunk.code[offset_size + 2] = jump & 0xff;
+        return;
+    }
+
     std::size_t jump = chunk.code.size() - offset_size - 2;
 
+    // compile() starts over with long jumps once this pass is done
     if (jump > UINT16_MAX) {
-        error("Too much code to jump over.");
+        jumpOverflow = true;
     }
 
     chunk.code[offset_size] = (jump >> 8) & 0xff;
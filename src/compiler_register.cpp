@@ -0,0 +1,353 @@
+#include "compiler.h"
+#include <algorithm>
+#include <cassert>
+
+// Code generation for the register backend. Every local lives in the register with the
+// same index as its slot in variables.locals, temporaries are allocated on top of them and
+// freed in stack order. After every statement all temporaries are free again.
+
+void Compiler::whileStatementRegister() {
+    auto loopStart = chunk.code.size();
+    consume(TokenType::LeftParen, "Expect '(' after 'while'.");
+    expression();
+    consume(TokenType::RightParen, "Expect ')' after condition.");
+
+    auto condition = exprToAnyRegister(expr);
+    freeExpr(expr);
+    auto exitJump = emitRegisterJump(RegOpCode::JumpIfFalse, condition);
+
+    statement();
+    emitLoop(loopStart);
+
+    patchJump(exitJump);
+}
+
+void Compiler::ifStatementRegister() {
+    consume(TokenType::LeftParen, "Expect '('  after 'if'.");
+    expression();
+    consume(TokenType::RightParen, "Expect ')'  after condition.");
+
+    auto condition = exprToAnyRegister(expr);
+    freeExpr(expr);
+    int thenJump = emitRegisterJump(RegOpCode::JumpIfFalse, condition);
+    statement();
+
+    int elseJump = emitJump(RegOpCode::Jump);
+    patchJump(thenJump);
+
+    if (match(TokenType::Else)) {
+        statement();
+    }
+    patchJump(elseJump);
+}
+
+void Compiler::printStatementRegister() {
+    expression();
+    consume(TokenType::Semicolon, "Expect ';' after value.");
+
+    auto reg = exprToAnyRegister(expr);
+    freeExpr(expr);
+    emitBytes(RegOpCode::Print, reg);
+}
+
+void Compiler::expressionStatementRegister() {
+    expression();
+    consume(TokenType::Semicolon, "Expect ';' after expression.");
+
+    // a global read can still fail and an emitted instruction needs a destination,
+    // every other expression has no effect when its value is dropped
+    if (expr.kind == ExprDesc::Kind::Global || expr.kind == ExprDesc::Kind::Relocatable) {
+        std::ignore = exprToNextRegister(expr);
+    }
+    freeExpr(expr);
+}
+
+void Compiler::varDeclarationRegister() {
+    std::uint16_t global = parseVariable("Expect variable name.");
+
+    if (variables.scopeDepth > 0) {
+        // the new local was just added, its register is the next free one
+        auto reg = reserveRegister();
+        if (match(TokenType::Equal)) {
+            expression();
+            exprToRegister(expr, reg);
+        } else {
+            emitBytes(RegOpCode::LoadNil, reg);
+        }
+        consume(TokenType::Semicolon, "Expect ';' after variable declaration.");
+        markInitialized();
+        return;
+    }
+
+    if (match(TokenType::Equal)) {
+        expression();
+    } else {
+        expr = ExprDesc { .kind { ExprDesc::Kind::Nil } };
+    }
+    consume(TokenType::Semicolon, "Expect ';' after variable declaration.");
+
+    auto reg = exprToAnyRegister(expr);
+    freeExpr(expr);
+    emitShort(RegOpCode::DefineGlobal, global);
+    emitByte(reg);
+}
+
+void Compiler::unaryRegister(TokenType operatorType) {
+    if (const auto value = constantValue(expr)) {
+        if (const auto folded = foldUnary(operatorType, *value)) {
+            expr = constantExpr(*folded);
+            return;
+        }
+    }
+
+    auto operand = exprToAnyRegister(expr);
+    freeExpr(expr);
+
+    const auto offset = chunk.code.size();
+    switch (operatorType) {
+        case TokenType::Minus: emitByte(RegOpCode::Negate); break;
+        case TokenType::Bang: emitByte(RegOpCode::Not); break;
+        default: assert(false && "Unreachable TokenType in unary expression.");
+    }
+    emitBytes(0_u8, operand);
+    expr = ExprDesc { .kind { ExprDesc::Kind::Relocatable }, .index { offset } };
+}
+
+void Compiler::binaryRegister(TokenType operatorType, Precedence precedence) {
+    auto left = expr;
+
+    // Constants and locals are read after the right operand was evaluated. Everything else
+    // has to be evaluated first, and so does a local that the right operand assigns to.
+    if (left.kind == ExprDesc::Kind::Local) {
+        if (assignsAhead(variables.locals[left.index].name)) {
+            std::ignore = exprToNextRegister(left);
+        }
+    } else if (left.kind == ExprDesc::Kind::Global || left.kind == ExprDesc::Kind::Relocatable) {
+        std::ignore = exprToNextRegister(left);
+    }
+
+    parsePrecedence(precedence);
+    auto right = expr;
+
+    // constant operands cost nothing until they are loaded, so the folded value simply replaces them
+    const auto lhsValue = constantValue(left);
+    const auto rhsValue = constantValue(right);
+    if (lhsValue && rhsValue) {
+        if (const auto folded = foldBinary(operatorType, *lhsValue, *rhsValue)) {
+            expr = constantExpr(*folded);
+            return;
+        }
+    }
+
+    const auto rhs = exprToAnyRegister(right);
+    const auto lhs = exprToAnyRegister(left);
+    freeExprs(left, right);
+
+    const auto offset = chunk.code.size();
+    switch (operatorType) {
+        case TokenType::Plus: emitByte(RegOpCode::Add); break;
+        case TokenType::Minus: emitByte(RegOpCode::Subtract); break;
+        case TokenType::Star: emitByte(RegOpCode::Multiply); break;
+        case TokenType::Slash: emitByte(RegOpCode::Divide); break;
+        case TokenType::BangEqual: emitByte(RegOpCode::NotEqual); break;
+        case TokenType::EqualEqual: emitByte(RegOpCode::Equal); break;
+        case TokenType::Greater: emitByte(RegOpCode::Greater); break;
+        case TokenType::GreaterEqual: emitByte(RegOpCode::NotLess); break;
+        case TokenType::Less: emitByte(RegOpCode::Less); break;
+        case TokenType::LessEqual: emitByte(RegOpCode::NotGreater); break;
+        default: assert(false && "Unreachable TokenType in binary expression.");
+    }
+    emitByte(0_u8);
+    emitBytes(lhs, rhs);
+    expr = ExprDesc { .kind { ExprDesc::Kind::Relocatable }, .index { offset } };
+}
+
+void Compiler::namedVariableRegister(const Token& name, bool canAssign) {
+    int local = resolveLocal(name);
+
+    if (local != -1) {
+        const auto reg = static_cast<std::uint8_t>(local);
+        if (canAssign && match(TokenType::Equal)) {
+            expression();
+            exprToRegister(expr, reg);
+        }
+        expr = ExprDesc { .kind { ExprDesc::Kind::Local }, .index { reg } };
+        return;
+    }
+
+    auto slot = globalSlot(name);
+
+    if (canAssign && match(TokenType::Equal)) {
+        expression();
+        // the value of the assignment stays in the register it was stored from
+        auto reg = exprToAnyRegister(expr);
+        emitShort(RegOpCode::SetGlobal, slot);
+        emitByte(reg);
+        return;
+    }
+    expr = ExprDesc { .kind { ExprDesc::Kind::Global }, .index { slot } };
+}
+
+void Compiler::logicalRegister(RegOpCode jump, Precedence precedence) {
+    // both operands end up in the same register, so the left one always needs a fresh one
+    auto result = exprToNextRegister(expr);
+    auto endJump = emitRegisterJump(jump, result);
+
+    parsePrecedence(precedence);
+    exprToRegister(expr, result);
+
+    patchJump(endJump);
+    expr = ExprDesc { .kind { ExprDesc::Kind::Temp }, .index { result } };
+}
+
+std::uint8_t Compiler::reserveRegister() {
+    if (nextRegister > UINT8_MAX) {
+        error("Too many registers in one chunk.");
+        return 0;
+    }
+    const auto reg = nextRegister++;
+    chunk.registerCount = std::max(chunk.registerCount, nextRegister);
+    return static_cast<std::uint8_t>(reg);
+}
+
+void Compiler::freeRegister(std::size_t reg) {
+    // registers of locals are only freed by endScope()
+    if (reg >= static_cast<std::size_t>(variables.localCount) && reg + 1 == nextRegister) {
+        nextRegister--;
+    }
+}
+
+void Compiler::freeExpr(const ExprDesc& desc) {
+    if (desc.kind == ExprDesc::Kind::Temp) {
+        freeRegister(desc.index);
+    }
+}
+
+void Compiler::freeExprs(const ExprDesc& first, const ExprDesc& second) {
+    // temporaries have to be freed in the reverse order they were reserved
+    if (first.kind == ExprDesc::Kind::Temp && second.kind == ExprDesc::Kind::Temp && first.index < second.index) {
+        freeExpr(second);
+        freeExpr(first);
+    } else {
+        freeExpr(first);
+        freeExpr(second);
+    }
+}
+
+void Compiler::dischargeToRegister(ExprDesc& desc, std::uint8_t reg) {
+    switch (desc.kind) {
+        case ExprDesc::Kind::Void: break;
+        case ExprDesc::Kind::Nil: emitBytes(RegOpCode::LoadNil, reg); break;
+        case ExprDesc::Kind::True: emitBytes(RegOpCode::LoadTrue, reg); break;
+        case ExprDesc::Kind::False: emitBytes(RegOpCode::LoadFalse, reg); break;
+        case ExprDesc::Kind::Constant: {
+            if (desc.index > UINT8_MAX) {
+                emitBytes(RegOpCode::LoadConstantLong, reg);
+                emitLong(desc.index);
+            } else {
+                emitBytes(RegOpCode::LoadConstant, reg);
+                emitByte(static_cast<std::uint8_t>(desc.index));
+            }
+            break;
+        }
+        case ExprDesc::Kind::Global: {
+            emitBytes(RegOpCode::GetGlobal, reg);
+            emitByte(static_cast<std::uint8_t>((desc.index >> 8) & 0xff));
+            emitByte(static_cast<std::uint8_t>(desc.index & 0xff));
+            break;
+        }
+        case ExprDesc::Kind::Local:
+        case ExprDesc::Kind::Temp: {
+            if (desc.index != reg) {
+                emitBytes(RegOpCode::Move, reg);
+                emitByte(static_cast<std::uint8_t>(desc.index));
+            }
+            break;
+        }
+        case ExprDesc::Kind::Relocatable: {
+            chunk.code[desc.index + 1] = reg;
+            break;
+        }
+    }
+    desc.kind = reg < variables.localCount ? ExprDesc::Kind::Local : ExprDesc::Kind::Temp;
+    desc.index = reg;
+}
+
+void Compiler::exprToRegister(ExprDesc& desc, std::uint8_t reg) {
+    freeExpr(desc);
+    dischargeToRegister(desc, reg);
+}
+
+std::uint8_t Compiler::exprToNextRegister(ExprDesc& desc) {
+    freeExpr(desc);
+    auto reg = reserveRegister();
+    dischargeToRegister(desc, reg);
+    desc.kind = ExprDesc::Kind::Temp;
+    return reg;
+}
+
+std::uint8_t Compiler::exprToAnyRegister(ExprDesc& desc) {
+    if (desc.kind == ExprDesc::Kind::Local || desc.kind == ExprDesc::Kind::Temp) {
+        return static_cast<std::uint8_t>(desc.index);
+    }
+    return exprToNextRegister(desc);
+}
+
+bool Compiler::assignsAhead(const Token& name) {
+    // Scans the rest of the statement for `name =`. Expressions cannot contain blocks,
+    // so the right operand of the current expression ends before the statement does.
+    Scanner lookahead = scanner;
+    auto lookaheadCursor = cursor;
+    Token token = parser.current;
+    int depth = 0;
+
+    while (true) {
+        switch (token.type) {
+            case TokenType::Semicolon:
+            case TokenType::LeftBrace:
+            case TokenType::RightBrace:
+            case TokenType::Eof:
+            case TokenType::Error:
+                return false;
+            case TokenType::LeftParen: depth++; break;
+            case TokenType::RightParen: {
+                if (--depth < 0) {
+                    return false;
+                }
+                break;
+            }
+            default: break;
+        }
+
+        Token next = tokens != nullptr ? tokens->next(lookaheadCursor).token : lookahead.scanToken();
+        if (token.type == TokenType::Identifier && next.type == TokenType::Equal && identifiersEqual(token, name)) {
+            return true;
+        }
+        token = next;
+    }
+}
+
+std::optional<Value> Compiler::constantValue(const ExprDesc& desc) const {
+    switch (desc.kind) {
+        case ExprDesc::Kind::Nil: return Value { Nil{} };
+        case ExprDesc::Kind::True: return Value { true };
+        case ExprDesc::Kind::False: return Value { false };
+        case ExprDesc::Kind::Constant: return chunk.constants[desc.index];
+        default: return std::nullopt;
+    }
+}
+
+ExprDesc Compiler::constantExpr(const Value& value) {
+    if (holds_type<Nil>(value)) {
+        return ExprDesc { .kind { ExprDesc::Kind::Nil } };
+    }
+    if (holds_type<Bool>(value)) {
+        return ExprDesc { .kind { get_type_unchecked<Bool>(value) ? ExprDesc::Kind::True : ExprDesc::Kind::False } };
+    }
+    return ExprDesc { .kind { ExprDesc::Kind::Constant }, .index { makeConstant(value) } };
+}
+
+int Compiler::emitRegisterJump(RegOpCode instruction, std::uint8_t reg) {
+    emitBytes(longJumps ? longJump(instruction) : instruction, reg);
+    return emitJumpOffset();
+}
@@ -0,0 +1,12 @@
+#include "globals.h"
+
+std::size_t Globals::resolve(ObjString *name) {
+    if (auto it = m_slots.find(name); it != m_slots.end()) {
+        return it->second;
+    }
+    const auto slot = m_names.size();
+    m_slots.emplace(name, slot);
+    m_names.push_back(name);
+    values.push_back(undefined_value());
+    return slot;
+}
@@ -0,0 +1,225 @@
+#include "heap.h"
+#include <algorithm>
+#include <new>
+#include <time.h>
+
+ThreadClock::time_point ThreadClock::now() noexcept {
+    timespec time {};
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return time_point(std::chrono::seconds(time.tv_sec) + std::chrono::nanoseconds(time.tv_nsec));
+}
+
+Heap::~Heap() {
+    Obj *object = m_objects;
+    while (object != nullptr) {
+        Obj *next = object->next;
+        freeObject(object);
+        object = next;
+    }
+}
+
+ObjString *Heap::copyString(std::string_view chars) {
+    const auto hash = hashString(chars);
+    if (auto it = m_strings.find(StringKey { chars, hash }); it != m_strings.end()) {
+        shade(*it);
+        return *it;
+    }
+    return allocateString(std::string(chars), hash);
+}
+
+ObjString *Heap::takeString(std::string&& chars) {
+    const auto hash = hashString(chars);
+    if (auto it = m_strings.find(StringKey { chars, hash }); it != m_strings.end()) {
+        shade(*it);
+        return *it;
+    }
+    return allocateString(std::move(chars), hash);
+}
+
+Obj *Heap::concatenate(Obj *left, Obj *right) {
+    const auto length = stringLength(left) + stringLength(right);
+    if (length < ROPE_THRESHOLD) {
+        return takeString(flatten(left)->chars + flatten(right)->chars);
+    }
+
+    auto *rope = new (m_arena.allocate(sizeof(ObjRope))) ObjRope(left, right, length);
+    track(rope);
+    return rope;
+}
+
+ObjString *Heap::flatten(Obj *string) {
+    if (string->type == ObjType::String) {
+        return static_cast<ObjString *>(string);
+    }
+
+    auto *rope = static_cast<ObjRope *>(string);
+    if (rope->flat == nullptr) {
+        rope->flat = takeString(ropeToString(rope));
+        rope->left = nullptr;
+        rope->right = nullptr;
+        // the rope may already be black
+        writeBarrier(rope->flat);
+    }
+    return rope->flat;
+}
+
+ObjString *Heap::allocateString(std::string chars, std::uint32_t hash) {
+    auto *str = new (m_arena.allocate(sizeof(ObjString))) ObjString(std::move(chars), hash);
+    m_strings.insert(str);
+    track(str);
+    return str;
+}
+
+void Heap::track(Obj *object) {
+    // black during a cycle, white again once the next one starts
+    object->mark = m_mark;
+    object->next = m_objects;
+    m_objects = object;
+
+    const auto size = objectSize(object);
+    m_stats.bytesAllocated += size;
+    m_stats.totalBytesAllocated += size;
+}
+
+void Heap::freeObject(Obj *object) {
+    const auto size = objectSize(object);
+    m_stats.bytesAllocated -= size;
+    m_stats.totalBytesFreed += size;
+
+    switch (object->type) {
+        case ObjType::String: {
+            static_cast<ObjString *>(object)->~ObjString();
+            m_arena.deallocate(object, sizeof(ObjString));
+            break;
+        }
+        case ObjType::Rope: {
+            static_cast<ObjRope *>(object)->~ObjRope();
+            m_arena.deallocate(object, sizeof(ObjRope));
+            break;
+        }
+    }
+}
+
+std::size_t Heap::objectSize(const Obj *object) {
+    switch (object->type) {
+        case ObjType::String: return sizeof(ObjString) + static_cast<const ObjString *>(object)->chars.size();
+        case ObjType::Rope: return sizeof(ObjRope);
+    }
+    return 0;
+}
+
+void Heap::markValue(const Value& value) {
+    visitValue([this](const auto& v) {
+        if constexpr (std::is_same_v<std::decay_t<decltype(v)>, Obj *>) {
+            markObject(v);
+        }
+    }, value);
+}
+
+void Heap::markObject(Obj *object) {
+    // the undefined sentinel of the globals is a null Obj, permanent objects are shared with other threads
+    if (object == nullptr || object->permanent || isMarked(object)) {
+        return;
+    }
+    object->mark = m_mark;
+    m_grayStack.push_back(object);
+}
+
+void Heap::shade(Obj *object) {
+    // a white string in the intern table may be dead, but it is about to be used again
+    if (m_phase != Phase::Idle) {
+        markObject(object);
+    }
+}
+
+void Heap::beginCycle() {
+    m_mark = not m_mark;
+    m_grayStack.clear();
+    m_phase = Phase::Marking;
+}
+
+std::size_t Heap::work(std::size_t budget, ThreadClock::time_point deadline) {
+    auto sliceStart = ThreadClock::now();
+    std::size_t done = 0;
+    while (m_phase != Phase::Idle && done < budget) {
+        // the first slice always runs, so every step makes progress
+        if (done > 0 && done % WORK_BETWEEN_CLOCK_CHECKS == 0 && deadline != ThreadClock::time_point::max()) {
+            const auto now = ThreadClock::now();
+            m_slowestSlice = std::max<ThreadClock::duration>(m_slowestSlice, now - sliceStart);
+            sliceStart = now;
+            // the next slice only starts if it fits even when it is as slow as the slowest one so far,
+            // an eighth of the budget is kept free for slices that are slower than any before
+            if (deadline - now < std::max<ThreadClock::duration>(m_slowestSlice, m_config.pauseBudget / 8)) {
+                return done;
+            }
+        }
+
+        if (m_phase == Phase::Marking) {
+            if (m_grayStack.empty()) {
+                m_phase = Phase::Sweeping;
+                m_sweepLink = &m_objects;
+                continue;
+            }
+            Obj *object = m_grayStack.back();
+            m_grayStack.pop_back();
+            blackenObject(object);
+            done++;
+        } else if (*m_sweepLink == nullptr) {
+            finishCycle();
+        } else {
+            sweepObject();
+            done++;
+        }
+    }
+    return done;
+}
+
+void Heap::blackenObject(Obj *object) {
+    switch (object->type) {
+        // strings do not reference other objects
+        case ObjType::String: break;
+        case ObjType::Rope: {
+            auto *rope = static_cast<ObjRope *>(object);
+            markObject(rope->left);
+            markObject(rope->right);
+            markObject(rope->flat);
+            break;
+        }
+    }
+}
+
+void Heap::sweepObject() {
+    Obj *object = *m_sweepLink;
+    if (isMarked(object)) {
+        m_sweepLink = &object->next;
+        return;
+    }
+
+    *m_sweepLink = object->next;
+    if (object->type == ObjType::String) {
+        m_strings.erase(static_cast<ObjString *>(object));
+    }
+    freeObject(object);
+}
+
+void Heap::finishCycle() {
+    const auto grown = static_cast<double>(m_stats.bytesAllocated) * m_config.growthFactor;
+    m_nextGC = std::max(static_cast<std::size_t>(grown), m_config.minimumThreshold);
+    m_phase = Phase::Idle;
+    m_sweepLink = nullptr;
+    m_stats.collections++;
+}
+
+void Heap::recordPause(std::chrono::nanoseconds pause, std::size_t work) {
+    m_stats.steps++;
+    m_stats.lastStepWork = work;
+    m_stats.maxStepWork = std::max(m_stats.maxStepWork, work);
+    m_stats.lastPause = pause;
+    m_stats.maxPause = std::max(m_stats.maxPause, pause);
+    m_stats.totalPause += pause;
+}
+
+void Heap::configure(const GCConfig& config) {
+    m_config = config;
+    m_nextGC = config.initialThreshold;
+}
@@ -1,12 +1,22 @@
+#include <algorithm>
+#include <charconv>
 #include <fmt/format.h>
-#include <fstream>
 #include <iostream>
+#include <optional>
 #include <filesystem>
+#include <fstream>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+#include "batch_runner.h"
 #include "chunk.h"
+#include "compile_driver.h"
+#include "source_file.h"
 #include "vm.h"
 
-static int repl() {
+static int repl(OptimizationLevel optimization) {
     VM vm;
+    vm.setOptimizationLevel(optimization);
 
     fmt::print("> ");
     std::string line;
@@ -21,51 +31,157 @@ static int repl() {
     return 0;
 }
 
-static int runFile(const std::filesystem::path& path) {
-    if (not std::filesystem::exists(path)) {
-        fmt::print(stderr, "The file: {} does not exists or can not be opened\n", path.string());
+static int exitCode(InterpretResult result) {
+    if (result == InterpretResult::CompileError) {
         return 1;
     }
 
+    if (result == InterpretResult::RuntimeError) {
+        return 2;
+    }
+
+    return 0;
+}
+
+static int runFile(const std::filesystem::path& path, OptimizationLevel optimization) {
     VM vm;
-    std::ifstream ifs(path);
+    vm.setOptimizationLevel(optimization);
 
-    if (not ifs.is_open()) {
-        fmt::print(stderr, "The file: {} does not exists or can not be opened\n", path.string());
+    if (path.extension() == ".loxc") {
+        return exitCode(vm.runBytecodeFile(path));
+    }
+
+    const auto source = SourceFile::load(path);
+    if (not source) {
         return 1;
     }
+    return exitCode(vm.interpret(source->text()));
+}
 
-    std::string source;
-    source.reserve(std::filesystem::file_size(path));
-    source.assign( (std::istreambuf_iterator<char>(ifs) ),
-                    (std::istreambuf_iterator<char>() ));
+// runs the whole input as one script, used for `-` and for input that is not a terminal
+static int runStdin(OptimizationLevel optimization) {
+    const auto source = SourceFile::read(STDIN_FILENO);
+    if (not source) {
+        return 1;
+    }
+
+    VM vm;
+    vm.setOptimizationLevel(optimization);
+    return exitCode(vm.interpret(source->text()));
+}
 
-    auto result = vm.interpret(source);
+// compiles every file at once, then runs them in order in one VM, so a file sees the
+// globals of the files before it
+static int runFiles(const std::vector<std::filesystem::path>& paths, OptimizationLevel optimization) {
+    const auto files = compileFiles(paths, CompileOptions { .optimization { optimization } });
 
-    if (result == InterpretResult::CompileError) {
+    bool compiled = true;
+    for (const auto& file : files) {
+        if (not file.diagnostics.empty()) {
+            fmt::print(stderr, "In {}:\n{}", file.path.string(), file.diagnostics);
+        }
+        compiled = compiled && file.program != nullptr;
+    }
+    if (not compiled) {
         return 1;
     }
 
-    if (result == InterpretResult::RuntimeError) {
-        return 2;
+    VM vm;
+    for (const auto& file : files) {
+        if (const auto result = vm.run(file.program); result != InterpretResult::Ok) {
+            return exitCode(result);
+        }
     }
-
     return 0;
 }
 
+// runs every script below `directory` in its own VM and writes the results as JSON to `output`, or stdout if empty
+static int runBatch(const std::filesystem::path& directory, const CompileOptions& options, const std::filesystem::path& output) {
+    if (not std::filesystem::is_directory(directory)) {
+        fmt::print(stderr, "The directory: {} can not be opened\n", directory.string());
+        return 1;
+    }
+
+    const auto scripts = findScripts(directory);
+    const auto results = runScripts(scripts, options);
+    const auto json = resultsToJson(results);
+    if (output.empty()) {
+        fmt::print("{}", json);
+    } else if (not (std::ofstream(output) << json)) {
+        fmt::print(stderr, "The file: {} can not be written\n", output.string());
+        return 1;
+    }
+
+    int code = 0;
+    for (const auto& result : results) {
+        code = std::max(code, exitCode(result.result));
+    }
+    return code;
+}
+
+// `--batch dir [-j threads] [-o results.json]`, nullopt if the arguments do not match
+static std::optional<int> batch(std::vector<std::string_view> args, OptimizationLevel optimization) {
+    if (args.size() < 2 || args.size() % 2 != 0 || args[0] != "--batch") {
+        return std::nullopt;
+    }
+
+    CompileOptions options { .optimization { optimization } };
+    std::filesystem::path output;
+    for (std::size_t i = 2; i < args.size(); i += 2) {
+        const auto value = args[i + 1];
+        if (args[i] == "-j") {
+            const auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), options.threads);
+            if (error != std::errc() || end != value.data() + value.size() || options.threads == 0) {
+                return std::nullopt;
+            }
+        } else if (args[i] == "-o") {
+            output = value;
+        } else {
+            return std::nullopt;
+        }
+    }
+    return runBatch(args[1], options, output);
+}
+
+static int compileFile(const std::filesystem::path& input, const std::filesystem::path& output, OptimizationLevel optimization) {
+    const auto source = SourceFile::load(input);
+    if (not source) {
+        return 1;
+    }
+
+    VM vm;
+    vm.setOptimizationLevel(optimization);
+    return vm.compileBytecodeFile(source->text(), output) ? 0 : 1;
+}
+
 int main(int argc, char *argv[]) {
 #ifdef DEBUG_TRACE_EXECUTION
-    fmt::print("===== DEBUG MODE =====\n");
+    // on stderr, the output of --batch is JSON on stdout
+    fmt::print(stderr, "===== DEBUG MODE =====\n");
 #endif
 
-    VM vm;
+    std::vector<std::string_view> args(argv + 1, argv + argc);
+
+    auto optimization = OptimizationLevel::None;
+    if (not args.empty() && args.front() == "-O") {
+        optimization = OptimizationLevel::Basic;
+        args.erase(args.begin());
+    }
 
-    if (argc == 1) {
-        return repl();
-    } else if (argc == 2) {
-        return runFile(argv[1]);
+    if (args.empty()) {
+        return ::isatty(STDIN_FILENO) ? repl(optimization) : runStdin(optimization);
+    } else if (args.size() == 1 && args.front() == "-") {
+        return runStdin(optimization);
+    } else if (args.size() == 1) {
+        return runFile(args.front(), optimization);
+    } else if (args.size() == 4 && args[0] == "--compile" && args[2] == "-o") {
+        return compileFile(args[1], args[3], optimization);
+    } else if (const auto code = batch(args, optimization)) {
+        return *code;
+    } else if (std::none_of(args.begin(), args.end(), [](std::string_view arg) { return arg.starts_with("-"); })) {
+        return runFiles(std::vector<std::filesystem::path>(args.begin(), args.end()), optimization);
     } else {
-        fmt::print(stderr, "Usage: Bytecode-VM [path]");
+        fmt::print(stderr, "Usage: Bytecode-VM [-O] [path... | -]\n       Bytecode-VM [-O] --compile in.lox -o out.loxc\n       Bytecode-VM [-O] --batch dir [-j threads] [-o results.json]");
         std::exit(84);
     }
 }
@@ -0,0 +1,51 @@
+#include "mapped_file.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::shared_ptr<const MappedFile> MappedFile::open(const std::filesystem::path& path) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    struct stat info {};
+    if (::fstat(fd, &info) == -1 || info.st_size == 0) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    const auto size = static_cast<std::size_t>(info.st_size);
+    void *data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return nullptr;
+    }
+    return std::shared_ptr<const MappedFile>(new MappedFile(static_cast<const std::uint8_t *>(data), size, size));
+}
+
+std::shared_ptr<const MappedFile> MappedFile::openTerminated(int fd, std::size_t size) {
+    // The file is mapped over the start of a larger range of anonymous zero pages. The kernel
+    // clears the rest of the last file page, and if the file ends on a page boundary the next
+    // page is one of the anonymous ones.
+    const auto page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    const auto mappedSize = (size / page + 1) * page;
+    void *reserved = ::mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED) {
+        return nullptr;
+    }
+    void *data = ::mmap(reserved, size, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0);
+    if (data == MAP_FAILED) {
+        ::munmap(reserved, mappedSize);
+        return nullptr;
+    }
+    // sources are scanned once from front to back
+    ::madvise(data, size, MADV_SEQUENTIAL);
+    return std::shared_ptr<const MappedFile>(new MappedFile(static_cast<const std::uint8_t *>(data), size, mappedSize));
+}
+
+MappedFile::~MappedFile() {
+    ::munmap(const_cast<std::uint8_t *>(m_data), m_mappedSize);
+}
@@ -0,0 +1,482 @@
+#include "optimizer.h"
+#include <initializer_list>
+#include <limits>
+
+namespace {
+
+struct PendingJump {
+    std::size_t offset;
+    std::size_t oldTarget;
+};
+
+struct JumpTargets {
+    // indexed by offset, true if at least one jump lands there
+    std::vector<bool> targets;
+    std::size_t jumpCount { 0 };
+};
+
+JumpTargets collectJumpTargets(const Chunk& chunk) {
+    JumpTargets result { .targets = std::vector<bool>(chunk.code.size() + 1, false) };
+    for (std::size_t offset = 0; offset < chunk.code.size();) {
+        const auto opcode = static_cast<OpCode>(chunk.code[offset]);
+        if (isJump(opcode)) {
+            result.targets[chunk.jumpTarget(offset)] = true;
+            result.jumpCount++;
+        }
+        offset += instructionSize(opcode);
+    }
+    return result;
+}
+
+struct Instruction {
+    std::size_t offset;
+    OpCode opcode;
+    // old offset of the jump target, only used for Jump, JumpIfFalse and Loop
+    std::size_t target { 0 };
+    bool removed { false };
+};
+
+[[nodiscard]] bool isUnconditionalJump(OpCode opcode) {
+    return opcode == OpCode::Jump || opcode == OpCode::JumpLong || opcode == OpCode::Loop || opcode == OpCode::LoopLong;
+}
+
+[[nodiscard]] bool isConditionalJump(OpCode opcode) {
+    return opcode == OpCode::JumpIfFalse || opcode == OpCode::JumpIfFalseLong;
+}
+
+[[nodiscard]] bool pushesLiteral(OpCode opcode) {
+    switch (opcode) {
+        case OpCode::Constant:
+        case OpCode::ConstantLong:
+        case OpCode::Nil:
+        case OpCode::True:
+        case OpCode::False:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/**
+ * @brief Basic blocks of a chunk that is rewritten by cleanupControlFlow(). Every pass only
+ *        marks instructions as removed, the offsets of the original code stay valid until
+ *        the chunk is emitted again.
+ */
+class ControlFlow {
+public:
+    explicit ControlFlow(const Chunk& chunk) : m_chunk(chunk), m_index(chunk.code.size() + 1, NONE) {
+        for (std::size_t offset = 0; offset < chunk.code.size();) {
+            const auto opcode = static_cast<OpCode>(chunk.code[offset]);
+            m_index[offset] = m_instructions.size();
+            m_instructions.push_back(Instruction {
+                .offset { offset },
+                .opcode { opcode },
+                .target { isJump(opcode) ? chunk.jumpTarget(offset) : 0 },
+            });
+            offset += instructionSize(opcode);
+        }
+    }
+
+    // runs every pass until none of them finds anything to do
+    void simplify() {
+        bool changed = true;
+        while (changed) {
+            changed = threadJumps();
+            changed |= foldConstantConditions();
+            changed |= removeDroppedLiterals();
+            changed |= removeUnreachableBlocks();
+            changed |= removeEmptyJumps();
+        }
+    }
+
+    void emit(Chunk& chunk) const;
+
+private:
+    static constexpr std::size_t NONE { std::numeric_limits<std::size_t>::max() };
+
+    // first instruction that is executed when the code at `offset` is reached
+    [[nodiscard]] std::size_t resolve(std::size_t offset) const {
+        std::size_t index = m_index[offset] == NONE ? m_instructions.size() : m_index[offset];
+        while (index < m_instructions.size() && m_instructions[index].removed) {
+            index++;
+        }
+        return index;
+    }
+
+    [[nodiscard]] std::size_t next(std::size_t index) const { return resolve(end(index)); }
+    [[nodiscard]] std::size_t end(std::size_t index) const {
+        return m_instructions[index].offset + instructionSize(m_instructions[index].opcode);
+    }
+
+    [[nodiscard]] std::size_t previous(std::size_t index) const {
+        while (index-- > 0) {
+            if (not m_instructions[index].removed) {
+                return index;
+            }
+        }
+        return NONE;
+    }
+
+    [[nodiscard]] bool isLoop(std::size_t index) const {
+        return m_instructions[index].opcode == OpCode::Loop || m_instructions[index].opcode == OpCode::LoopLong;
+    }
+
+    [[nodiscard]] bool isLong(std::size_t index) const {
+        return isLongJump(m_instructions[index].opcode);
+    }
+
+    // every instruction that can be reached by a jump instead of falling through
+    [[nodiscard]] std::vector<bool> jumpTargets() const;
+
+    bool threadJumps();
+    bool foldConstantConditions();
+    bool removeDroppedLiterals();
+    bool removeUnreachableBlocks();
+    bool removeEmptyJumps();
+
+private:
+    const Chunk& m_chunk;
+    std::vector<Instruction> m_instructions;
+    // index into m_instructions for every offset that starts an instruction
+    std::vector<std::size_t> m_index;
+};
+
+std::vector<bool> ControlFlow::jumpTargets() const {
+    std::vector<bool> targets(m_instructions.size() + 1, false);
+    for (const auto& instruction : m_instructions) {
+        if (not instruction.removed && isJump(instruction.opcode)) {
+            targets[resolve(instruction.target)] = true;
+        }
+    }
+    return targets;
+}
+
+// Jump to a jump goes straight to the final target. A JumpIfFalse that lands on another
+// JumpIfFalse takes that one as well, the condition is still the same value on the stack.
+bool ControlFlow::threadJumps() {
+    bool changed = false;
+    for (std::size_t index = 0; index < m_instructions.size(); ++index) {
+        auto& jump = m_instructions[index];
+        if (jump.removed || not (isUnconditionalJump(jump.opcode) || isConditionalJump(jump.opcode))) {
+            continue;
+        }
+
+        // bounded, jumps can form a cycle
+        for (std::size_t steps = 0; steps < m_instructions.size(); ++steps) {
+            const auto target = resolve(jump.target);
+            if (target == m_instructions.size() || target == index) {
+                break;
+            }
+            const auto& via = m_instructions[target];
+            const bool follows = isUnconditionalJump(via.opcode) || (isConditionalJump(jump.opcode) && isConditionalJump(via.opcode));
+            if (not follows || via.target == jump.target) {
+                break;
+            }
+
+            // conditional jumps only go forward, and the old distance has to fit into the
+            // operand, the emitted code is never longer than the original one
+            const auto from = end(index);
+            if (isConditionalJump(jump.opcode) && via.target < from) {
+                break;
+            }
+            const auto distance = via.target < from ? from - via.target : via.target - from;
+            if (distance > (isLong(index) ? 0xffffff : UINT16_MAX)) {
+                break;
+            }
+            jump.target = via.target;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// `true`, `false` and `nil` (and every Constant, those are never falsey) directly in front
+// of a JumpIfFalse decide the jump at compile time
+bool ControlFlow::foldConstantConditions() {
+    bool changed = false;
+    const auto targets = jumpTargets();
+    for (std::size_t index = 0; index < m_instructions.size(); ++index) {
+        auto& jump = m_instructions[index];
+        if (jump.removed || not isConditionalJump(jump.opcode) || targets[index]) {
+            continue;
+        }
+        const auto literal = previous(index);
+        if (literal == NONE || not pushesLiteral(m_instructions[literal].opcode)) {
+            continue;
+        }
+
+        const auto opcode = m_instructions[literal].opcode;
+        if (opcode == OpCode::False || opcode == OpCode::Nil) {
+            jump.opcode = isLong(index) ? OpCode::JumpLong : OpCode::Jump;
+        } else {
+            jump.removed = true;
+        }
+        changed = true;
+    }
+    return changed;
+}
+
+// a literal that is popped right away has no effect
+bool ControlFlow::removeDroppedLiterals() {
+    bool changed = false;
+    const auto targets = jumpTargets();
+    for (std::size_t index = 0; index < m_instructions.size(); ++index) {
+        if (m_instructions[index].removed || not pushesLiteral(m_instructions[index].opcode)) {
+            continue;
+        }
+        const auto pop = next(index);
+        if (pop < m_instructions.size() && m_instructions[pop].opcode == OpCode::Pop && not targets[pop]) {
+            m_instructions[index].removed = true;
+            m_instructions[pop].removed = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool ControlFlow::removeUnreachableBlocks() {
+    // a block starts at every jump target and behind every jump, it is only left at its end
+    const auto targets = jumpTargets();
+    std::vector<std::size_t> blockOf(m_instructions.size(), NONE);
+    std::vector<std::size_t> blockStarts;
+    for (std::size_t index = resolve(0); index < m_instructions.size(); index = next(index)) {
+        const auto last = blockStarts.empty() ? NONE : previous(index);
+        if (blockStarts.empty() || targets[index] || isJump(m_instructions[last].opcode) || m_instructions[last].opcode == OpCode::Return) {
+            blockStarts.push_back(index);
+        }
+        blockOf[index] = blockStarts.size() - 1;
+    }
+    if (blockStarts.empty()) {
+        return false;
+    }
+
+    std::vector<bool> reachable(blockStarts.size(), false);
+    std::vector<std::size_t> worklist { 0 };
+    reachable[0] = true;
+    const auto visit = [&](std::size_t instruction) {
+        if (instruction < m_instructions.size() && not reachable[blockOf[instruction]]) {
+            reachable[blockOf[instruction]] = true;
+            worklist.push_back(blockOf[instruction]);
+        }
+    };
+
+    while (not worklist.empty()) {
+        const auto block = worklist.back();
+        worklist.pop_back();
+
+        std::size_t last = blockStarts[block];
+        for (auto index = last; index < m_instructions.size() && blockOf[index] == block; index = next(index)) {
+            last = index;
+        }
+        const auto& instruction = m_instructions[last];
+        if (isJump(instruction.opcode)) {
+            visit(resolve(instruction.target));
+        }
+        if (instruction.opcode != OpCode::Return && not isUnconditionalJump(instruction.opcode)) {
+            visit(next(last));
+        }
+    }
+
+    // the Return at the end stays even behind an endless loop, a chunk always ends with it
+    const auto end = m_instructions.back().opcode == OpCode::Return ? m_instructions.size() - 1 : m_instructions.size();
+    bool changed = false;
+    for (std::size_t index = 0; index < end; ++index) {
+        if (not m_instructions[index].removed && not reachable[blockOf[index]]) {
+            m_instructions[index].removed = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+// forward jumps to the very next instruction
+bool ControlFlow::removeEmptyJumps() {
+    bool changed = false;
+    for (std::size_t index = 0; index < m_instructions.size(); ++index) {
+        auto& jump = m_instructions[index];
+        if (jump.removed || isLoop(index) || not (isUnconditionalJump(jump.opcode) || isConditionalJump(jump.opcode))) {
+            continue;
+        }
+        if (resolve(jump.target) == next(index)) {
+            jump.removed = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+void ControlFlow::emit(Chunk& chunk) const {
+    const auto& code = m_chunk.code;
+
+    // the new offset of every old one, removed code maps to the next instruction that is kept
+    std::vector<std::size_t> newOffsets(code.size() + 1, 0);
+    std::size_t size = 0;
+    for (const auto& instruction : m_instructions) {
+        if (not instruction.removed) {
+            size += instructionSize(instruction.opcode);
+        }
+    }
+    newOffsets[code.size()] = size;
+    for (std::size_t index = m_instructions.size(); index-- > 0;) {
+        const auto& instruction = m_instructions[index];
+        const auto start = instruction.offset;
+        const auto end = start + instructionSize(instruction.opcode);
+        if (not instruction.removed) {
+            size -= end - start;
+        }
+        for (auto offset = start; offset < end; ++offset) {
+            newOffsets[offset] = size;
+        }
+    }
+
+    std::vector<std::uint8_t> rewritten;
+    LineTable lines;
+    rewritten.reserve(code.size());
+
+    for (std::size_t index = 0; index < m_instructions.size(); ++index) {
+        const auto& instruction = m_instructions[index];
+        if (instruction.removed) {
+            continue;
+        }
+        const auto width = instructionSize(instruction.opcode);
+        lines.add(rewritten.size(), m_chunk.lines.getLine(instruction.offset));
+
+        if (not (isUnconditionalJump(instruction.opcode) || isConditionalJump(instruction.opcode))) {
+            for (std::size_t i = 0; i < width; ++i) {
+                rewritten.push_back(code[instruction.offset + i]);
+            }
+            continue;
+        }
+
+        // a threaded unconditional jump can change its direction, its width stays the same
+        const auto from = rewritten.size() + width;
+        const auto target = newOffsets[instruction.target];
+        auto opcode = instruction.opcode;
+        if (isUnconditionalJump(opcode)) {
+            opcode = target < from ? (isLong(index) ? OpCode::LoopLong : OpCode::Loop) : (isLong(index) ? OpCode::JumpLong : OpCode::Jump);
+        }
+        const auto distance = target < from ? from - target : target - from;
+
+        rewritten.push_back(static_cast<std::uint8_t>(opcode));
+        if (isLong(index)) {
+            rewritten.push_back(static_cast<std::uint8_t>((distance >> 16) & 0xff));
+        }
+        rewritten.push_back(static_cast<std::uint8_t>((distance >> 8) & 0xff));
+        rewritten.push_back(static_cast<std::uint8_t>(distance & 0xff));
+    }
+
+    chunk.code = std::move(rewritten);
+    chunk.lines = std::move(lines);
+}
+
+} // namespace
+
+void cleanupControlFlow(Chunk& chunk) {
+    ControlFlow flow(chunk);
+    flow.simplify();
+    flow.emit(chunk);
+}
+
+void fuseSuperinstructions(Chunk& chunk) {
+    const auto& code = chunk.code;
+    const auto [targets, jumpCount] = collectJumpTargets(chunk);
+
+    std::vector<std::uint8_t> fused;
+    LineTable lines;
+    fused.reserve(code.size());
+
+    std::vector<std::size_t> newOffsets(code.size() + 1, 0);
+    std::vector<PendingJump> jumps;
+    jumps.reserve(jumpCount);
+
+    // checks that the pattern starts at `offset` and that no jump lands behind its first instruction
+    const auto matches = [&](std::size_t offset, std::initializer_list<OpCode> pattern) {
+        std::size_t current = offset;
+        for (const auto opcode : pattern) {
+            if (current >= code.size() || static_cast<OpCode>(code[current]) != opcode) {
+                return false;
+            }
+            if (current != offset && targets[current]) {
+                return false;
+            }
+            current += instructionSize(opcode);
+        }
+        return true;
+    };
+
+    std::size_t line = 0;
+    const auto emit = [&](auto byte) {
+        lines.add(fused.size(), line);
+        fused.push_back(static_cast<std::uint8_t>(byte));
+    };
+
+    // fused code is never longer, so every jump keeps the width of its offset
+    const auto emitJump = [&](OpCode opcode, std::size_t oldJump) {
+        jumps.push_back(PendingJump { .offset { fused.size() }, .oldTarget { chunk.jumpTarget(oldJump) } });
+        emit(opcode);
+        for (std::size_t i = 1; i < instructionSize(opcode); ++i) {
+            emit(0xff);
+        }
+    };
+
+    for (std::size_t offset = 0; offset < code.size();) {
+        newOffsets[offset] = fused.size();
+        line = chunk.lines.getLine(offset);
+
+        if (matches(offset, { OpCode::GetLocal, OpCode::GetLocal, OpCode::Add })) {
+            emit(OpCode::AddLocals);
+            emit(code[offset + 1]);
+            emit(code[offset + 3]);
+            offset += 5;
+        } else if (matches(offset, { OpCode::Constant, OpCode::Add })) {
+            emit(OpCode::AddConstant);
+            emit(code[offset + 1]);
+            offset += 3;
+        } else if (matches(offset, { OpCode::Less, OpCode::JumpIfFalse, OpCode::Pop })) {
+            emitJump(OpCode::JumpIfNotLess, offset + 1);
+            offset += 5;
+        } else if (matches(offset, { OpCode::Greater, OpCode::JumpIfFalse, OpCode::Pop })) {
+            emitJump(OpCode::JumpIfNotGreater, offset + 1);
+            offset += 5;
+        } else if (matches(offset, { OpCode::Equal, OpCode::Not })) {
+            emit(OpCode::NotEqual);
+            offset += 2;
+        } else if (matches(offset, { OpCode::Less, OpCode::Not })) {
+            emit(OpCode::NotLess);
+            offset += 2;
+        } else if (matches(offset, { OpCode::Greater, OpCode::Not })) {
+            emit(OpCode::NotGreater);
+            offset += 2;
+        } else {
+            const auto opcode = static_cast<OpCode>(code[offset]);
+            const auto size = instructionSize(opcode);
+            if (isJump(opcode)) {
+                emitJump(opcode, offset);
+            } else {
+                for (std::size_t i = 0; i < size; ++i) {
+                    emit(code[offset + i]);
+                }
+            }
+            offset += size;
+        }
+    }
+    newOffsets[code.size()] = fused.size();
+
+    for (const auto& jump : jumps) {
+        const auto opcode = static_cast<OpCode>(fused[jump.offset]);
+        const auto next = jump.offset + instructionSize(opcode);
+        const auto target = newOffsets[jump.oldTarget];
+        const auto distance = opcode == OpCode::Loop || opcode == OpCode::LoopLong ? next - target : target - next;
+        if (isLongJump(opcode)) {
+            fused[jump.offset + 1] = static_cast<std::uint8_t>((distance >> 16) & 0xff);
+            fused[jump.offset + 2] = static_cast<std::uint8_t>((distance >> 8) & 0xff);
+            fused[jump.offset + 3] = static_cast<std::uint8_t>(distance & 0xff);
+        } else {
+            fused[jump.offset + 1] = static_cast<std::uint8_t>((distance >> 8) & 0xff);
+            fused[jump.offset + 2] = static_cast<std::uint8_t>(distance & 0xff);
+        }
+    }
+
+    chunk.code = std::move(fused);
+    chunk.lines = std::move(lines);
+}
@@ -0,0 +1,39 @@
+#include "program.h"
+#include "bytecode_file.h"
+#include "compiler.h"
+
+std::shared_ptr<const Program> Program::compile(std::string_view source, std::string& diagnostics,
+                                                 Backend backend, OptimizationLevel optimization, Lexing lexing) {
+    // every compile has its own heap and globals, so any number of them can run at once
+    std::shared_ptr<Program> program(new Program());
+    Globals globals;
+
+    auto& chunk = program->m_chunk;
+    Compiler compiler(chunk, program->m_heap, globals, backend, optimization);
+    compiler.reportTo(diagnostics);
+    // compiles run on worker threads and diagnostics only hold errors, so the listing of a
+    // DEBUG_PRINT_CODE build is dropped
+    std::string listing;
+    compiler.printTo(listing);
+    // a source too large for the 32 bit offsets of a TokenBuffer is scanned while parsing
+    const auto compiled = lexing == Lexing::Ahead && TokenBuffer::fits(source) ? compiler.compile(TokenBuffer(source)) : compiler.compile(source);
+    if (not compiled) {
+        return nullptr;
+    }
+    // checked once here instead of every time a VM runs it
+    if (const auto reason = verifyBytecode(chunk, globals.size())) {
+        diagnostics += fmt::format("The compiled program is not valid: {}\n", *reason);
+        return nullptr;
+    }
+
+    for (std::size_t slot = 0; slot < globals.size(); ++slot) {
+        chunk.globalNames.push_back(globals.name(slot));
+        chunk.globalNames.back()->permanent = true;
+    }
+    for (const auto& constant : chunk.constants) {
+        if (holds_string(constant)) {
+            get_objtype_unchecked<Obj>(constant)->permanent = true;
+        }
+    }
+    return program;
+}
@@ -0,0 +1,40 @@
+#include "scan_kernels_impl.h"
+
+namespace {
+
+constexpr ScanKernels SCALAR_SCAN_KERNELS {
+    .skipBlanks { scalar::skipBlanks },
+    .skipComment { scalar::skipComment },
+    .skipIdentifier { scalar::skipIdentifier },
+    .skipDigits { scalar::skipDigits },
+    .skipString { scalar::skipString },
+    .name { "scalar" },
+};
+
+} // namespace
+
+#if defined(__x86_64__)
+extern const ScanKernels SSE2_SCAN_KERNELS;
+#if defined(SCANNER_AVX2)
+extern const ScanKernels AVX2_SCAN_KERNELS;
+#endif
+#endif
+
+std::vector<const ScanKernels *> supportedScanKernels() {
+    std::vector<const ScanKernels *> kernels { &SCALAR_SCAN_KERNELS };
+#if defined(__x86_64__)
+    kernels.push_back(&SSE2_SCAN_KERNELS);
+#if defined(SCANNER_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(&AVX2_SCAN_KERNELS);
+    }
+#endif
+#endif
+    return kernels;
+}
+
+const ScanKernels& scanKernels() {
+    static const ScanKernels& best = *supportedScanKernels().back();
+    return best;
+}
@@ -0,0 +1,29 @@
+#include "scan_kernels_impl.h"
+
+// compiled with -mavx2, only called after scanKernels() checked that the CPU supports it
+#if defined(__x86_64__) && defined(__AVX2__)
+#include <immintrin.h>
+
+namespace {
+
+struct Avx2 {
+    using Vec = __m256i;
+    static constexpr std::size_t WIDTH { 32 };
+    static constexpr std::uint32_t FULL { 0xffffffff };
+
+    [[nodiscard]] static Vec load(const char *p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)); }
+    [[nodiscard]] static Vec splat(char c) { return _mm256_set1_epi8(c); }
+    [[nodiscard]] static Vec eq(Vec a, Vec b) { return _mm256_cmpeq_epi8(a, b); }
+    [[nodiscard]] static Vec either(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+    [[nodiscard]] static Vec inRange(Vec x, char lo, char hi) {
+        const auto distance = _mm256_sub_epi8(x, splat(lo));
+        return eq(_mm256_min_epu8(distance, splat(static_cast<char>(hi - lo))), distance);
+    }
+    [[nodiscard]] static std::uint32_t mask(Vec v) { return static_cast<std::uint32_t>(_mm256_movemask_epi8(v)); }
+};
+
+} // namespace
+
+extern const ScanKernels AVX2_SCAN_KERNELS = SimdKernels<Avx2>::kernels("avx2");
+
+#endif
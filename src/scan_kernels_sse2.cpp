@@ -0,0 +1,30 @@
+#include "scan_kernels_impl.h"
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+
+namespace {
+
+// SSE2 is part of every x86-64 CPU, so this needs no runtime check
+struct Sse2 {
+    using Vec = __m128i;
+    static constexpr std::size_t WIDTH { 16 };
+    static constexpr std::uint32_t FULL { 0xffff };
+
+    [[nodiscard]] static Vec load(const char *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)); }
+    [[nodiscard]] static Vec splat(char c) { return _mm_set1_epi8(c); }
+    [[nodiscard]] static Vec eq(Vec a, Vec b) { return _mm_cmpeq_epi8(a, b); }
+    [[nodiscard]] static Vec either(Vec a, Vec b) { return _mm_or_si128(a, b); }
+    // the unsigned distance to `lo` is at most hi - lo, min_epu8 is the unsigned comparison
+    [[nodiscard]] static Vec inRange(Vec x, char lo, char hi) {
+        const auto distance = _mm_sub_epi8(x, splat(lo));
+        return eq(_mm_min_epu8(distance, splat(static_cast<char>(hi - lo))), distance);
+    }
+    [[nodiscard]] static std::uint32_t mask(Vec v) { return static_cast<std::uint32_t>(_mm_movemask_epi8(v)); }
+};
+
+} // namespace
+
+extern const ScanKernels SSE2_SCAN_KERNELS = SimdKernels<Sse2>::kernels("sse2");
+
+#endif
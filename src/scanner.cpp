@@ -1,10 +1,13 @@
 #include "scanner.h"
 #include <cassert>
-#include <cctype>
+#include <cstring>
 
-Scanner::Scanner(const char *source) {
-    m_start = source;
-    m_current = source;
+Scanner::Scanner(const char *source) : Scanner(std::string_view(source)) {}
+
+Scanner::Scanner(std::string_view source) {
+    m_start = source.data();
+    m_current = source.data();
+    m_end = source.data() + source.size();
     m_line = 1;
 }
 
@@ -18,7 +21,7 @@ Token Scanner::scanToken() {
 
     char c = advance();
 
-    if (std::isdigit(c)) {
+    if (isDigit(c)) {
         return number();
     }
 
@@ -49,9 +52,7 @@ Token Scanner::scanToken() {
 }
 
 Token Scanner::identifier() {
-    while (isAlpha(peek()) || std::isdigit(peek())) {
-        std::ignore = advance();
-    }
+    m_current = m_kernels->skipIdentifier(m_current, m_end);
 
     return makeToken(identifierType());
 }
@@ -95,36 +96,27 @@ TokenType Scanner::identifierType() {
 }
 
 TokenType Scanner::checkKeyword(std::size_t start, std::size_t length, const char *rest, TokenType type) {
+    // the size has to be checked first, a shorter identifier can end right before the end of the source
     const bool sizeMatch = m_current - m_start == static_cast<long>(start + length);
-    const bool contentMatch = std::memcmp(m_start + start, rest, length) == 0;
-    if (sizeMatch && contentMatch) {
+    if (sizeMatch && std::memcmp(m_start + start, rest, length) == 0) {
         return type;
     }
     return TokenType::Identifier;
 }
 
 Token Scanner::number() {
-    while (std::isdigit(peek())) {
-        std::ignore = advance();
-    }
+    m_current = m_kernels->skipDigits(m_current, m_end);
 
-    if (peek() == '.' && std::isdigit(peekNext())) {
+    if (peek() == '.' && isDigit(peekNext())) {
         std::ignore = advance();
-        while (std::isdigit(peek())) {
-            std::ignore = advance();
-        }
+        m_current = m_kernels->skipDigits(m_current, m_end);
     }
 
     return makeToken(TokenType::Number);
 }
 
 Token Scanner::string() {
-    while (peek() != '"' && not isAtEnd()) {
-        if (peek() == '\n') {
-            m_line++;
-        }
-        std::ignore = advance();
-    }
+    m_current = m_kernels->skipString(m_current, m_end, m_line);
 
     if (isAtEnd()) {
         return errorToken("Unterminated string.");
@@ -134,20 +126,28 @@ Token Scanner::string() {
     return makeToken(TokenType::String);
 }
 
+// ASCII only, std::isalpha depends on the locale and is undefined for negative chars
 bool Scanner::isAlpha(char c) {
-    return std::isalpha(c) || c == '_';
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+bool Scanner::isDigit(char c) {
+    return c >= '0' && c <= '9';
 }
 
 bool Scanner::isAtEnd() const {
-    return *m_current == '\0';
+    return m_current == m_end;
 }
 
 char Scanner::peek() const {
+    if (isAtEnd()) {
+        return '\0';
+    }
     return *m_current;
 }
 
 char Scanner::peekNext() const {
-    if (isAtEnd()) {
+    if (m_end - m_current < 2) {
         return '\0';
     }
     return m_current[1];
@@ -155,33 +155,12 @@ char Scanner::peekNext() const {
 
 void Scanner::skipWhitespace() {
     while (true) {
-        char c = peek();
-
-        switch (c) {
-            case ' ': [[fallthrough]];
-            case '\r': [[fallthrough]];
-            case '\t': {
-                std::ignore = advance();
-                break;
-            }
-            case '\n': {
-                m_line++;
-                std::ignore = advance();
-                break;
-            }
-            case '/': {
-                if (peekNext() == '/') {
-                    while (peek() != '\n' && not isAtEnd()) {
-                        std::ignore = advance();
-                    }
-                } else {
-                    return;
-                }
-                break;
-            }
-            default:
-                return;
+        m_current = m_kernels->skipBlanks(m_current, m_end, m_line);
+
+        if (peek() != '/' || peekNext() != '/') {
+            return;
         }
+        m_current = m_kernels->skipComment(m_current, m_end);
     }
 }
 
@@ -0,0 +1,82 @@
+#include "source_file.h"
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <fmt/format.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr std::size_t READ_BLOCK { 64 * 1024 };
+
+void report(std::string *diagnostics, const std::string& message) {
+    if (diagnostics != nullptr) {
+        *diagnostics += message;
+    } else {
+        fmt::print(stderr, "{}", message);
+    }
+}
+
+// appends everything up to the end of the stream, `sizeHint` bytes are reserved up front
+bool readAll(int fd, std::string& buffer, std::size_t sizeHint) {
+    buffer.reserve(sizeHint + 1);
+    while (true) {
+        const auto size = buffer.size();
+        buffer.resize(size + READ_BLOCK);
+        const auto count = ::read(fd, buffer.data() + size, READ_BLOCK);
+        if (count < 0 && errno == EINTR) {
+            buffer.resize(size);
+            continue;
+        }
+        buffer.resize(size + static_cast<std::size_t>(std::max<ssize_t>(count, 0)));
+        if (count <= 0) {
+            return count == 0;
+        }
+    }
+}
+
+} // namespace
+
+std::optional<SourceFile> SourceFile::load(const std::filesystem::path& path, std::string *diagnostics) {
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    struct stat info {};
+    if (fd == -1 || ::fstat(fd, &info) == -1 || S_ISDIR(info.st_mode)) {
+        if (fd != -1) {
+            ::close(fd);
+        }
+        report(diagnostics, fmt::format("The file: {} does not exists or can not be opened\n", path.string()));
+        return std::nullopt;
+    }
+
+    SourceFile source;
+    const auto size = static_cast<std::size_t>(info.st_size);
+    if (S_ISREG(info.st_mode) && size > 0) {
+        source.m_mapping = MappedFile::openTerminated(fd, size);
+    }
+    // named pipes, /dev/stdin and files that cannot be mapped are read like a stream
+    const bool ok = source.m_mapping != nullptr || readAll(fd, source.m_buffer, S_ISREG(info.st_mode) ? size : 0);
+    ::close(fd);
+    if (not ok) {
+        report(diagnostics, fmt::format("The file: {} can not be read\n", path.string()));
+        return std::nullopt;
+    }
+    return source;
+}
+
+std::optional<SourceFile> SourceFile::read(int fd) {
+    SourceFile source;
+    if (not readAll(fd, source.m_buffer, 0)) {
+        fmt::print(stderr, "The input can not be read\n");
+        return std::nullopt;
+    }
+    return source;
+}
+
+std::string_view SourceFile::text() const {
+    if (m_mapping != nullptr) {
+        const auto bytes = m_mapping->bytes();
+        return { reinterpret_cast<const char *>(bytes.data()), bytes.size() };
+    }
+    return m_buffer;
+}
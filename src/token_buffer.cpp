@@ -0,0 +1,70 @@
+#include "token_buffer.h"
+#include <algorithm>
+#include <cassert>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include "scanner.h"
+
+double parseNumberLiteral(std::string_view text) {
+    double value = 0;
+    const auto result = std::from_chars(text.data(), text.data() + text.size(), value);
+    if (result.ec == std::errc::result_out_of_range) {
+        return std::numeric_limits<double>::infinity();
+    }
+    return value;
+}
+
+TokenBuffer::TokenBuffer(std::string_view source) : m_source(source.data()) {
+    assert(fits(source));
+
+    Scanner scanner(source);
+    while (true) {
+        const auto token = scanner.scanToken();
+        const auto index = static_cast<std::uint32_t>(m_types.size());
+        if (m_lines.empty() || m_lines.back().line != token.line) {
+            m_lines.push_back(LineRun { .firstToken { index }, .line { static_cast<std::uint32_t>(token.line) } });
+        }
+
+        m_types.push_back(token.type);
+        m_lengths.push_back(static_cast<std::uint32_t>(token.length));
+        if (token.type == TokenType::Error) {
+            m_offsets.push_back(static_cast<std::uint32_t>(m_errors.size()));
+            m_errors.push_back(token.start);
+        } else {
+            m_offsets.push_back(static_cast<std::uint32_t>(token.start - m_source));
+        }
+
+        if (token.type == TokenType::Number) {
+            m_numbers.push_back(parseNumberLiteral(std::string_view(token.start, token.length)));
+        } else if (token.type == TokenType::Eof) {
+            break;
+        }
+    }
+}
+
+TokenBuffer::Lexeme TokenBuffer::next(Cursor& cursor) const {
+    const auto index = std::min(cursor.token, m_types.size() - 1);
+    const auto type = m_types[index];
+    double number = 0;
+    if (type == TokenType::Number) {
+        number = m_numbers[cursor.numbers];
+    }
+    if (cursor.token < m_types.size()) {
+        cursor.token++;
+        cursor.numbers += type == TokenType::Number;
+    }
+    while (cursor.lineRun + 1 < m_lines.size() && m_lines[cursor.lineRun + 1].firstToken <= index) {
+        cursor.lineRun++;
+    }
+
+    return Lexeme {
+        .token {
+            .type { type },
+            .start { type == TokenType::Error ? m_errors[m_offsets[index]] : m_source + m_offsets[index] },
+            .length { m_lengths[index] },
+            .line { m_lines[cursor.lineRun].line },
+        },
+        .number { number },
+    };
+}
@@ -1,222 +1,762 @@
 #include "vm.h"
-#include <cassert>
+#include "prelude.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iterator>
+#include <new>
+#include <numeric>
+#include <type_traits>
+#include <sys/mman.h>
+
+namespace {
+
+// Anonymous pages are only committed when they are first touched, so a VM does not pay for
+// the part of the stack a script never uses. The compiler writes every slot before reading
+// it, the zero pages only keep a stray read of verified bytecode well defined: all bits
+// zero is `false` in the variant and 0.0 when NaN boxed.
+Value *mapStack(std::size_t size) {
+    void *stack = ::mmap(nullptr, size * sizeof(Value), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stack == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    return static_cast<Value *>(stack);
+}
+
+#ifndef NAN_BOXING
+static_assert(std::is_same_v<std::variant_alternative_t<0, Value>, Bool>, "A zero page has to read as a valid Value.");
+#endif
+
+} // namespace
 
+void StackDeleter::operator()(Value *stack) const {
+    ::munmap(stack, size * sizeof(Value));
+}
+
+VM::VM(std::size_t stackSize)
+    : m_stack(mapStack(stackSize), StackDeleter { stackSize }), m_stackTop(m_stack.get()), m_stackEnd(m_stack.get() + stackSize) {
+    auto prelude = loadBytecode(preludeBytecode(), "prelude", m_heap);
+    if (prelude == nullptr || execute(std::move(prelude)) != InterpretResult::Ok) {
+        fmt::print(stderr, "The embedded prelude can not be run\n");
+        std::abort();
+    }
+#ifdef DEBUG_TRACE_EXECUTION
+    m_trace = true;
+#endif
+}
 
-InterpretResult VM::interpret(const std::string_view source) {
+InterpretResult VM::interpret(const std::string_view source, Backend backend) {
     Chunk chunk;
 
-    Compiler compiler(chunk);
+    Compiler compiler(chunk, m_heap, globals, backend, m_optimization);
+    if (m_diagnostics != nullptr) {
+        compiler.reportTo(*m_diagnostics);
+    }
+    if (m_debugOutput != nullptr) {
+        compiler.printTo(*m_debugOutput);
+    }
 
     if (not compiler.compile(source)) {
         return InterpretResult::CompileError;
     }
 
-    m_chunk = std::make_unique<Chunk>(chunk);
-    m_ip = m_chunk->code.begin();
+    return execute(std::make_unique<Chunk>(std::move(chunk)));
+}
+
+InterpretResult VM::runBytecodeFile(const std::filesystem::path& path) {
+    auto chunk = loadBytecodeFile(path, m_heap, m_diagnostics);
+    if (chunk == nullptr) {
+        return InterpretResult::CompileError;
+    }
+    return execute(std::move(chunk));
+}
+
+InterpretResult VM::run(std::shared_ptr<const Program> program) {
+    if (std::find(m_programs.begin(), m_programs.end(), program) == m_programs.end()) {
+        m_programs.push_back(program);
+    }
+    // the chunk is shared with every other VM that runs the program
+    const auto& chunk = program->chunk();
+    return execute(std::shared_ptr<const Chunk>(std::move(program), &chunk));
+}
+
+bool VM::compileBytecodeFile(const std::string_view source, const std::filesystem::path& path, Backend backend) {
+    Chunk chunk;
+    Compiler compiler(chunk, m_heap, globals, backend, m_optimization);
+    if (not compiler.compile(source)) {
+        return false;
+    }
+    if (not writeBytecodeFile(path, chunk, globals)) {
+        fmt::print(stderr, "The file: {} can not be written\n", path.string());
+        return false;
+    }
+    return true;
+}
+
+InterpretResult VM::execute(std::shared_ptr<const Chunk> chunk) {
+    m_chunk = std::move(chunk);
+    m_globalSlots.clear();
+    if (m_chunk->globalNames.empty()) {
+        // compiled against these globals, the operands are the slots
+        m_globalSlots.resize(globals.size());
+        std::iota(m_globalSlots.begin(), m_globalSlots.end(), std::size_t { 0 });
+    }
+    for (auto *name : m_chunk->globalNames) {
+        // the names of a Program are interned in its own heap, globals are looked up by pointer
+        m_globalSlots.push_back(globals.resolve(name->permanent ? m_heap.copyString(name->chars) : name));
+    }
+    m_ip = m_chunk->bytecode().data();
+    resetStack();
+    if (m_chunk->backend == Backend::Register) {
+        return runRegisters();
+    }
     return run();
 }
 
+#ifdef DEBUG_TRACE_EXECUTION
+#define TRACE_EXECUTION() do { m_ip = ip; traceExecution(); } while (false)
+#else
+#define TRACE_EXECUTION() do {} while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+// Every handler jumps straight to the handler of the next instruction.
+#define DISPATCH() do { TRACE_EXECUTION(); goto *dispatchTable[*ip++]; } while (false)
+#define CASE(name) op_##name
+#else
+#define DISPATCH() break
+#define CASE(name) case Op::name
+#endif
+
 InterpretResult VM::run() {
-    const auto readByte = [this]() -> OpCode { return static_cast<OpCode>(*m_ip++); };
-    const auto readConstant = [this, readByte]() -> Value { return m_chunk->constants[static_cast<std::size_t>(readByte())]; };
-    const auto readShort = [this]() -> std::uint16_t { 
-        m_ip += 2; 
-        return static_cast<std::uint16_t>((m_ip[-2] << 8) | m_ip[-1]);
+    // keeping the instruction pointer in a local lets the compiler hold it in a register,
+    // it is written back to m_ip whenever something outside of run() needs it.
+    const std::uint8_t *ip = m_ip;
+    const auto readByte = [&ip]() -> std::uint8_t { return *ip++; };
+    const auto readConstant = [this, readByte]() -> const Value& { return m_chunk->constants[readByte()]; };
+    const auto readShort = [&ip]() -> std::uint16_t { 
+        ip += 2; 
+        return static_cast<std::uint16_t>((ip[-2] << 8) | ip[-1]);
+    };
+    const auto readLong = [&ip]() -> std::size_t {
+        ip += 3;
+        return static_cast<std::size_t>((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]);
     };
+
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    // Has to be in the same order as the OpCode enum.
+    static void *const dispatchTable[] = {
+        &&op_Constant,
+        &&op_Nil,
+        &&op_True,
+        &&op_False,
+        &&op_Pop,
+        &&op_GetLocal,
+        &&op_SetLocal,
+        &&op_GetGlobalSlot,
+        &&op_DefineGlobalSlot,
+        &&op_SetGlobalSlot,
+        &&op_Equal,
+        &&op_Greater,
+        &&op_Less,
+        &&op_Add,
+        &&op_Subtract,
+        &&op_Multiply,
+        &&op_Divide,
+        &&op_Not,
+        &&op_Negate,
+        &&op_Jump,
+        &&op_JumpIfFalse,
+        &&op_Print,
+        &&op_Loop,
+        &&op_ConstantLong,
+        &&op_GetLocalWide,
+        &&op_SetLocalWide,
+        &&op_JumpLong,
+        &&op_JumpIfFalseLong,
+        &&op_LoopLong,
+        &&op_AddLocals,
+        &&op_AddConstant,
+        &&op_NotEqual,
+        &&op_NotLess,
+        &&op_NotGreater,
+        &&op_JumpIfNotLess,
+        &&op_JumpIfNotGreater,
+        &&op_Return,
+    };
+    static_assert(std::size(dispatchTable) == static_cast<std::size_t>(OpCode::Return) + 1, "Every OpCode needs a handler.");
+
+    DISPATCH();
+#else
+    using Op = OpCode;
     while (true) {
-#ifdef DEBUG_TRACE_EXECUTION
-        const auto distance = std::distance(m_chunk->code.cbegin(), m_ip);
-        fmt::print("          ");
-        for (auto dump = m_stack; not dump.empty(); dump.pop_back()) {
-            fmt::print("[ {} ]", std::visit(PrintVisitor{}, dump.back()));
-        }
-        fmt::print("\n");
-        std::ignore = m_chunk->disassembleInstruction(static_cast<std::size_t>(distance));
+        TRACE_EXECUTION();
+        switch (static_cast<Op>(readByte())) {
 #endif
-        OpCode instruction;
-        switch (instruction = readByte()) {
-            case OpCode::Constant: {
-                auto constant = readConstant();
-                m_stack.push_back(constant);
-                break;
-            }
-            case OpCode::Nil: { m_stack.emplace_back(Nil{}); break; };
-            case OpCode::True: { m_stack.emplace_back(true); break; };
-            case OpCode::False: { m_stack.emplace_back(false); break; };
-            case OpCode::Pop: { std::ignore = pop(); break; };
-            case OpCode::GetLocal: {
+            CASE(Constant): {
+                PUSH(readConstant());
+                DISPATCH();
+            }
+            CASE(Nil): { PUSH(Nil{}); DISPATCH(); };
+            CASE(True): { PUSH(true); DISPATCH(); };
+            CASE(False): { PUSH(false); DISPATCH(); };
+            CASE(Pop): { m_stackTop--; DISPATCH(); };
+            CASE(GetLocal): {
                 auto slot = readByte();
-                m_stack.push_back(m_stack[static_cast<std::size_t>(slot)]);
-                break;
+                PUSH(m_stack[slot]);
+                DISPATCH();
             };
-            case OpCode::SetLocal: {
+            CASE(SetLocal): {
                 auto slot = readByte();
-                m_stack[static_cast<std::size_t>(slot)] = peek();
-                break;
+                m_heap.writeBarrier(peek());
+                m_stack[slot] = peek();
+                DISPATCH();
             };
-            case OpCode::GetGlobal: {
-                const auto name = get_objtype_unchecked<std::string>(readConstant());
-                Value value;
-                try {
-                    value = globals.at(name);
-                } catch (const std::exception&) {
-                    runtimeError(fmt::format("Undefined variable '{}'", name));
+            CASE(GetGlobalSlot): {
+                const auto slot = m_globalSlots[readShort()];
+                const auto& value = globals.values[slot];
+                if (is_undefined(value)) {
+                    m_ip = ip;
+                    runtimeError(fmt::format("Undefined variable '{}'", globals.name(slot)->chars));
                     return InterpretResult::RuntimeError;
                 }
-                m_stack.push_back(value);
-                break;
+                PUSH(value);
+                DISPATCH();
             };
-            case OpCode::DefineGlobal: {
-                const auto name = get_objtype_unchecked<std::string>(readConstant());
-                globals[name] = peek();
-                std::ignore = pop();
-                break;
+            CASE(DefineGlobalSlot): {
+                const auto slot = m_globalSlots[readShort()];
+                m_heap.writeBarrier(peek());
+                globals.values[slot] = pop();
+                DISPATCH();
             };
-            case OpCode::SetGlobal: {
-                const auto name = get_objtype_unchecked<std::string>(readConstant());
-                try {
-                    // check if this key already exists
-                    globals.at(name);
-                    globals[name] = peek();
-                } catch (const std::exception&) {
-                    runtimeError(fmt::format("Undefined variable '{}'", name));
+            CASE(SetGlobalSlot): {
+                const auto slot = m_globalSlots[readShort()];
+                auto& value = globals.values[slot];
+                if (is_undefined(value)) {
+                    m_ip = ip;
+                    runtimeError(fmt::format("Undefined variable '{}'", globals.name(slot)->chars));
                     return InterpretResult::RuntimeError;
                 }
-                break;
-                
+                m_heap.writeBarrier(peek());
+                value = peek();
+                DISPATCH();
             }
-            case OpCode::Equal: {
-                const auto b = pop();
-                const auto a = pop();
-                m_stack.emplace_back(valuesEqual(a, b));
-                break;
+            CASE(Equal): {
+                peek(1) = valuesEqual(peek(1), peek(0));
+                m_stackTop--;
+                DISPATCH();
             };
-            case OpCode::Greater: { BINARY_OP(>); break; };
-            case OpCode::Less: { BINARY_OP(<); break; };
-            case OpCode::Add: { 
-                if (holds_obj_type<std::string>(peek()) && holds_obj_type<std::string>(peek(1))) {
+            CASE(Greater): { BINARY_OP(>); DISPATCH(); };
+            CASE(Less): { BINARY_OP(<); DISPATCH(); };
+            CASE(Add): { 
+                if (holds_string(peek()) && holds_string(peek(1))) {
                     concatenate();
                 } else {
                     BINARY_OP(+); 
                 }
-                break; 
+                DISPATCH(); 
             };
-            case OpCode::Subtract: { BINARY_OP(-); break; }
-            case OpCode::Multiply: { BINARY_OP(*); break; }
-            case OpCode::Divide: { BINARY_OP(/); break; }
-            case OpCode::Not: {
-                const auto value = m_stack.back();
-                m_stack.pop_back();
-                const bool truthyness = isFalsey(value);
-                m_stack.emplace_back(truthyness);
-                break;
+            CASE(Subtract): { BINARY_OP(-); DISPATCH(); }
+            CASE(Multiply): { BINARY_OP(*); DISPATCH(); }
+            CASE(Divide): { BINARY_OP(/); DISPATCH(); }
+            CASE(Not): {
+                auto& value = peek();
+                value = isFalsey(value);
+                DISPATCH();
             };
-            case OpCode::Negate: {
-                const auto last = m_stack.back();
-                if (not std::holds_alternative<Number>(last)) {
-                    fmt::print(stderr, "Operand must be a number.");
+            CASE(Negate): {
+                auto& value = peek();
+                if (not holds_type<Number>(value)) {
+                    m_ip = ip;
+                    runtimeError("Operand must be a number.");
                     return InterpretResult::RuntimeError;
                 }
-                const auto value = std::get<Number>(last);
-                m_stack.pop_back();
-                m_stack.emplace_back(-value);
-                break;
+                value = -get_type_unchecked<Number>(value);
+                DISPATCH();
             };
-            case OpCode::Jump: {
+            CASE(Jump): {
                 std::uint16_t offset = readShort();
-                m_ip += offset;
-                break;
+                ip += offset;
+                DISPATCH();
             };
-            case OpCode::JumpIfFalse: {
+            CASE(JumpIfFalse): {
                 std::uint16_t offset = readShort();
 
-                if (isFalsey(peek(0))) {
-                    m_ip += offset;
+                if (isFalsey(peek())) {
+                    ip += offset;
                 }
-                break;
+                DISPATCH();
             };
-            case OpCode::Print: {
-                fmt::print("{}\n", std::visit(PrintVisitor{}, pop()));
-                break;
+            CASE(Print): {
+                print(pop());
+                DISPATCH();
             };
-            case OpCode::Loop: {
+            CASE(Loop): {
                 std::uint16_t offset = readShort();
-                m_ip -= offset;
-                break;
+                ip -= offset;
+                DISPATCH();
+            }
+            CASE(ConstantLong): {
+                PUSH(m_chunk->constants[readLong()]);
+                DISPATCH();
+            }
+            CASE(GetLocalWide): {
+                const auto slot = readShort();
+                PUSH(m_stack[slot]);
+                DISPATCH();
+            }
+            CASE(SetLocalWide): {
+                const auto slot = readShort();
+                m_heap.writeBarrier(peek());
+                m_stack[slot] = peek();
+                DISPATCH();
+            }
+            CASE(JumpLong): {
+                ip += readLong();
+                DISPATCH();
+            }
+            CASE(JumpIfFalseLong): {
+                const auto offset = readLong();
+                if (isFalsey(peek())) {
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+            CASE(LoopLong): {
+                ip -= readLong();
+                DISPATCH();
+            }
+            CASE(AddLocals): {
+                const auto& a = m_stack[readByte()];
+                const auto& b = m_stack[readByte()];
+                if (holds_type<Number>(a) && holds_type<Number>(b)) {
+                    PUSH(get_type_unchecked<Number>(a) + get_type_unchecked<Number>(b));
+                } else if (holds_string(a) && holds_string(b)) {
+                    PUSH(concatenate(a, b));
+                } else {
+                    m_ip = ip;
+                    runtimeError("Operands must be numbers.");
+                    return InterpretResult::RuntimeError;
+                }
+                DISPATCH();
+            }
+            CASE(AddConstant): {
+                const auto& b = readConstant();
+                auto& a = peek();
+                if (holds_type<Number>(a) && holds_type<Number>(b)) {
+                    a = get_type_unchecked<Number>(a) + get_type_unchecked<Number>(b);
+                } else if (holds_string(a) && holds_string(b)) {
+                    a = concatenate(a, b);
+                } else {
+                    m_ip = ip;
+                    runtimeError("Operands must be numbers.");
+                    return InterpretResult::RuntimeError;
+                }
+                DISPATCH();
+            }
+            CASE(NotEqual): {
+                peek(1) = not valuesEqual(peek(1), peek(0));
+                m_stackTop--;
+                DISPATCH();
+            }
+            // implemented as not (a < b) instead of a >= b, so NaN compares exactly like `Less; Not`
+            CASE(NotLess): { BINARY_OP_RESULT(not (a_value < b_value)); DISPATCH(); }
+            CASE(NotGreater): { BINARY_OP_RESULT(not (a_value > b_value)); DISPATCH(); }
+            CASE(JumpIfNotLess): {
+                const auto offset = readShort();
+                BINARY_OP(<);
+                if (isFalsey(peek())) {
+                    ip += offset;
+                } else {
+                    m_stackTop--;
+                }
+                DISPATCH();
+            }
+            CASE(JumpIfNotGreater): {
+                const auto offset = readShort();
+                BINARY_OP(>);
+                if (isFalsey(peek())) {
+                    ip += offset;
+                } else {
+                    m_stackTop--;
+                }
+                DISPATCH();
             }
-            case OpCode::Return: {
+            CASE(Return): {
                 return InterpretResult::Ok;
             }
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#else
         }
     }
+#endif
 }
 
-void VM::runtimeError(const std::string& msg) {
-    fmt::print(stderr, "{}", msg);
+InterpretResult VM::runRegisters() {
+    // the registers live at the bottom of the stack, locals first and temporaries above them
+    Value *const registers = m_stack.get();
+    if (m_chunk->registerCount > static_cast<std::size_t>(m_stackEnd - registers)) {
+        runtimeError("Stack overflow.");
+        return InterpretResult::RuntimeError;
+    }
+    m_stackTop = std::fill_n(registers, m_chunk->registerCount, Value { Nil{} });
+
+    const std::uint8_t *ip = m_ip;
+    const auto readByte = [&ip]() -> std::uint8_t { return *ip++; };
+    const auto readConstant = [this, readByte]() -> const Value& { return m_chunk->constants[readByte()]; };
+    const auto readShort = [&ip]() -> std::uint16_t { 
+        ip += 2; 
+        return static_cast<std::uint16_t>((ip[-2] << 8) | ip[-1]);
+    };
+    const auto readLong = [&ip]() -> std::size_t {
+        ip += 3;
+        return static_cast<std::size_t>((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]);
+    };
 
-    long instruction = std::distance(this->m_chunk->code.cbegin(), this->m_ip) - 1;
-    std::size_t line = this->m_chunk->lines[static_cast<std::size_t>(instruction)];
-    fmt::print(stderr, "[line {}] in script\n", line);
-    resetStack();
-}
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+    // Has to be in the same order as the RegOpCode enum.
+    static void *const dispatchTable[] = {
+        &&op_LoadConstant,
+        &&op_LoadConstantLong,
+        &&op_LoadNil,
+        &&op_LoadTrue,
+        &&op_LoadFalse,
+        &&op_Move,
+        &&op_GetGlobal,
+        &&op_DefineGlobal,
+        &&op_SetGlobal,
+        &&op_Equal,
+        &&op_NotEqual,
+        &&op_Greater,
+        &&op_NotGreater,
+        &&op_Less,
+        &&op_NotLess,
+        &&op_Add,
+        &&op_Subtract,
+        &&op_Multiply,
+        &&op_Divide,
+        &&op_Not,
+        &&op_Negate,
+        &&op_Jump,
+        &&op_JumpIfFalse,
+        &&op_JumpIfTrue,
+        &&op_Loop,
+        &&op_JumpLong,
+        &&op_JumpIfFalseLong,
+        &&op_JumpIfTrueLong,
+        &&op_LoopLong,
+        &&op_Print,
+        &&op_Return,
+    };
+    static_assert(std::size(dispatchTable) == static_cast<std::size_t>(RegOpCode::Return) + 1, "Every RegOpCode needs a handler.");
 
-void VM::resetStack() {
-    m_stack = {};
+    DISPATCH();
+#else
+    using Op = RegOpCode;
+    while (true) {
+        TRACE_EXECUTION();
+        switch (static_cast<Op>(readByte())) {
+#endif
+            CASE(LoadConstant): {
+                const auto dst = readByte();
+                registers[dst] = readConstant();
+                DISPATCH();
+            }
+            CASE(LoadConstantLong): {
+                const auto dst = readByte();
+                registers[dst] = m_chunk->constants[readLong()];
+                DISPATCH();
+            }
+            CASE(LoadNil): { registers[readByte()] = Nil{}; DISPATCH(); }
+            CASE(LoadTrue): { registers[readByte()] = true; DISPATCH(); }
+            CASE(LoadFalse): { registers[readByte()] = false; DISPATCH(); }
+            CASE(Move): {
+                const auto dst = readByte();
+                const auto& value = registers[readByte()];
+                m_heap.writeBarrier(value);
+                registers[dst] = value;
+                DISPATCH();
+            }
+            CASE(GetGlobal): {
+                const auto dst = readByte();
+                const auto slot = m_globalSlots[readShort()];
+                const auto& value = globals.values[slot];
+                if (is_undefined(value)) {
+                    m_ip = ip;
+                    runtimeError(fmt::format("Undefined variable '{}'", globals.name(slot)->chars));
+                    return InterpretResult::RuntimeError;
+                }
+                registers[dst] = value;
+                DISPATCH();
+            }
+            CASE(DefineGlobal): {
+                const auto slot = m_globalSlots[readShort()];
+                const auto& value = registers[readByte()];
+                m_heap.writeBarrier(value);
+                globals.values[slot] = value;
+                DISPATCH();
+            }
+            CASE(SetGlobal): {
+                const auto slot = m_globalSlots[readShort()];
+                auto& value = globals.values[slot];
+                if (is_undefined(value)) {
+                    m_ip = ip;
+                    runtimeError(fmt::format("Undefined variable '{}'", globals.name(slot)->chars));
+                    return InterpretResult::RuntimeError;
+                }
+                const auto& stored = registers[readByte()];
+                m_heap.writeBarrier(stored);
+                value = stored;
+                DISPATCH();
+            }
+            CASE(Equal): {
+                const auto dst = readByte();
+                const auto& a = registers[readByte()];
+                const auto& b = registers[readByte()];
+                registers[dst] = valuesEqual(a, b);
+                DISPATCH();
+            }
+            CASE(NotEqual): {
+                const auto dst = readByte();
+                const auto& a = registers[readByte()];
+                const auto& b = registers[readByte()];
+                registers[dst] = not valuesEqual(a, b);
+                DISPATCH();
+            }
+            // same NaN semantics as the fused stack instructions
+            CASE(Greater): { REGISTER_BINARY_OP(a_value > b_value); DISPATCH(); }
+            CASE(NotGreater): { REGISTER_BINARY_OP(not (a_value > b_value)); DISPATCH(); }
+            CASE(Less): { REGISTER_BINARY_OP(a_value < b_value); DISPATCH(); }
+            CASE(NotLess): { REGISTER_BINARY_OP(not (a_value < b_value)); DISPATCH(); }
+            CASE(Add): {
+                const auto dst = readByte();
+                const auto& a = registers[readByte()];
+                const auto& b = registers[readByte()];
+                if (holds_type<Number>(a) && holds_type<Number>(b)) {
+                    registers[dst] = get_type_unchecked<Number>(a) + get_type_unchecked<Number>(b);
+                } else if (holds_string(a) && holds_string(b)) {
+                    registers[dst] = concatenate(a, b);
+                } else {
+                    m_ip = ip;
+                    runtimeError("Operands must be numbers.");
+                    return InterpretResult::RuntimeError;
+                }
+                DISPATCH();
+            }
+            CASE(Subtract): { REGISTER_BINARY_OP(a_value - b_value); DISPATCH(); }
+            CASE(Multiply): { REGISTER_BINARY_OP(a_value * b_value); DISPATCH(); }
+            CASE(Divide): { REGISTER_BINARY_OP(a_value / b_value); DISPATCH(); }
+            CASE(Not): {
+                const auto dst = readByte();
+                registers[dst] = isFalsey(registers[readByte()]);
+                DISPATCH();
+            }
+            CASE(Negate): {
+                const auto dst = readByte();
+                const auto& value = registers[readByte()];
+                if (not holds_type<Number>(value)) {
+                    m_ip = ip;
+                    runtimeError("Operand must be a number.");
+                    return InterpretResult::RuntimeError;
+                }
+                registers[dst] = -get_type_unchecked<Number>(value);
+                DISPATCH();
+            }
+            CASE(Jump): {
+                const auto offset = readShort();
+                ip += offset;
+                DISPATCH();
+            }
+            CASE(JumpIfFalse): {
+                const auto& condition = registers[readByte()];
+                const auto offset = readShort();
+                if (isFalsey(condition)) {
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+            CASE(JumpIfTrue): {
+                const auto& condition = registers[readByte()];
+                const auto offset = readShort();
+                if (not isFalsey(condition)) {
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+            CASE(Loop): {
+                const auto offset = readShort();
+                ip -= offset;
+                DISPATCH();
+            }
+            CASE(JumpLong): {
+                ip += readLong();
+                DISPATCH();
+            }
+            CASE(JumpIfFalseLong): {
+                const auto& condition = registers[readByte()];
+                const auto offset = readLong();
+                if (isFalsey(condition)) {
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+            CASE(JumpIfTrueLong): {
+                const auto& condition = registers[readByte()];
+                const auto offset = readLong();
+                if (not isFalsey(condition)) {
+                    ip += offset;
+                }
+                DISPATCH();
+            }
+            CASE(LoopLong): {
+                ip -= readLong();
+                DISPATCH();
+            }
+            CASE(Print): {
+                print(registers[readByte()]);
+                DISPATCH();
+            }
+            CASE(Return): {
+                return InterpretResult::Ok;
+            }
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#else
+        }
+    }
+#endif
 }
 
-void VM::concatenate() {
-    // unchecked should be fine, since we're checking the types before in run()
-    auto b = get_objtype_unchecked<std::string>(pop());
-    auto a = get_objtype_unchecked<std::string>(pop());
-    m_stack.emplace_back(a + b);
-}
+#undef DISPATCH
+#undef CASE
+#undef TRACE_EXECUTION
 
-bool VM::isFalsey(const Value& value) {
-    return (
-        std::holds_alternative<Nil>(value) ||
-        (std::holds_alternative<Bool>(value) && std::get<Bool>(value) == false)
-    );
+#ifdef DEBUG_TRACE_EXECUTION
+void VM::traceExecution() {
+    if (not m_trace) {
+        return;
+    }
+    std::string trace = "          ";
+    for (auto *slot = m_stackTop; slot != m_stack.get(); ) {
+        fmt::format_to(std::back_inserter(trace), "[ {} ]", visitValue(PrintVisitor{}, *--slot));
+    }
+    trace += '\n';
+    std::ignore = m_chunk->disassembleInstruction(trace, static_cast<std::size_t>(m_ip - m_chunk->bytecode().data()));
+    if (m_debugOutput != nullptr) {
+        *m_debugOutput += trace;
+    } else {
+        fmt::print("{}", trace);
+    }
 }
+#endif
 
-bool VM::valuesEqual(const Value& a, const Value& b) {
-    return std::visit(EqualityVisitor{}, a, b);
+void VM::runtimeError(const std::string& msg) {
+    long instruction = this->m_ip - this->m_chunk->bytecode().data() - 1;
+    std::size_t line = this->m_chunk->lines.getLine(static_cast<std::size_t>(instruction));
+    const auto message = fmt::format("{}[line {}] in script\n", msg, line);
+    if (m_diagnostics != nullptr) {
+        *m_diagnostics += message;
+    } else {
+        fmt::print(stderr, "{}", message);
+    }
+    resetStack();
 }
 
-Value VM::peek(std::size_t many) {
-    if (many == 0) {
-        return m_stack.back();
-    } else if (many == 1) {
-        auto tmpValue = pop();
-        auto retValue = m_stack.back();
-        m_stack.push_back(tmpValue);
-        return retValue;
+void VM::print(const Value& value) {
+    const auto text = visitValue(PrintVisitor{}, flatten(value));
+    if (m_output != nullptr) {
+        *m_output += text;
+        *m_output += '\n';
+    } else {
+        fmt::print("{}\n", text);
     }
-    assert(false && "peek is not implemented for numbers > 1.");
 }
 
-Value VM::pop() {
-    auto v = m_stack.back();
-    m_stack.pop_back();
-    return v;
+void VM::resetStack() {
+    m_stackTop = m_stack.get();
 }
 
+void VM::concatenate() {
+    // unchecked should be fine, since we're checking the types before in run()
+    peek(1) = concatenate(peek(1), peek(0));
+    m_stackTop--;
+}
 
+Obj *VM::concatenate(const Value& a, const Value& b) {
+    // the operands are still on the stack, in a register or a constant, so they survive
+    if (m_heap.shouldCollect()) {
+        m_heap.step([this](Heap& heap) { markRoots(heap); });
+    }
+    return m_heap.concatenate(get_objtype_unchecked<Obj>(a), get_objtype_unchecked<Obj>(b));
+}
 
+Value VM::flatten(const Value& value) {
+    if (holds_obj_type<ObjRope>(value)) {
+        return m_heap.flatten(get_objtype_unchecked<Obj>(value));
+    }
+    return value;
+}
 
+void VM::collectGarbage() {
+    m_heap.collect([this](Heap& heap) { markRoots(heap); });
+}
 
+void VM::markRoots(Heap& heap) {
+    for (const Value *slot = m_stack.get(); slot != m_stackTop; ++slot) {
+        heap.markValue(*slot);
+    }
+    for (const auto& value : globals.values) {
+        heap.markValue(value);
+    }
+    // the compiler maps names to slots by pointer, so the names have to stay alive
+    for (std::size_t slot = 0; slot < globals.size(); ++slot) {
+        heap.markObject(globals.name(slot));
+    }
+    if (m_chunk != nullptr) {
+        for (const auto& constant : m_chunk->constants) {
+            heap.markValue(constant);
+        }
+        for (auto *name : m_chunk->globalNames) {
+            heap.markObject(name);
+        }
+    }
+}
 
+bool VM::isFalsey(const Value& value) {
+    return (
+        holds_type<Nil>(value) ||
+        (holds_type<Bool>(value) && get_type_unchecked<Bool>(value) == false)
+    );
+}
 
+bool VM::valuesEqual(const Value& a, const Value& b) {
+    // flat strings are interned, ropes have to be flattened before their pointers can be compared
+    if (holds_string(a) && holds_string(b)) {
+        auto *lhs = get_objtype_unchecked<Obj>(a);
+        auto *rhs = get_objtype_unchecked<Obj>(b);
+        if (lhs == rhs) {
+            return true;
+        }
+        if (stringLength(lhs) != stringLength(rhs)) {
+            return false;
+        }
+        const auto *left = m_heap.flatten(lhs);
+        const auto *right = m_heap.flatten(rhs);
+        // the strings of a Program are interned in its own heap
+        return left == right || ((left->permanent || right->permanent) && left->chars == right->chars);
+    }
+    return visitValues(EqualityVisitor{}, a, b);
+}
 
+Value& VM::peek(std::size_t distance) {
+    return m_stackTop[-1 - static_cast<std::ptrdiff_t>(distance)];
+}
 
-
-
-
-
-
-
-
-
-
-
-
-
+// the returned value stays valid until the next push
+const Value& VM::pop() {
+    return *--m_stackTop;
+}
@@ -1,8 +1,46 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <unistd.h>
 
+#include "batch_runner.h"
+#include "bytecode_file.h"
 #include "chunk.h"
+#include "compile_driver.h"
 #include "compiler.h"
+#include "optimizer.h"
+#include "prelude.h"
+#include "scan_kernels.h"
 #include "scanner.h"
+#include "source_file.h"
+#include "token_buffer.h"
+#include "vm.h"
+
+// every allocation of the test binary is counted, see compiler.front_end_does_not_allocate_per_token
+static std::atomic<std::size_t> allocationCount { 0 };
+
+void *operator new(std::size_t size) {
+    allocationCount++;
+    if (void *pointer = std::malloc(size == 0 ? 1 : size)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
 
 TEST(scanner, tokentype) {
     std::string_view lexeme = "for";
@@ -25,6 +63,128 @@ TEST(scanner, full_compare) {
     EXPECT_EQ(token, expected);
 }
 
+TEST(scanner, simd_kernels_agree_with_the_scalar_ones) {
+    const auto kernels = supportedScanKernels();
+    ASSERT_FALSE(kernels.empty());
+    const auto& scalar = *kernels.front();
+    EXPECT_STREQ(scalar.name, "scalar");
+
+    // every run length around the vector widths, followed by a byte that stops the kernel
+    std::vector<std::string> inputs;
+    for (std::size_t length = 0; length < 70; ++length) {
+        inputs.push_back(std::string(length, ' ') + "x");
+        inputs.push_back(std::string(length, '\n') + " \t\r\n" + std::string(length % 5, '\n') + "+");
+        inputs.push_back(std::string(length, 'a') + "Z_9" + std::string(length, '1') + ".");
+        inputs.push_back(std::string(length, '7') + "e");
+        inputs.push_back(std::string(length, '\n') + std::string(length, 's') + "\"tail");
+        inputs.push_back(std::string(length, 'c'));
+        inputs.push_back(std::string(length, '\xe9') + "\n");
+    }
+
+    for (const auto *simd : kernels) {
+        SCOPED_TRACE(simd->name);
+        for (const auto& input : inputs) {
+            // ending one byte early checks that the kernels stop at `end` even if more bytes follow
+            for (const auto size : { input.size(), input.empty() ? 0 : input.size() - 1 }) {
+                const char *begin = input.data();
+                const char *end = begin + size;
+                std::size_t expectedLines = 0;
+                std::size_t lines = 0;
+                EXPECT_EQ(simd->skipBlanks(begin, end, lines), scalar.skipBlanks(begin, end, expectedLines));
+                EXPECT_EQ(lines, expectedLines);
+                EXPECT_EQ(simd->skipComment(begin, end), scalar.skipComment(begin, end));
+                EXPECT_EQ(simd->skipIdentifier(begin, end), scalar.skipIdentifier(begin, end));
+                EXPECT_EQ(simd->skipDigits(begin, end), scalar.skipDigits(begin, end));
+                lines = expectedLines = 0;
+                EXPECT_EQ(simd->skipString(begin, end, lines), scalar.skipString(begin, end, expectedLines));
+                EXPECT_EQ(lines, expectedLines);
+            }
+        }
+    }
+}
+
+TEST(scanner, long_runs_keep_tokens_and_lines) {
+    const std::string identifier(100, 'v');
+    const std::string source = std::string(40, ' ') + "// " + std::string(50, '-') + "\n\n" + identifier
+        + " 12345678901234567890.25\n\"" + std::string(33, 's') + "\n" + std::string(20, 's') + "\" x";
+    Scanner scanner(source.c_str());
+
+    auto token = scanner.scanToken();
+    EXPECT_EQ(token.type, TokenType::Identifier);
+    EXPECT_EQ(std::string_view(token.start, token.length), identifier);
+    EXPECT_EQ(token.line, 3);
+
+    token = scanner.scanToken();
+    EXPECT_EQ(token.type, TokenType::Number);
+    EXPECT_EQ(std::string_view(token.start, token.length), "12345678901234567890.25");
+
+    token = scanner.scanToken();
+    EXPECT_EQ(token.type, TokenType::String);
+    EXPECT_EQ(token.length, 33 + 1 + 20 + 2);
+    EXPECT_EQ(token.line, 5);
+
+    token = scanner.scanToken();
+    EXPECT_EQ(token.type, TokenType::Identifier);
+    EXPECT_EQ(scanner.scanToken().type, TokenType::Eof);
+}
+
+TEST(scanner, stops_at_the_end_of_the_view) {
+    const std::string source = "print 12;\"unterminated";
+    Scanner scanner(std::string_view(source).substr(0, 8));
+    EXPECT_EQ(scanner.scanToken().type, TokenType::Print);
+    const auto number = scanner.scanToken();
+    EXPECT_EQ(std::string_view(number.start, number.length), "12");
+    EXPECT_EQ(scanner.scanToken().type, TokenType::Eof);
+
+    Scanner string(std::string_view(source).substr(9, 5));
+    EXPECT_EQ(string.scanToken().type, TokenType::Error);
+}
+
+TEST(source_file, maps_files_and_reads_streams) {
+    const auto path = std::filesystem::temp_directory_path() / "bytecode_vm_source.lox";
+    const auto page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+
+    // a file that ends exactly on a page boundary still gets its zero byte
+    for (const auto size : { std::size_t { 1 }, page - 1, page, 3 * page }) {
+        std::string text = "print 1;";
+        text.resize(size, ' ');
+        std::ofstream(path, std::ios::trunc) << text;
+
+        const auto source = SourceFile::load(path);
+        ASSERT_TRUE(source.has_value());
+        EXPECT_TRUE(source->isMapped());
+        EXPECT_EQ(source->text(), text);
+        EXPECT_EQ(source->text().data()[size], '\0');
+    }
+
+    std::ofstream(path, std::ios::trunc).flush();
+    const auto empty = SourceFile::load(path);
+    ASSERT_TRUE(empty.has_value());
+    EXPECT_TRUE(empty->text().empty());
+    std::filesystem::remove(path);
+
+    testing::internal::CaptureStderr();
+    EXPECT_FALSE(SourceFile::load(path).has_value());
+    EXPECT_NE(testing::internal::GetCapturedStderr().find("can not be opened"), std::string::npos);
+
+    // pipes cannot be mapped and are read in blocks
+    int fds[2];
+    ASSERT_EQ(::pipe(fds), 0);
+    const std::string script = "var a = 40;\nprint a + 2;\n";
+    ASSERT_EQ(::write(fds[1], script.data(), script.size()), static_cast<ssize_t>(script.size()));
+    ::close(fds[1]);
+    const auto streamed = SourceFile::read(fds[0]);
+    ::close(fds[0]);
+    ASSERT_TRUE(streamed.has_value());
+    EXPECT_FALSE(streamed->isMapped());
+    EXPECT_EQ(streamed->text(), script);
+
+    VM vm;
+    testing::internal::CaptureStdout();
+    EXPECT_EQ(vm.interpret(streamed->text()), InterpretResult::Ok);
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "42\n");
+}
+
 TEST(compiler, eof_token_at_the_end) {
     std::string_view sv = "1 + 2;";
     Scanner s(sv.data());
@@ -41,13 +201,1044 @@ TEST(compiler, eof_token_at_the_end) {
 
 TEST(ValuePrinter, correct_print_for_all_types) {
     Value v { true };
-    EXPECT_EQ(std::visit(PrintVisitor{}, v), "true");
+    EXPECT_EQ(visitValue(PrintVisitor{}, v), "true");
+}
+
+TEST(Value, holds_the_type_it_was_constructed_with) {
+    Value number { 3.5 };
+    EXPECT_TRUE(holds_type<Number>(number));
+    EXPECT_FALSE(holds_type<Bool>(number));
+    EXPECT_EQ(get_type_unchecked<Number>(number), 3.5);
+    EXPECT_TRUE(holds_type<Nil>(Value { Nil{} }));
+    EXPECT_FALSE(get_type_unchecked<Bool>(Value { false }));
+
+    Heap heap;
+    Value str { heap.copyString("lox") };
+    EXPECT_TRUE(holds_obj_type<ObjString>(str));
+    EXPECT_FALSE(holds_type<Number>(str));
+    EXPECT_EQ(visitValue(PrintVisitor{}, str), "lox");
+    EXPECT_FALSE(visitValues(EqualityVisitor{}, str, number));
+}
+
+TEST(Heap, strings_are_interned) {
+    Heap heap;
+    auto *lox = heap.copyString("lox");
+    EXPECT_EQ(lox, heap.copyString("lox"));
+    EXPECT_EQ(lox, heap.takeString(std::string("l") + "ox"));
+    EXPECT_NE(lox, heap.copyString("clox"));
+    EXPECT_EQ(lox->hash, hashString("lox"));
+    EXPECT_TRUE(visitValues(EqualityVisitor{}, Value { lox }, Value { heap.copyString("lox") }));
+}
+
+#ifdef NAN_BOXING
+TEST(Value, nan_boxed_value_fits_into_a_double) {
+    EXPECT_EQ(sizeof(Value), sizeof(double));
+    EXPECT_TRUE(holds_type<Number>(Value { 0.0 / 0.0 }));
+}
+#endif
+
+TEST(vm, global_arithmetic) {
+    VM vm;
+    testing::internal::CaptureStdout();
+    EXPECT_EQ(vm.interpret("var a = 1; var b = a + 2; print b * 2;"), InterpretResult::Ok);
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "6\n");
+}
+
+TEST(vm, globals_keep_their_slot_across_interpret_calls) {
+    VM vm;
+    testing::internal::CaptureStdout();
+    EXPECT_EQ(vm.interpret("var a = 1;"), InterpretResult::Ok);
+    EXPECT_EQ(vm.interpret("a = a + 41; print a;"), InterpretResult::Ok);
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "42\n");
+}
+
+TEST(vm, undefined_global_is_a_runtime_error) {
+    VM vm;
+    testing::internal::CaptureStderr();
+    EXPECT_EQ(vm.interpret("print b;"), InterpretResult::RuntimeError);
+    EXPECT_EQ(vm.interpret("b = 1;"), InterpretResult::RuntimeError);
+    EXPECT_NE(testing::internal::GetCapturedStderr().find("Undefined variable 'b'"), std::string::npos);
+}
+
+TEST(vm, concatenated_strings_compare_equal) {
+    VM vm;
+    testing::internal::CaptureStdout();
+    EXPECT_EQ(vm.interpret("var a = \"con\"; print a + \"cat\" == \"concat\";"), InterpretResult::Ok);
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "true\n");
+}
+
+
+
+
+
+
+
+
+
+static bool containsOpCode(const Chunk& chunk, OpCode opcode) {
+    for (std::size_t offset = 0; offset < chunk.code.size(); offset += instructionSize(static_cast<OpCode>(chunk.code[offset]))) {
+        if (static_cast<OpCode>(chunk.code[offset]) == opcode) {
+            return true;
+        }
+    }
+    return false;
+}
+
+TEST(chunk, line_table_is_run_length_encoded) {
+    Chunk chunk;
+    Heap heap;
+    Globals globals;
+    Compiler compiler(chunk, heap, globals);
+    ASSERT_TRUE(compiler.compile("var a = 1;\n\nprint a;\nprint a + 2;"));
+    // Constant, DefineGlobalSlot | GetGlobalSlot, Print | GetGlobalSlot, AddConstant, Print, Return
+    ASSERT_EQ(chunk.lines.runs().size(), 3);
+    EXPECT_EQ(chunk.lines.getLine(0), 1);
+    EXPECT_EQ(chunk.lines.getLine(4), 1);
+    EXPECT_EQ(chunk.lines.getLine(5), 3);
+    EXPECT_EQ(chunk.lines.getLine(8), 3);
+    EXPECT_EQ(chunk.lines.getLine(9), 4);
+    EXPECT_EQ(chunk.lines.getLine(chunk.code.size() - 1), 4);
+
+    VM vm;
+    testing::internal::CaptureStderr();
+    EXPECT_EQ(vm.interpret("var a = 1;\n\nprint b;"), InterpretResult::RuntimeError);
+    EXPECT_NE(testing::internal::GetCapturedStderr().find("[line 3]"), std::string::npos);
+}
+
+TEST(chunk, line_table_is_small_for_large_chunks) {
+    std::string source;
+    for (int n = 0; n < 5000; ++n) {
+        source += fmt::format("var v{} = {} + v{};\n", n % 100, n, (n + 1) % 100);
+    }
+
+    Chunk chunk;
+    Heap heap;
+    Globals globals;
+    Compiler compiler(chunk, heap, globals);
+    ASSERT_TRUE(compiler.compile(source));
+    // the Return is on the line after the last statement
+    EXPECT_EQ(chunk.lines.runs().size(), 5001);
+
+    testing::internal::CaptureStdout();
+    chunk.printMemoryReport("large");
+    const auto report = testing::internal::GetCapturedStdout();
+    EXPECT_NE(report.find("5001 runs"), std::string::npos);
+
+    // one line per byte would have been sizeof(std::size_t) bytes for every byte of code
+    const auto memory = chunk.memoryUsage();
+    EXPECT_LT(memory.lines * 4, chunk.code.size() * sizeof(std::size_t));
+}
+
+TEST(chunk, listings_can_be_written_to_a_sink) {
+    Chunk chunk;
+    Heap heap;
+    Globals globals;
+    Compiler compiler(chunk, heap, globals);
+    ASSERT_TRUE(compiler.compile("print 1 + 2;"));
+
+    std::string listing;
+    testing::internal::CaptureStdout();
+    chunk.disassembleChunk("code", &listing);
+    chunk.printMemoryReport("code", &listing);
+    std::ignore = chunk.disassembleInstruction(0, &listing);
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "");
+
+    EXPECT_EQ(listing.find("== code ("), 0);
+    EXPECT_NE(listing.find("Return"), std::string::npos);
+    EXPECT_NE(listing.find("== code memory =="), std::string::npos);
+    // the single instruction comes after the whole listing
+    EXPECT_GT(listing.rfind("0000 "), listing.find("== code memory =="));
+}
+
+TEST(optimizer, fuses_superinstructions) {
+    Chunk chunk;
+    Heap heap;
+    Globals globals;
+    Compiler compiler(chunk, heap, globals);
+    ASSERT_TRUE(compiler.compile("{ var a = 1; var b = 2; while (a < 10) { a = a + b; } print a != b; print a >= b; }"));
+    EXPECT_TRUE(containsOpCode(chunk, OpCode::AddLocals));
+    EXPECT_TRUE(containsOpCode(chunk, OpCode::JumpIfNotLess));
+    EXPECT_TRUE(containsOpCode(chunk, OpCode::NotEqual));
+    EXPECT_TRUE(containsOpCode(chunk, OpCode::NotLess));
+    EXPECT_FALSE(containsOpCode(chunk, OpCode::Less));
+    EXPECT_EQ(chunk.lines.runs().size(), 1);
+}
+
+TEST(vm, fused_instructions_keep_their_semantics) {
+    VM vm;
+    testing::internal::CaptureStdout();
+    EXPECT_EQ(vm.interpret(R"(
+        var i = 0;
+        var s = "";
+        while (i < 3) { s = s + "a"; i = i + 1; }
+        print s;
+        { var a = 2; var b = 3; print a + b; }
+        print 1 != 1;
+        print 2 >= 1;
+        print 2 <= 1;
+        var x = 5;
+        print 1 + (x or 2);
+    )"), InterpretResult::Ok);
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "aaa\n5\nfalse\ntrue\nfalse\n6\n");
+}
+
+static std::string runWithBackend(const std::string_view source, Backend backend) {
+    VM vm;
+    testing::internal::CaptureStdout();
+    EXPECT_EQ(vm.interpret(source, backend), InterpretResult::Ok);
+    return testing::internal::GetCapturedStdout();
+}
+
+TEST(vm, register_backend_matches_stack_backend) {
+    constexpr std::string_view source = R"(
+        var a = 1;
+        var b = 2;
+        print a + b * 3 - -a;
+        print !(a < b) == false;
+        print a >= b; print a <= b; print a != b;
+        print "ab" + "cd" + "e";
+        print nil or "x"; print false and 1; print 1 and 2;
+        {
+            var x = 10;
+            var y = x;
+            x = x + 1;
+            print x + (x = 1);
+            var z = x = y = 5;
+            print x + y + z;
+            var i = 0;
+            var sum = 0;
+            while (i < 10) {
+                if (i == 3 or i > 6) sum = sum + i; else sum = sum - 1;
+                i = i + 1;
+            }
+            print sum;
+        }
+        a = b = 7;
+        print a + (a = 1);
+    )";
+    const auto expected = runWithBackend(source, Backend::Stack);
+    EXPECT_EQ(expected, "8\ntrue\nfalse\ntrue\ntrue\nabcde\nx\nfalse\n2\n12\n15\n21\n8\n");
+    EXPECT_EQ(runWithBackend(source, Backend::Register), expected);
+}
+
+TEST(compiler, register_backend_keeps_locals_in_registers) {
+    Chunk chunk;
+    Heap heap;
+    Globals globals;
+    Compiler compiler(chunk, heap, globals, Backend::Register);
+    ASSERT_TRUE(compiler.compile("{ var a = 1; var b = 2; a = a + b; print a; }"));
+    EXPECT_EQ(chunk.backend, Backend::Register);
+    EXPECT_EQ(chunk.registerCount, 2);
+    // LoadConstant r0, LoadConstant r1, Add r0 r0 r1, Print r0, Return
+    EXPECT_EQ(chunk.code.size(), 3 + 3 + 4 + 2 + 1);
+}
+
+TEST(vm, register_backend_reports_runtime_errors) {
+    VM vm;
+    testing::internal::CaptureStderr();
+    EXPECT_EQ(vm.interpret("{ var a = 1; print -\"a\"; }", Backend::Register), InterpretResult::RuntimeError);
+    EXPECT_EQ(vm.interpret("print a + 1;", Backend::Register), InterpretResult::RuntimeError);
+    const auto errors = testing::internal::GetCapturedStderr();
+    EXPECT_NE(errors.find("Operand must be a number."), std::string::npos);
+    EXPECT_NE(errors.find("Undefined variable 'a'"), std::string::npos);
+}
+
+TEST(vm, stack_overflow_is_a_runtime_error) {
+    VM vm(4);
+    testing::internal::CaptureStderr();
+    // a global keeps the constant folding from evaluating the expression at compile time
+    EXPECT_EQ(vm.interpret("var x = 1; print x + (x + (x + (x + (x + x))));"), InterpretResult::RuntimeError);
+    EXPECT_NE(testing::internal::GetCapturedStderr().find("Stack overflow."), std::string::npos);
+
+    testing::internal::CaptureStdout();
+    EXPECT_EQ(vm.interpret("print 1 + (2 + (3 + 4));"), InterpretResult::Ok);
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "10\n");
+}
+
+TEST(compiler, constants_are_deduplicated) {
+    Chunk chunk;
+    Heap heap;
+    Globals globals;
+    Compiler compiler(chunk, heap, globals);
+    ASSERT_TRUE(compiler.compile("print 1; print 1; print \"a\"; print \"a\"; print 2; print true;"));
+    EXPECT_EQ(chunk.constants.size(), 3);
+}
+
+TEST(vm, large_scripts_use_wide_operands) {
+    // thousands of literals and a loop body that no 16 bit jump can cross
+    std::string source = "var s = 0; var i = 0; while (i < 2) { if (i < 5) {";
+    for (int n = 1; n <= 6000; ++n) {
+        source += fmt::format(" s = s + {};", n);
+    }
+    source += " } i = i + 1; } print s;";
+
+    Chunk chunk;
+    Heap heap;
+    Globals globals;
+    Compiler compiler(chunk, heap, globals);
+    ASSERT_TRUE(compiler.compile(source));
+    EXPECT_TRUE(containsOpCode(chunk, OpCode::ConstantLong));
+    EXPECT_TRUE(containsOpCode(chunk, OpCode::JumpIfFalseLong));
+    EXPECT_TRUE(containsOpCode(chunk, OpCode::LoopLong));
+
+    EXPECT_EQ(runWithBackend(source, Backend::Stack), "36006000\n");
+    EXPECT_EQ(runWithBackend(source, Backend::Register), "36006000\n");
+}
+
+TEST(vm, locals_beyond_the_first_256_use_wide_slots) {
+    std::string source = "{";
+    for (int n = 0; n < 300; ++n) {
+        source += fmt::format(" var l{} = {};", n, n);
+    }
+    source += " print l0 + l299; l299 = 1; print l299; }";
+    EXPECT_EQ(runWithBackend(source, Backend::Stack), "299\n1\n");
+
+    // register operands stay 8 bit wide
+    VM vm;
+    testing::internal::CaptureStderr();
+    EXPECT_EQ(vm.interpret(source, Backend::Register), InterpretResult::CompileError);
+    EXPECT_NE(testing::internal::GetCapturedStderr().find("Too many registers in one chunk."), std::string::npos);
+}
+
+TEST(token_buffer, stores_tokens_as_parallel_arrays) {
+    const std::string source = "var x = 12.5;\n\n\nprint x 3 @ \"a\nb\" 99999999999999999999999999999999999999999999999999"
+        + std::string(300, '9') + ";";
+    const TokenBuffer buffer(source);
+    ASSERT_EQ(buffer.size(), 13);
+    EXPECT_EQ(buffer.type(3), TokenType::Number);
+    EXPECT_EQ(buffer.type(8), TokenType::Error);
+    EXPECT_EQ(buffer.number(0), 12.5);
+    EXPECT_EQ(buffer.number(1), 3);
+    EXPECT_EQ(buffer.number(2), std::numeric_limits<double>::infinity());
+
+    Scanner scanner(source.c_str());
+    TokenBuffer::Cursor cursor;
+    std::size_t numbers = 0;
+    for (std::size_t i = 0; i < buffer.size(); ++i) {
+        const auto expected = scanner.scanToken();
+        const auto [token, number] = buffer.next(cursor);
+        EXPECT_EQ(token.type, expected.type);
+        EXPECT_EQ(std::string_view(token.start, token.length), std::string_view(expected.start, expected.length));
+        EXPECT_EQ(token.line, expected.line);
+        if (token.type == TokenType::Number) {
+            EXPECT_EQ(number, buffer.number(numbers++));
+        }
+    }
+    EXPECT_EQ(cursor.numbers, 3);
+    EXPECT_EQ(numbers, 3);
+    // the parser can ask for more tokens after the end
+    EXPECT_EQ(buffer.next(cursor).token.type, TokenType::Eof);
+    EXPECT_EQ(cursor.token, buffer.size());
+}
+
+TEST(compiler, token_buffer_compiles_the_same_code) {
+    constexpr std::string_view source = R"(
+        var a = 1;
+        { var b = 2; var c = b = 3 4; }
+        while (a < 10) { a = a + 2 * 1.5; }
+        if (a == 10 or !(a > 3)) print "x"; else print -a;
+    )";
+    for (const auto backend : { Backend::Stack, Backend::Register }) {
+        for (const auto& text : { std::string(source), std::string(source).replace(source.find(" 4;"), 2, "") }) {
+            Heap heap;
+            Globals globals;
+            Chunk scanned;
+            Compiler scanning(scanned, heap, globals, backend);
+            Chunk buffered;
+            Compiler buffering(buffered, heap, globals, backend);
+
+            testing::internal::CaptureStderr();
+            const auto compiled = scanning.compile(text);
+            EXPECT_EQ(buffering.compile(TokenBuffer(text)), compiled);
+            std::ignore = testing::internal::GetCapturedStderr();
+
+            EXPECT_EQ(buffered.code, scanned.code);
+            EXPECT_EQ(buffered.constants.size(), scanned.constants.size());
+            EXPECT_EQ(buffered.lines.runs().size(), scanned.lines.runs().size());
+
+            std::string diagnostics;
+            const auto onDemand = Program::compile(text, diagnostics, backend, OptimizationLevel::Basic, Lexing::OnDemand);
+            const auto ahead = Program::compile(text, diagnostics, backend, OptimizationLevel::Basic, Lexing::Ahead);
+            ASSERT_EQ(ahead != nullptr, compiled);
+            ASSERT_EQ(onDemand != nullptr, compiled);
+            if (compiled) {
+                EXPECT_EQ(ahead->chunk().code, onDemand->chunk().code);
+                EXPECT_EQ(ahead->chunk().constants.size(), onDemand->chunk().constants.size());
+            }
+        }
+    }
 }
 
+TEST(compiler, front_end_does_not_allocate_per_token) {
+    constexpr std::string_view statement = "print -a * (b + 2) < 3 and !false or a == nil; { var x = a; x = x / 2; } ";
+    Heap heap;
+    Globals globals;
 
+    const auto allocations = [&](std::size_t repetitions, Backend backend) {
+        std::string source;
+        for (std::size_t i = 0; i < repetitions; ++i) {
+            source += statement;
+        }
+        Chunk chunk;
+        chunk.code.reserve(64 * 1024);
+        Compiler compiler(chunk, heap, globals, backend);
+        const auto before = allocationCount.load();
+        EXPECT_TRUE(compiler.compile(source));
+        return allocationCount.load() - before;
+    };
+
+    for (const auto backend : { Backend::Stack, Backend::Register }) {
+        SCOPED_TRACE(backend == Backend::Stack ? "stack" : "register");
+        // resolves the globals, so neither run below interns a new name
+        std::ignore = allocations(1, backend);
+        // besides chunk growth, scanning and parsing 200 times the tokens costs nothing extra
+        EXPECT_EQ(allocations(200, backend), allocations(1, backend));
+    }
+}
+
+TEST(compiler, constant_expressions_are_folded) {
+    Chunk chunk;
+    Heap heap;
+    Globals globals;
+    Compiler compiler(chunk, heap, globals);
+    ASSERT_TRUE(compiler.compile("print 60 * 60 * 24; print -1 - 2; print !true; print \"a\" + \"b\" == \"ab\"; print 2 >= 3;"));
+    for (const auto opcode : { OpCode::Multiply, OpCode::Subtract, OpCode::Negate, OpCode::Not, OpCode::Add, OpCode::Equal, OpCode::Less }) {
+        EXPECT_FALSE(containsOpCode(chunk, opcode));
+    }
+
+    constexpr std::string_view source = R"(
+        print 60 * 60 * 24;
+        print -1 - 2;
+        print !true;
+        print "a" + "b" == "ab";
+        print 2 >= 3;
+        print (false and 1) == 1;
+        print (nil or 1) + 2;
+        var a = 1;
+        print a + 2 * 3;
+    )";
+    EXPECT_EQ(runWithBackend(source, Backend::Stack), "86400\n-3\nfalse\ntrue\nfalse\nfalse\n3\n7\n");
+    EXPECT_EQ(runWithBackend(source, Backend::Register), "86400\n-3\nfalse\ntrue\nfalse\nfalse\n3\n7\n");
+}
+
+TEST(vm, folding_keeps_runtime_errors) {
+    for (const auto backend : { Backend::Stack, Backend::Register }) {
+        VM vm;
+        testing::internal::CaptureStderr();
+        EXPECT_EQ(vm.interpret("print -\"a\";", backend), InterpretResult::RuntimeError);
+        EXPECT_EQ(vm.interpret("print 1 + \"a\";", backend), InterpretResult::RuntimeError);
+        EXPECT_EQ(vm.interpret("print \"a\" < \"b\";", backend), InterpretResult::RuntimeError);
+        std::ignore = testing::internal::GetCapturedStderr();
+    }
+}
+
+TEST(optimizer, removes_dead_code_and_constant_conditions) {
+    Chunk chunk;
+    Heap heap;
+    Globals globals;
+    Compiler compiler(chunk, heap, globals, Backend::Stack, OptimizationLevel::Basic);
+    ASSERT_TRUE(compiler.compile("if (false) print 1; else print 2; while (true) { print 3; } print 4;"));
+    for (const auto opcode : { OpCode::True, OpCode::False, OpCode::JumpIfFalse, OpCode::Jump, OpCode::Pop }) {
+        EXPECT_FALSE(containsOpCode(chunk, opcode));
+    }
+    // Constant 2, Print, Constant 3, Print, Loop and the Return that ends every chunk
+    EXPECT_EQ(chunk.code.size(), 2 + 1 + 2 + 1 + 3 + 1);
+    EXPECT_EQ(static_cast<OpCode>(chunk.code.back()), OpCode::Return);
+    EXPECT_EQ(chunk.lines.runs().size(), 1);
+    EXPECT_EQ(chunk.jumpTarget(6), 3);
+}
+
+TEST(optimizer, programs_ending_in_an_endless_loop_still_load) {
+    // there is no break, the loop is left with a runtime error
+    constexpr std::string_view source = "var i = 0; while (true) { i = i + 1; if (i == 3) { print i; print -nil; } }";
+    const auto path = std::filesystem::temp_directory_path() / "bytecode_vm_endless_loop.loxc";
+
+    for (const auto backend : { Backend::Stack, Backend::Register }) {
+        std::string diagnostics;
+        const auto program = Program::compile(source, diagnostics, backend, OptimizationLevel::Basic);
+        ASSERT_NE(program, nullptr);
+
+        VM isolate;
+        std::string output;
+        isolate.printTo(output);
+        isolate.reportTo(diagnostics);
+        EXPECT_EQ(isolate.run(program), InterpretResult::RuntimeError);
+        EXPECT_EQ(output, "3\n");
+        EXPECT_NE(diagnostics.find("Operand must be a number"), std::string::npos);
+
+        VM compiling;
+        compiling.setOptimizationLevel(OptimizationLevel::Basic);
+        ASSERT_TRUE(compiling.compileBytecodeFile(source, path, backend));
+        VM loading;
+        output.clear();
+        loading.printTo(output);
+        loading.reportTo(diagnostics);
+        EXPECT_EQ(loading.runBytecodeFile(path), InterpretResult::RuntimeError);
+        EXPECT_EQ(output, "3\n");
+    }
+    std::filesystem::remove(path);
+}
+
+TEST(optimizer, threads_jump_chains) {
+    Chunk chunk;
+    Heap heap;
+    Globals globals;
+    Compiler compiler(chunk, heap, globals, Backend::Stack, OptimizationLevel::Basic);
+    ASSERT_TRUE(compiler.compile("var a; var b; var c; print a and b and c;"));
+
+    // the JumpIfFalse of the first `and` lands on the one of the second and skips it
+    std::vector<std::size_t> jumps;
+    for (std::size_t offset = 0; offset < chunk.code.size(); offset += instructionSize(static_cast<OpCode>(chunk.code[offset]))) {
+        if (static_cast<OpCode>(chunk.code[offset]) == OpCode::JumpIfFalse) {
+            jumps.push_back(offset);
+        }
+    }
+    ASSERT_EQ(jumps.size(), 2);
+    EXPECT_EQ(chunk.jumpTarget(jumps[0]), chunk.jumpTarget(jumps[1]));
+}
+
+TEST(optimizer, cleanup_keeps_the_semantics) {
+    constexpr std::string_view source = R"(
+        var out = "";
+        var i = 0;
+        while (i < 8) {
+            var a = i > 3;
+            var b = i == 2 or i == 5;
+            if (a and b and i) print "a b " + (i + 0 == i and "i" or "no"); else if (false) print "never";
+            if (a or b or false) print "a or b"; else { if (nil) print "never"; print "neither"; }
+            if (true) i = i + 1;
+            while (false) print "never";
+            print !(a and b) == (!a or !b);
+        }
+        { var x = 1; if (x > 0) { var y = 2; print x + y; } else { var z = 3; print z; } }
+        print nil or false or "last";
+    )";
+
+    VM plain;
+    testing::internal::CaptureStdout();
+    EXPECT_EQ(plain.interpret(source), InterpretResult::Ok);
+    const auto expected = testing::internal::GetCapturedStdout();
+
+    VM optimized;
+    optimized.setOptimizationLevel(OptimizationLevel::Basic);
+    testing::internal::CaptureStdout();
+    EXPECT_EQ(optimized.interpret(source), InterpretResult::Ok);
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), expected);
+}
+
+TEST(bytecode_file, compiled_chunks_run_from_the_mapped_file) {
+    constexpr std::string_view source = R"(
+        var greeting = "hello" + " ";
+        var i = 0;
+        while (i < 3) { greeting = greeting + "!"; i = i + 1; }
+        { var local = 1.5; print local * i; }
+        print greeting;
+    )";
+    const auto path = std::filesystem::temp_directory_path() / "bytecode_vm_round_trip.loxc";
+
+    for (const auto backend : { Backend::Stack, Backend::Register }) {
+        Chunk chunk;
+        Heap heap;
+        Globals globals;
+        Compiler compiler(chunk, heap, globals, backend);
+        ASSERT_TRUE(compiler.compile(source));
+        ASSERT_TRUE(writeBytecodeFile(path, chunk, globals));
+
+        {
+            Heap loadHeap;
+            const auto loaded = loadBytecodeFile(path, loadHeap);
+            ASSERT_NE(loaded, nullptr);
+            // the code is executed straight from the mapping
+            EXPECT_NE(loaded->codeOwner, nullptr);
+            EXPECT_TRUE(loaded->code.empty());
+            EXPECT_TRUE(std::ranges::equal(loaded->bytecode(), chunk.code));
+            EXPECT_EQ(loaded->backend, backend);
+            EXPECT_EQ(loaded->constants.size(), chunk.constants.size());
+            EXPECT_EQ(loaded->lines.getLine(chunk.code.size() - 1), chunk.lines.getLine(chunk.code.size() - 1));
+        }
+
+        const auto expected = runWithBackend(source, backend);
+        EXPECT_EQ(expected, "4.5\nhello !!!\n");
+
+        VM fresh;
+        testing::internal::CaptureStdout();
+        EXPECT_EQ(fresh.runBytecodeFile(path), InterpretResult::Ok);
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), expected);
+
+        // other globals already took the slots of the file, the VM maps the names to its own
+        VM used;
+        testing::internal::CaptureStdout();
+        EXPECT_EQ(used.interpret("var unrelated = 1; var i = 10;", backend), InterpretResult::Ok);
+        EXPECT_EQ(used.runBytecodeFile(path), InterpretResult::Ok);
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), expected);
+    }
+    std::filesystem::remove(path);
+}
+
+TEST(bytecode_file, prelude_is_embedded_as_bytecode) {
+    for (const auto backend : { Backend::Stack, Backend::Register }) {
+        VM vm;
+        testing::internal::CaptureStdout();
+        EXPECT_EQ(vm.interpret("print PI; print SECONDS_PER_DAY; print -INFINITY;", backend), InterpretResult::Ok);
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), "3.141592653589793\n86400\n-inf\n");
+    }
+
+    // the VM starts with these globals, the code runs straight from the generated array
+    Heap heap;
+    const auto prelude = loadBytecode(preludeBytecode(), "prelude", heap);
+    ASSERT_NE(prelude, nullptr);
+    EXPECT_TRUE(prelude->code.empty());
+    EXPECT_EQ(prelude->bytecode().data(), preludeBytecode().data() + BytecodeFile::HEADER_SIZE);
+    ASSERT_FALSE(prelude->globalNames.empty());
+    EXPECT_EQ(prelude->globalNames[0], heap.copyString("PI"));
+
+    // a file compiled by a VM refers to the prelude globals by name, a fresh VM runs it in place
+    const auto path = std::filesystem::temp_directory_path() / "bytecode_vm_prelude.loxc";
+    VM compiling;
+    ASSERT_TRUE(compiling.compileBytecodeFile("var area = PI * 2 * 2; print area;", path));
+    const auto loaded = loadBytecodeFile(path, heap);
+    ASSERT_NE(loaded, nullptr);
+    EXPECT_NE(loaded->codeOwner, nullptr);
+
+    VM fresh;
+    testing::internal::CaptureStdout();
+    EXPECT_EQ(fresh.runBytecodeFile(path), InterpretResult::Ok);
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "12.566370614359172\n");
+    std::filesystem::remove(path);
+}
+
+TEST(bytecode_file, corrupted_files_are_rejected) {
+    const auto path = std::filesystem::temp_directory_path() / "bytecode_vm_corrupted.loxc";
+
+    Chunk chunk;
+    Heap heap;
+    Globals globals;
+    Compiler compiler(chunk, heap, globals);
+    ASSERT_TRUE(compiler.compile("print 1 + 2;"));
+    auto bytes = serializeChunk(chunk, globals);
+    bytes.back() ^= 0xff;
+    std::ofstream(path, std::ios::binary).write(reinterpret_cast<const char *>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+
+    VM vm;
+    testing::internal::CaptureStderr();
+    EXPECT_EQ(vm.runBytecodeFile(path), InterpretResult::CompileError);
+    EXPECT_NE(testing::internal::GetCapturedStderr().find("checksum mismatch"), std::string::npos);
+
+    std::ofstream(path, std::ios::binary | std::ios::trunc) << "LOXC";
+    testing::internal::CaptureStderr();
+    EXPECT_EQ(vm.runBytecodeFile(path), InterpretResult::CompileError);
+    EXPECT_NE(testing::internal::GetCapturedStderr().find("not a valid bytecode file"), std::string::npos);
+    std::filesystem::remove(path);
+
+    // hand built code with a valid checksum is still checked before it is used or patched
+    const auto op = [](auto opcode) { return static_cast<std::uint8_t>(opcode); };
+    struct Case {
+        Backend backend;
+        std::vector<std::uint8_t> code;
+        std::string_view reason;
+    };
+    const Case cases[] {
+        { Backend::Stack, { op(OpCode::Nil), op(OpCode::GetGlobalSlot) }, "truncated instruction" },
+        { Backend::Stack, { op(OpCode::Constant), 200, op(OpCode::Return) }, "constant out of range" },
+        { Backend::Stack, { op(OpCode::ConstantLong), 0, 1, 0, op(OpCode::Return) }, "constant out of range" },
+        { Backend::Stack, { op(OpCode::Jump), 0xff, 0xff, op(OpCode::Return) }, "jump out of range" },
+        { Backend::Stack, { op(OpCode::Loop), 0, 4, op(OpCode::Return) }, "jump out of range" },
+        { Backend::Stack, { op(OpCode::Jump), 0, 1, op(OpCode::Constant), 0, op(OpCode::Return) }, "jump out of range" },
+        { Backend::Stack, { op(OpCode::GetGlobalSlot), 0, 1, op(OpCode::Return) }, "global out of range" },
+        { Backend::Stack, { 0xee, op(OpCode::Return) }, "unknown opcode" },
+        { Backend::Stack, { op(OpCode::Nil), op(OpCode::Print) }, "code runs past the end" },
+        { Backend::Stack, {}, "code runs past the end" },
+        { Backend::Stack, { op(OpCode::Pop), op(OpCode::Print), op(OpCode::Return) }, "stack underflow" },
+        { Backend::Stack, { op(OpCode::Nil), op(OpCode::Less), op(OpCode::Return) }, "stack underflow" },
+        { Backend::Stack, { op(OpCode::True), op(OpCode::JumpIfFalse), 0, 1, op(OpCode::Nil), op(OpCode::Return) }, "stack depth differs between paths" },
+        { Backend::Stack, { op(OpCode::GetLocal), 100, op(OpCode::Return) }, "local out of range" },
+        { Backend::Stack, { op(OpCode::Nil), op(OpCode::Nil), op(OpCode::AddLocals), 0, 2, op(OpCode::Return) }, "local out of range" },
+        { Backend::Register, { op(RegOpCode::LoadNil), 3, op(RegOpCode::Return) }, "register out of range" },
+        { Backend::Register, { op(RegOpCode::LoadConstant), 0, 1, op(RegOpCode::Return) }, "constant out of range" },
+        { Backend::Register, { op(RegOpCode::JumpIfFalse), 0, 0, 9, op(RegOpCode::Return) }, "jump out of range" },
+        { Backend::Register, { op(RegOpCode::Print) }, "truncated instruction" },
+    };
+    for (const auto& [backend, code, reason] : cases) {
+        SCOPED_TRACE(reason);
+        Chunk handBuilt;
+        handBuilt.backend = backend;
+        handBuilt.registerCount = backend == Backend::Register ? 1 : 0;
+        handBuilt.code = code;
+        std::ignore = handBuilt.addConstant(Value { 1.0 });
+        Globals noGlobals;
+        const auto file = serializeChunk(handBuilt, noGlobals);
+
+        testing::internal::CaptureStderr();
+        EXPECT_EQ(loadBytecode(file, "hand built", heap), nullptr);
+        EXPECT_NE(testing::internal::GetCapturedStderr().find(reason), std::string::npos);
+    }
+
+    // code that only ends in a jump never runs past the end, whatever the optimizer leaves behind
+    Chunk endless;
+    endless.code = { op(OpCode::Nil), op(OpCode::Print), op(OpCode::Loop), 0, 5 };
+    Globals noGlobals;
+    EXPECT_NE(loadBytecode(serializeChunk(endless, noGlobals), "endless", heap), nullptr);
 
+    // a VM that reports errors to a sink does so for files it can not load too
+    Chunk underflow;
+    underflow.code = { op(OpCode::Pop), op(OpCode::Return) };
+    ASSERT_TRUE(writeBytecodeFile(path, underflow, noGlobals));
+    std::string diagnostics;
+    VM reporting(4);
+    reporting.reportTo(diagnostics);
+    testing::internal::CaptureStderr();
+    EXPECT_EQ(reporting.runBytecodeFile(path), InterpretResult::CompileError);
+    EXPECT_EQ(reporting.runBytecodeFile(path.string() + ".missing"), InterpretResult::CompileError);
+    EXPECT_EQ(testing::internal::GetCapturedStderr(), "");
+    EXPECT_NE(diagnostics.find("stack underflow"), std::string::npos);
+    EXPECT_NE(diagnostics.find("can not be opened"), std::string::npos);
+    std::filesystem::remove(path);
 
+    // a global operand addresses a name of the file, which a VM with other slots maps to its own
+    Chunk remapped;
+    remapped.code = { op(OpCode::Constant), 0, op(OpCode::DefineGlobalSlot), 0, 0, op(OpCode::GetGlobalSlot), 0, 0, op(OpCode::Print), op(OpCode::Return) };
+    std::ignore = remapped.addConstant(Value { 1.0 });
+    Globals fileGlobals;
+    std::ignore = fileGlobals.resolve(heap.copyString("late"));
+    const auto file = serializeChunk(remapped, fileGlobals);
+    const auto loaded = loadBytecode(file, "remapped", heap);
+    ASSERT_NE(loaded, nullptr);
+    EXPECT_EQ(loaded->bytecode()[4], 0);
+    ASSERT_EQ(loaded->globalNames.size(), 1);
+    EXPECT_EQ(loaded->globalNames[0]->chars, "late");
 
+    ASSERT_TRUE(writeBytecodeFile(path, remapped, fileGlobals));
+    VM shifted;
+    testing::internal::CaptureStdout();
+    EXPECT_EQ(shifted.interpret("var early = 2;"), InterpretResult::Ok);
+    EXPECT_EQ(shifted.runBytecodeFile(path), InterpretResult::Ok);
+    EXPECT_EQ(shifted.interpret("print late + early;"), InterpretResult::Ok);
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "1\n3\n");
+    std::filesystem::remove(path);
+}
+
+TEST(compile_driver, compiles_files_concurrently_in_a_stable_order) {
+    const auto directory = std::filesystem::temp_directory_path() / "bytecode_vm_driver";
+    std::filesystem::create_directories(directory);
+
+    std::vector<std::filesystem::path> paths;
+    for (int i = 0; i < 32; ++i) {
+        paths.push_back(directory / fmt::format("unit{}.lox", i));
+        std::ofstream(paths.back()) << fmt::format("var total = {} + total; print total * SECONDS_PER_MINUTE / 60;\n", i);
+    }
+    // `total` has to exist before the first unit runs
+    std::ofstream(directory / "init.lox") << "var total = 0;";
+    paths.insert(paths.begin(), directory / "init.lox");
+
+    testing::internal::CaptureStderr();
+    const auto files = compileFiles(paths, CompileOptions { .threads { 8 } });
+    const auto badFiles = compileFiles(std::vector { directory / "missing.lox", paths[1] }, CompileOptions { .threads { 2 } });
+    std::ofstream(directory / "broken.lox") << "print 1;\nprint (2;\nvar = 3;";
+    const auto broken = compileFiles(std::vector { directory / "broken.lox" });
+    // nothing is printed while compiling
+    EXPECT_EQ(testing::internal::GetCapturedStderr(), "");
+
+    ASSERT_EQ(files.size(), paths.size());
+    std::string expected;
+    int total = 0;
+    for (std::size_t i = 0; i < files.size(); ++i) {
+        EXPECT_EQ(files[i].path, paths[i]);
+        EXPECT_EQ(files[i].diagnostics, "");
+        ASSERT_NE(files[i].program, nullptr);
+        if (i > 0) {
+            total += static_cast<int>(i) - 1;
+            expected += fmt::format("{}\n", total);
+        }
+    }
+
+    ASSERT_EQ(badFiles.size(), 2);
+    EXPECT_EQ(badFiles[0].program, nullptr);
+    EXPECT_NE(badFiles[0].diagnostics.find("can not be opened"), std::string::npos);
+    EXPECT_NE(badFiles[1].program, nullptr);
+    EXPECT_EQ(broken[0].program, nullptr);
+    EXPECT_EQ(broken[0].diagnostics, "[line 2] Error at ';': Expect ')' after expression.\n[line 3] Error at '=': Expect variable name.\n");
+
+    // the programs share nothing, one VM runs them all and links their globals by name
+    VM vm;
+    testing::internal::CaptureStdout();
+    for (const auto& file : files) {
+        EXPECT_EQ(vm.run(file.program), InterpretResult::Ok);
+    }
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), expected);
+    std::filesystem::remove_all(directory);
+}
+
+TEST(vm, isolates_run_one_program_on_many_threads) {
+    constexpr std::size_t isolates = 8;
+    for (const auto backend : { Backend::Stack, Backend::Register }) {
+        SCOPED_TRACE(static_cast<int>(backend));
+        std::string diagnostics;
+        const auto program = Program::compile(R"(
+            var sum = 0;
+            var text = "";
+            {
+                var i = 0;
+                while (i < 2000) {
+                    sum = sum + i * TAU / TAU;
+                    text = text + "ab";
+                    i = i + 1;
+                }
+            }
+            print sum;
+            print text == text + "";
+        )", diagnostics, backend, OptimizationLevel::Basic);
+        ASSERT_NE(program, nullptr) << diagnostics;
+
+        // every isolate has its own stack, globals and heap, only the program is shared
+        std::vector<std::unique_ptr<VM>> vms;
+        for (std::size_t i = 0; i < isolates; ++i) {
+            vms.push_back(std::make_unique<VM>());
+        }
+        std::atomic<std::size_t> ok { 0 };
+        testing::internal::CaptureStdout();
+        {
+            std::vector<std::jthread> threads;
+            for (auto& vm : vms) {
+                threads.emplace_back([&ok, &program, &vm] {
+                    for (int run = 0; run < 3; ++run) {
+                        ok += vm->run(program) == InterpretResult::Ok;
+                    }
+                });
+            }
+        }
+        const auto output = testing::internal::GetCapturedStdout();
+        EXPECT_EQ(ok.load(), isolates * 3);
+        // the prints of the threads interleave, but every isolate prints the same two lines
+        std::size_t sums = 0;
+        std::size_t equal = 0;
+        std::istringstream lines(output);
+        for (std::string line; std::getline(lines, line);) {
+            sums += line == "1999000";
+            equal += line == "true";
+        }
+        EXPECT_EQ(sums, isolates * 3);
+        EXPECT_EQ(equal, isolates * 3);
+
+        // every isolate runs the shared chunk in place and keeps the program for the strings its globals hold
+        EXPECT_EQ(program.use_count(), static_cast<long>(2 * isolates + 1));
+    }
+}
+
+TEST(vm, program_strings_are_shared_with_the_vm) {
+    std::string diagnostics;
+    auto program = Program::compile(R"(var greeting = "hello"; var PI = PI * 2;)", diagnostics);
+    ASSERT_NE(program, nullptr) << diagnostics;
+    const auto code = program->chunk().code;
+
+    VM vm;
+    std::string output;
+    vm.printTo(output);
+    ASSERT_EQ(vm.run(program), InterpretResult::Ok);
+    ASSERT_EQ(vm.run(program), InterpretResult::Ok);
+    // running the program neither copies nor changes its chunk
+    EXPECT_EQ(program->chunk().code, code);
+    EXPECT_TRUE(program->chunk().globalNames.front()->permanent);
+
+    // the globals still reference the strings of the program after it was dropped
+    program.reset();
+    vm.collectGarbage();
+    EXPECT_EQ(vm.interpret(R"(print greeting == "hello"; print greeting + "!"; print PI;)"), InterpretResult::Ok);
+    EXPECT_EQ(output, "true\nhello!\n12.566370614359172\n");
+}
+
+TEST(batch_runner, runs_every_script_in_a_fresh_vm) {
+    const auto directory = std::filesystem::temp_directory_path() / "bytecode_vm_batch";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory / "nested");
+
+    for (int i = 0; i < 24; ++i) {
+        std::ofstream(directory / fmt::format("script{:02}.lox", i)) << fmt::format("var x = {};\nprint x * 2;\nprint \"done\";", i);
+    }
+    // every script gets a fresh VM, so `x` of the other scripts is not defined here
+    std::ofstream(directory / "nested" / "undefined.lox") << "print \"before\";\nprint x;";
+    std::ofstream(directory / "nested" / "broken.lox") << "print (;";
+    std::ofstream(directory / "notes.txt") << "print 1;";
+
+    const auto paths = findScripts(directory);
+    ASSERT_EQ(paths.size(), 26);
+    EXPECT_EQ(paths[0], directory / "nested" / "broken.lox");
 
+    testing::internal::CaptureStdout();
+    testing::internal::CaptureStderr();
+    const auto results = runScripts(paths, CompileOptions { .threads { 4 } });
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "");
+    EXPECT_EQ(testing::internal::GetCapturedStderr(), "");
 
+    ASSERT_EQ(results.size(), paths.size());
+    EXPECT_EQ(results[0].result, InterpretResult::CompileError);
+    EXPECT_EQ(results[0].diagnostics, "[line 1] Error at ';': Expect expression.\n");
+    EXPECT_EQ(results[1].result, InterpretResult::RuntimeError);
+    EXPECT_EQ(results[1].output, "before\n");
+    EXPECT_EQ(results[1].diagnostics, "Undefined variable 'x'[line 2] in script\n");
+    for (std::size_t i = 2; i < results.size(); ++i) {
+        EXPECT_EQ(results[i].path, paths[i]);
+        EXPECT_EQ(results[i].result, InterpretResult::Ok);
+        EXPECT_EQ(results[i].output, fmt::format("{}\ndone\n", (i - 2) * 2));
+        EXPECT_EQ(results[i].diagnostics, "");
+    }
+
+    const auto json = resultsToJson(std::span(results).subspan(1, 2));
+    EXPECT_EQ(json, fmt::format("{{\"scripts\": [\n"
+                                "  {{\"path\": \"{}\", \"status\": \"runtime_error\", \"wall_time_us\": {}, \"stdout\": \"before\\n\", "
+                                "\"stderr\": \"Undefined variable 'x'[line 2] in script\\n\"}},\n"
+                                "  {{\"path\": \"{}\", \"status\": \"ok\", \"wall_time_us\": {}, \"stdout\": \"0\\ndone\\n\", \"stderr\": \"\"}}\n"
+                                "]}}\n",
+                                paths[1].string(), results[1].wallTime.count(), paths[2].string(), results[2].wallTime.count()));
+    EXPECT_EQ(resultsToJson({}), "{\"scripts\": []}\n");
+    std::filesystem::remove_all(directory);
+}
+
+TEST(Heap, collector_frees_unreachable_strings) {
+    VM vm;
+    vm.heap().configure(GCConfig { .initialThreshold { 4096 }, .growthFactor { 2.0 }, .minimumThreshold { 4096 } });
+    testing::internal::CaptureStdout();
+    // every iteration leaves the ropes of the previous string behind as garbage
+    EXPECT_EQ(vm.interpret(R"(
+        var i = 0;
+        var j = 0;
+        var s = "";
+        while (i < 500) {
+            s = "";
+            j = 0;
+            while (j < 100) {
+                s = s + "x";
+                j = j + 1;
+            }
+            i = i + 1;
+        }
+        print s;
+    )"), InterpretResult::Ok);
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), std::string(100, 'x') + "\n");
+
+    const auto& stats = vm.heap().stats();
+    EXPECT_GT(stats.collections, 0);
+    EXPECT_EQ(stats.bytesAllocated, stats.totalBytesAllocated - stats.totalBytesFreed);
+    EXPECT_GT(stats.totalBytesAllocated, 500 * 36 * sizeof(ObjRope));
+    EXPECT_LE(stats.bytesAllocated, 4096 + 1024);
+    EXPECT_LE(stats.lastPause, stats.maxPause);
+}
+
+TEST(Heap, stress_collection_keeps_reachable_objects) {
+    constexpr std::string_view source = R"(
+        var greeting = "hello";
+        var i = 0;
+        {
+            var local = greeting + " ";
+            while (i < 20) {
+                local = local + "!";
+                i = i + 1;
+            }
+            greeting = local + "world";
+        }
+        print greeting + "" == greeting;
+        print greeting;
+    )";
+    for (const auto backend : { Backend::Stack, Backend::Register })
+    for (const auto incremental : { false, true }) {
+        VM vm;
+        vm.heap().configure(GCConfig { .stress { true }, .incremental { incremental }, .stepBudget { 64 } });
+        testing::internal::CaptureStdout();
+        EXPECT_EQ(vm.interpret(source, backend), InterpretResult::Ok);
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), "true\nhello !!!!!!!!!!!!!!!!!!!!world\n");
+        EXPECT_GT(vm.heap().stats().collections, 20);
+
+        // names of globals survive collections, otherwise they would get a new slot
+        vm.collectGarbage();
+        testing::internal::CaptureStdout();
+        EXPECT_EQ(vm.interpret("print i;", backend), InterpretResult::Ok);
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), "20\n");
+    }
+}
+
+TEST(Heap, incremental_collection_stays_within_the_pause_budget) {
+    constexpr std::size_t objects = 2'000'000;
+    constexpr auto budget = std::chrono::microseconds { 4000 };
+
+    Heap heap(GCConfig { .incremental { true }, .pauseBudget { budget } });
+    std::vector<ObjString *> live;
+    for (std::size_t i = 0; i < objects; ++i) {
+        auto *str = heap.copyString(std::to_string(i));
+        if (i % 256 == 0) {
+            live.push_back(str);
+        }
+    }
+    const auto bytesBefore = heap.stats().bytesAllocated;
+
+    const auto markRoots = [&live](Heap& h) {
+        for (auto *str : live) {
+            h.markObject(str);
+        }
+    };
+    do {
+        heap.step(markRoots);
+        EXPECT_LE(heap.stats().lastPause, budget);
+    } while (heap.collecting());
+
+    // every live string is marked and every string is swept, one step at a time
+    const auto& stats = heap.stats();
+    EXPECT_EQ(stats.collections, 1);
+    EXPECT_GT(stats.steps, 10);
+    EXPECT_LE(stats.maxPause, budget);
+    EXPECT_LT(stats.bytesAllocated, bytesBefore / 128);
+    EXPECT_EQ(heap.copyString("256"), live[1]);
+
+    // the steps the VM takes while concatenating can be bounded by work as well
+    VM vm;
+    vm.heap().configure(GCConfig { .initialThreshold { 4096 }, .minimumThreshold { 4096 }, .incremental { true }, .stepBudget { 16 } });
+    testing::internal::CaptureStdout();
+    EXPECT_EQ(vm.interpret(R"(
+        var s = "";
+        var i = 0;
+        var j = 0;
+        while (i < 200) {
+            s = "";
+            j = 0;
+            while (j < 100) {
+                s = s + "fragment";
+                j = j + 1;
+            }
+            i = i + 1;
+        }
+        print s == s + "";
+    )"), InterpretResult::Ok);
+    EXPECT_EQ(testing::internal::GetCapturedStdout(), "true\n");
+    EXPECT_GT(vm.heap().stats().collections, 0);
+    EXPECT_GT(vm.heap().stats().steps, vm.heap().stats().collections);
+    EXPECT_EQ(vm.heap().stats().maxStepWork, 16);
+}
 
+TEST(vm, repeated_concatenation_builds_a_rope) {
+    constexpr std::string_view source = R"(
+        var s = "";
+        var t = "";
+        var i = 0;
+        while (i < 10000) {
+            s = s + "fragment";
+            t = t + "frag" + "ment";
+            i = i + 1;
+        }
+        print s == t;
+        print s == t + "!";
+        print "ab" + "cd" == "abcd";
+        print s;
+    )";
+    std::string expected = "true\nfalse\ntrue\n";
+    for (int i = 0; i < 10000; ++i) {
+        expected += "fragment";
+    }
+    expected += "\n";
+
+    for (const auto backend : { Backend::Stack, Backend::Register }) {
+        VM vm;
+        testing::internal::CaptureStdout();
+        EXPECT_EQ(vm.interpret(source, backend), InterpretResult::Ok);
+        EXPECT_EQ(testing::internal::GetCapturedStdout(), expected);
+        // copying the whole string on every iteration would allocate hundreds of megabytes
+        EXPECT_LT(vm.heap().stats().totalBytesAllocated, 4 * 1024 * 1024);
+    }
+}
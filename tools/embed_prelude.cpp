@@ -0,0 +1,62 @@
+#include <fmt/format.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include "bytecode_file.h"
+#include "compiler.h"
+
+// Compiles the prelude and writes a translation unit that defines preludeBytecode().
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fmt::print(stderr, "Usage: embed-prelude prelude.lox out.cpp\n");
+        return 84;
+    }
+    const std::filesystem::path input = argv[1];
+    const std::filesystem::path output = argv[2];
+
+    std::ifstream ifs(input);
+    if (not ifs.is_open()) {
+        fmt::print(stderr, "The file: {} does not exists or can not be opened\n", input.string());
+        return 1;
+    }
+    const std::string source((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+
+    Chunk chunk;
+    Heap heap;
+    Globals globals;
+    Compiler compiler(chunk, heap, globals, Backend::Stack, OptimizationLevel::Basic);
+    if (not compiler.compile(source)) {
+        fmt::print(stderr, "The prelude {} does not compile\n", input.string());
+        return 1;
+    }
+    const auto bytes = serializeChunk(chunk, globals);
+
+    std::string array;
+    for (std::size_t i = 0; i < bytes.size(); ++i) {
+        array += fmt::format("{}0x{:02x},", i % 16 == 0 ? "\n    " : " ", bytes[i]);
+    }
+
+    std::ofstream ofs(output, std::ios::trunc);
+    ofs << fmt::format(R"(// Generated by embed-prelude from {}, do not edit.
+#include <array>
+#include "prelude.h"
+
+namespace {{
+
+constexpr std::array<std::uint8_t, {}> PRELUDE {{{}
+}};
+
+}} // namespace
+
+std::span<const std::uint8_t> preludeBytecode() {{
+    return PRELUDE;
+}}
+)", input.filename().string(), bytes.size(), array);
+
+    if (not ofs.good()) {
+        fmt::print(stderr, "The file: {} can not be written\n", output.string());
+        return 1;
+    }
+    return 0;
+}